@@ -24,12 +24,14 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libunecm.h"
@@ -67,12 +69,57 @@ static int ecm_read_tag(int fd, uint32_t *count, uint8_t *type, off_t *pos)
 
 static void usage(void)
 {
-        printf("Usage: ecm-index <file>\n");
+        printf("Usage: ecm-index [-v|--verify] [-j|--threads=<num>] <file>\n");
+}
+
+/* Decode the whole file and check it against the EDC at the end of the
+ * file. The file must already have an index.
+ */
+static int verify(const char *file, int threads)
+{
+        struct ecm *ecm;
+        struct timespec start, end;
+        double secs;
+        off_t offset, size;
+        int ret;
+
+        ecm = ecm_open_file(AT_FDCWD, file);
+        if (ecm == NULL) {
+                printf("Failed to open %s, is it indexed?\n", file);
+                return 1;
+        }
+
+        printf("Verifying %s using %d threads\n", file, threads);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size = ecm_get_file_size(ecm);
+        ret = ecm_verify(ecm, threads, &offset);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ecm_close_file(ecm);
+
+        secs = (end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) / 1e9;
+        switch (ret) {
+        case ECM_VERIFY_OK:
+                printf("%s: OK, %jd bytes in %.2f seconds (%.1f MB/s)\n",
+                       file, (intmax_t)size, secs,
+                       secs > 0 ? size / secs / 1000000 : 0);
+                return 0;
+        case ECM_VERIFY_READ_ERROR:
+                printf("%s: CORRUPT, unreadable data at offset %jd\n",
+                       file, (intmax_t)offset);
+                return 1;
+        case ECM_VERIFY_NO_MEMORY:
+                printf("Out of memory\n");
+                return 1;
+        default:
+                printf("%s: CORRUPT, EDC mismatch\n", file);
+                return 1;
+        }
 }
 
 static uint32_t index_size;
 
-static void add_to_index(int fd, off_t upos, uint32_t usize, off_t cpos)
+static void add_to_index(int fd, off_t upos, off_t usize, off_t cpos)
 {
         static off_t next;
         
@@ -107,13 +154,48 @@ int main(int argc, char *argv[])
         char *ofile = NULL;
         uint8_t magic[4];
         off_t upos, cpos;
-        
-        if (argc != 2) {
+        int c, opt_idx = 0, do_verify = 0;
+        int threads = 0;
+        static struct option long_opts[] = {
+                { "help", no_argument, 0, '?' },
+                { "threads", required_argument, 0, 'j' },
+                { "verify", no_argument, 0, 'v' },
+                { NULL, 0, 0, 0 }
+        };
+
+        while ((c = getopt_long(argc, argv, "?hj:v", long_opts,
+                    &opt_idx)) > 0) {
+                switch (c) {
+                case 'h':
+                case '?':
+                        usage();
+                        exit(0);
+                case 'j':
+                        threads = atoi(optarg);
+                        break;
+                case 'v':
+                        do_verify = 1;
+                        break;
+                }
+        }
+
+        if (optind != argc - 1) {
                 usage();
                 exit(1);
         }
+        /* -j0 or no -j, one thread per cpu */
+        if (threads <= 0) {
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (threads <= 0) {
+                threads = 1;
+        }
+
+        if (do_verify) {
+                return verify(argv[optind], threads);
+        }
 
-        if ((ifd = open(argv[1], O_RDONLY)) == -1) {
+        if ((ifd = open(argv[optind], O_RDONLY)) == -1) {
                 printf("Failed to open ECM file : %s\n", strerror(errno));
                 exit(1);
         }
@@ -123,7 +205,7 @@ int main(int argc, char *argv[])
                 exit(1);
         }
 
-        asprintf(&ofile, "%s.edi", argv[1]);
+        asprintf(&ofile, "%s.edi", argv[optind]);
         if ((ofd = open(ofile, O_CREAT|O_WRONLY, 0644)) == -1) {
                 printf("Failed to create index file %s : %s\n",
                        ofile, strerror(errno));
@@ -161,25 +243,25 @@ int main(int argc, char *argv[])
                         cpos += count;
                         break;
                 case BLOCK_MODE_1:
-                        add_to_index(ofd, upos, 2352 * count, current);
-                        upos += 2352 * count;
-                        cpos += 0x803 * count;
+                        add_to_index(ofd, upos, (off_t)2352 * count, current);
+                        upos += (off_t)2352 * count;
+                        cpos += (off_t)0x803 * count;
                         break;
                 case BLOCK_MODE_2_FORM_1:
-                        add_to_index(ofd, upos, 2336 * count, current);
-                        upos += 2336 * count;
-                        cpos += 0x804 * count;
+                        add_to_index(ofd, upos, (off_t)2336 * count, current);
+                        upos += (off_t)2336 * count;
+                        cpos += (off_t)0x804 * count;
                         break;
                 case BLOCK_MODE_2_FORM_2:
-                        add_to_index(ofd, upos, 2336 * count, current);
-                        upos += 2336 * count;
-                        cpos += 0x918 * count;
+                        add_to_index(ofd, upos, (off_t)2336 * count, current);
+                        upos += (off_t)2336 * count;
+                        cpos += (off_t)0x918 * count;
                         break;
                 }
         }
+        printf("Wrote %u entries to index\n", index_size);
         index_size = htole32(index_size);
         pwrite(ofd, &index_size, sizeof(uint32_t), 0);
-        printf("Wrote %d entries to index\n", index_size);
                
         free(ofile);
         close(ifd);
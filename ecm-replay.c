@@ -0,0 +1,557 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/***************************************************************************/
+/*
+ * Program to replay a trace recorded by fuse-unecm --trace
+ *
+ * The reads are issued either straight to libunecm, with the ECM files
+ * taken from the backing directory, or to the files of a mounted
+ * fuse-unecm. By default the original timing is kept, each request is
+ * issued when it was issued in the trace, with -a requests are issued as
+ * fast as possible. The requests are replayed one at a time and in the
+ * order they were recorded, so a replay is the same every time.
+ *
+ * With -p every open of the trace gets a thread of its own, which issues
+ * the requests of that open at their recorded times. Requests that ran at
+ * the same time in the original run then do so again, but the order they
+ * finish in, and so the replay, is no longer the same every time.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ecm-trace.h"
+#include "libunecm.h"
+
+/* a record of the trace */
+struct request {
+        struct request *next;
+        struct ecm_trace_record r;
+        char *path;             /* and the names of an OPEN */
+        char *ecm;
+};
+
+/* an open of the trace, indexed by its handle */
+struct handle {
+        struct ecm *ecm;
+        int cooked;
+        int fd;
+
+        /* with -p, the requests of the open wait here for its thread */
+        pthread_t thread;
+        pthread_cond_t cond;
+        struct request *head, **tail;
+        struct handle *next;    /* in the list of threads */
+};
+
+struct latencies {
+        uint32_t *us;
+        size_t count;
+        size_t size;
+};
+
+static struct handle **handles;
+static uint32_t nhandles;
+static struct handle *threads;  /* that have been started, with -p */
+
+/* requests are handed to their threads this far ahead of their time */
+#define AHEAD_US 100000
+
+static int dir_fd = -1;         /* backing directory, -d */
+static int mnt_fd = -1;         /* mount point, -m */
+static int uring_entries;
+static int direct_blocks;
+static int fast;                /* -a */
+static uint64_t start;
+
+/* the queues of the threads and the results below */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct latencies recorded, replayed;
+static uint64_t bytes, reads, errors, late;
+
+/* of all the libunecm handles, added up as they are released */
+static struct ecm_stats totals;
+
+static void usage(void)
+{
+        printf("Usage: ecm-replay [-d|--directory=<backing directory>] "
+               "[-m|--mountpoint=<mountpoint>] [-a|--fast] "
+               "[-j|--decode-threads=<threads>] [-u|--io-uring=<depth>] "
+               "[-D|--direct-io=<blocks>] [-p|--parallel] <trace>\n");
+}
+
+static uint64_t now_us(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_latency(struct latencies *l, uint32_t us)
+{
+        if (l->count == l->size) {
+                uint32_t *n;
+
+                l->size = l->size ? 2 * l->size : 4096;
+                n = realloc(l->us, l->size * sizeof(uint32_t));
+                if (n == NULL) {
+                        return;
+                }
+                l->us = n;
+        }
+        l->us[l->count++] = us;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+        uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static void print_latencies(const char *what, struct latencies *l)
+{
+        if (l->count == 0) {
+                return;
+        }
+        qsort(l->us, l->count, sizeof(uint32_t), cmp_u32);
+        printf("%-9s latency us: p50 %u  p90 %u  p99 %u  max %u\n", what,
+               l->us[l->count / 2], l->us[l->count * 9 / 10],
+               l->us[l->count * 99 / 100], l->us[l->count - 1]);
+}
+
+static struct handle *get_handle(uint32_t handle)
+{
+        if (handle >= nhandles) {
+                uint32_t n = handle + 1024;
+                struct handle **h;
+
+                h = realloc(handles, n * sizeof(struct handle *));
+                if (h == NULL) {
+                        return NULL;
+                }
+                memset(h + nhandles, 0,
+                       (n - nhandles) * sizeof(struct handle *));
+                handles = h;
+                nhandles = n;
+        }
+        /* allocated one by one, the threads keep pointers to them */
+        if (handles[handle] == NULL) {
+                handles[handle] = calloc(1, sizeof(struct handle));
+                if (handles[handle] == NULL) {
+                        return NULL;
+                }
+                handles[handle]->fd = -1;
+        }
+        return handles[handle];
+}
+
+static void replay_open(struct handle *h, const char *path, const char *ecm,
+                        int flags)
+{
+        h->ecm = NULL;
+        h->fd = -1;
+        h->cooked = flags & ECM_TRACE_COOKED;
+
+        if (mnt_fd != -1) {
+                h->fd = openat(mnt_fd, path, O_RDONLY);
+                if (h->fd == -1) {
+                        printf("Failed to open %s : %s\n", path,
+                               strerror(errno));
+                }
+                return;
+        }
+        if (ecm[0] == 0) {
+                h->fd = openat(dir_fd, path, O_RDONLY);
+                return;
+        }
+        h->ecm = ecm_open_file(dir_fd, ecm);
+        if (h->ecm == NULL) {
+                printf("Failed to open ECM file %s\n", ecm);
+                return;
+        }
+        if (direct_blocks) {
+                ecm_set_direct_io(h->ecm, direct_blocks);
+        }
+        if (uring_entries) {
+                ecm_set_io_uring(h->ecm, uring_entries);
+        }
+}
+
+static ssize_t replay_read(struct handle *h, char *buf, size_t size,
+                           off_t offset)
+{
+        if (h->ecm && h->cooked) {
+                return ecm_read_cooked(h->ecm, buf, offset, size);
+        }
+        if (h->ecm) {
+                return ecm_read(h->ecm, buf, offset, size);
+        }
+        if (h->fd != -1) {
+                return pread(h->fd, buf, size, offset);
+        }
+        errno = EBADF;
+        return -1;
+}
+
+static void replay_release(struct handle *h)
+{
+        if (h->ecm) {
+                struct ecm_stats s;
+
+                ecm_get_stats(h->ecm, &s);
+                pthread_mutex_lock(&mutex);
+                totals.sectors += s.sectors;
+                totals.ecm_reads += s.ecm_reads;
+                totals.ecm_bytes += s.ecm_bytes;
+                totals.shared += s.shared;
+                totals.cache_hits += s.cache_hits;
+                totals.cache_misses += s.cache_misses;
+                pthread_mutex_unlock(&mutex);
+                ecm_close_file(h->ecm);
+        }
+        if (h->fd != -1) {
+                close(h->fd);
+        }
+        h->ecm = NULL;
+        h->fd = -1;
+}
+
+/* Issue a request at its time in the trace, or right away with -a */
+static void replay(struct handle *h, struct request *q, char **buf,
+                   size_t *buf_size)
+{
+        uint32_t size = le32toh(q->r.size);
+        uint64_t when = le64toh(q->r.time);
+        uint64_t t;
+        ssize_t ret;
+        int wrong;
+
+        if (!fast) {
+                t = now_us() - start;
+                if (t < when) {
+                        usleep(when - t);
+                } else if (t > when + 1000) {
+                        pthread_mutex_lock(&mutex);
+                        late++;
+                        pthread_mutex_unlock(&mutex);
+                }
+        }
+
+        switch (q->r.op) {
+        case ECM_TRACE_OPEN:
+                replay_open(h, q->path, q->ecm, q->r.flags);
+                break;
+        case ECM_TRACE_READ:
+                if (size > *buf_size) {
+                        free(*buf);
+                        *buf_size = size;
+                        *buf = malloc(*buf_size);
+                        if (*buf == NULL) {
+                                printf("Out of memory\n");
+                                exit(1);
+                        }
+                }
+                t = now_us();
+                ret = replay_read(h, *buf, size, le64toh(q->r.offset));
+                wrong = (ret < 0 ? -errno : ret) !=
+                        (int32_t)le32toh(q->r.result);
+                t = now_us() - t;
+
+                pthread_mutex_lock(&mutex);
+                add_latency(&replayed, t);
+                add_latency(&recorded, le32toh(q->r.latency));
+                errors += wrong;
+                if (ret > 0) {
+                        bytes += ret;
+                }
+                reads++;
+                pthread_mutex_unlock(&mutex);
+                break;
+        case ECM_TRACE_RELEASE:
+                replay_release(h);
+                break;
+        }
+}
+
+/* With -p, replays the requests of one open until its RELEASE */
+static void *handle_thread(void *arg)
+{
+        struct handle *h = arg;
+        struct request *q;
+        size_t buf_size = 0;
+        char *buf = NULL;
+        int op;
+
+        do {
+                pthread_mutex_lock(&mutex);
+                while (h->head == NULL) {
+                        pthread_cond_wait(&h->cond, &mutex);
+                }
+                q = h->head;
+                h->head = q->next;
+                if (h->head == NULL) {
+                        h->tail = &h->head;
+                }
+                pthread_mutex_unlock(&mutex);
+
+                replay(h, q, &buf, &buf_size);
+                op = q->r.op;
+                free(q);
+        } while (op != ECM_TRACE_RELEASE);
+        free(buf);
+        return NULL;
+}
+
+/* Hand a request to the thread of its open, which is started by the first
+ * request
+ */
+static void queue(struct handle *h, struct request *req)
+{
+        size_t path_len = strlen(req->path) + 1;
+        size_t ecm_len = strlen(req->ecm) + 1;
+        struct request *q;
+        int err;
+
+        q = malloc(sizeof(struct request) + path_len + ecm_len);
+        if (q == NULL) {
+                printf("Out of memory\n");
+                exit(1);
+        }
+        q->next = NULL;
+        q->r = req->r;
+        q->path = (char *)(q + 1);
+        q->ecm = q->path + path_len;
+        memcpy(q->path, req->path, path_len);
+        memcpy(q->ecm, req->ecm, ecm_len);
+
+        if (h->tail == NULL) {
+                h->tail = &h->head;
+                pthread_cond_init(&h->cond, NULL);
+                err = pthread_create(&h->thread, NULL, handle_thread, h);
+                if (err) {
+                        printf("Failed to start a thread : %s\n",
+                               strerror(err));
+                        exit(1);
+                }
+                h->next = threads;
+                threads = h;
+        }
+        pthread_mutex_lock(&mutex);
+        *h->tail = q;
+        h->tail = &q->next;
+        pthread_cond_signal(&h->cond);
+        pthread_mutex_unlock(&mutex);
+}
+
+int main(int argc, char *argv[])
+{
+        struct request q;
+        char path[PATH_MAX], ecm[PATH_MAX], magic[8];
+        uint64_t end;
+        size_t buf_size = 0;
+        char *buf = NULL;
+        struct handle *h;
+        uint32_t i;
+        FILE *fh;
+        int c, opt_idx = 0, parallel = 0, decode_threads = 0;
+        static struct option long_opts[] = {
+                { "help", no_argument, 0, '?' },
+                { "fast", no_argument, 0, 'a' },
+                { "directory", required_argument, 0, 'd' },
+                { "direct-io", required_argument, 0, 'D' },
+                { "decode-threads", required_argument, 0, 'j' },
+                { "mountpoint", required_argument, 0, 'm' },
+                { "parallel", no_argument, 0, 'p' },
+                { "io-uring", required_argument, 0, 'u' },
+                { NULL, 0, 0, 0 }
+        };
+
+        while ((c = getopt_long(argc, argv, "?had:D:j:m:pu:", long_opts,
+                    &opt_idx)) > 0) {
+                switch (c) {
+                case 'h':
+                case '?':
+                        usage();
+                        exit(0);
+                case 'a':
+                        fast = 1;
+                        break;
+                case 'd':
+                        dir_fd = open(optarg, O_DIRECTORY);
+                        if (dir_fd == -1) {
+                                printf("Failed to open %s : %s\n", optarg,
+                                       strerror(errno));
+                                exit(1);
+                        }
+                        break;
+                case 'D':
+                        direct_blocks = atoi(optarg);
+                        break;
+                case 'j':
+                        decode_threads = atoi(optarg);
+                        break;
+                case 'm':
+                        mnt_fd = open(optarg, O_DIRECTORY);
+                        if (mnt_fd == -1) {
+                                printf("Failed to open %s : %s\n", optarg,
+                                       strerror(errno));
+                                exit(1);
+                        }
+                        break;
+                case 'p':
+                        parallel = 1;
+                        break;
+                case 'u':
+                        uring_entries = atoi(optarg);
+                        break;
+                }
+        }
+
+        if (optind != argc - 1 || (dir_fd == -1) == (mnt_fd == -1)) {
+                usage();
+                exit(1);
+        }
+        if (decode_threads && ecm_set_decode_threads(decode_threads)) {
+                printf("Failed to start decode threads\n");
+        }
+
+        fh = fopen(argv[optind], "r");
+        if (fh == NULL) {
+                printf("Failed to open trace %s : %s\n", argv[optind],
+                       strerror(errno));
+                exit(1);
+        }
+        if (fread(magic, 8, 1, fh) != 1 ||
+            memcmp(magic, ECM_TRACE_MAGIC, 8)) {
+                printf("%s is not a fuse-unecm trace\n", argv[optind]);
+                exit(1);
+        }
+
+        start = now_us();
+        q.path = path;
+        q.ecm = ecm;
+        while (fread(&q.r, sizeof(q.r), 1, fh) == 1) {
+                uint16_t path_len = le16toh(q.r.path_len);
+                uint16_t ecm_len = le16toh(q.r.ecm_len);
+                uint32_t handle = le32toh(q.r.handle);
+                uint64_t when = le64toh(q.r.time);
+                uint64_t t;
+
+                if (path_len >= PATH_MAX || ecm_len >= PATH_MAX ||
+                    fread(path, 1, path_len, fh) != path_len ||
+                    fread(ecm, 1, ecm_len, fh) != ecm_len) {
+                        printf("Trace is truncated\n");
+                        break;
+                }
+                path[path_len] = 0;
+                ecm[ecm_len] = 0;
+
+                h = get_handle(handle);
+                if (h == NULL) {
+                        printf("Out of memory\n");
+                        exit(1);
+                }
+
+                if (!parallel) {
+                        replay(h, &q, &buf, &buf_size);
+                } else {
+                        /* only read the trace a little ahead */
+                        t = now_us() - start;
+                        if (!fast && t + AHEAD_US < when) {
+                                usleep(when - t - AHEAD_US);
+                        }
+                        queue(h, &q);
+                }
+                if (q.r.op == ECM_TRACE_RELEASE) {
+                        /* the thread frees it once it is done */
+                        if (!parallel) {
+                                free(h);
+                        }
+                        handles[handle] = NULL;
+                }
+        }
+
+        /* opens that the trace does not release */
+        memset(&q.r, 0, sizeof(q.r));
+        q.r.op = ECM_TRACE_RELEASE;
+        q.r.time = htole64(now_us() - start);
+        for (i = 0; i < nhandles; i++) {
+                h = handles[i];
+                if (h && h->tail) {
+                        queue(h, &q);
+                } else if (h) {
+                        replay_release(h);
+                        free(h);
+                }
+        }
+        free(handles);
+        while (threads) {
+                h = threads;
+                threads = h->next;
+                pthread_join(h->thread, NULL);
+                pthread_cond_destroy(&h->cond);
+                free(h);
+        }
+        end = now_us();
+        fclose(fh);
+
+        printf("%" PRIu64 " reads, %" PRIu64 " bytes in %.2f seconds "
+               "(%.1f MB/s)\n", reads, bytes, (end - start) / 1e6,
+               end > start ? (double)bytes / (end - start) : 0);
+        if (errors) {
+                printf("%" PRIu64 " reads returned something else than "
+                       "in the trace\n", errors);
+        }
+        if (late) {
+                printf("%" PRIu64 " requests were issued more than 1 ms "
+                       "late\n", late);
+        }
+        print_latencies("recorded", &recorded);
+        print_latencies("replayed", &replayed);
+        if (dir_fd != -1) {
+                printf("%" PRIu64 " sectors regenerated, %" PRIu64 " reads "
+                       "of %" PRIu64 " bytes of ECM data, %" PRIu64
+                       " shared\n", totals.sectors, totals.ecm_reads,
+                       totals.ecm_bytes, totals.shared);
+                if (totals.cache_hits + totals.cache_misses) {
+                        printf("block cache: %" PRIu64 " hits, %" PRIu64
+                               " misses\n", totals.cache_hits,
+                               totals.cache_misses);
+                }
+        }
+
+        free(buf);
+        return errors != 0;
+}
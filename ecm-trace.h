@@ -0,0 +1,38 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+ * Access traces written by fuse-unecm --trace and read by ecm-replay.
+ *
+ * A trace is an ECM_TRACE_MAGIC header followed by records. Every record
+ * is a struct ecm_trace_record, all fields little endian, followed by
+ * 'path_len' bytes of path and 'ecm_len' bytes of ECM file name, neither
+ * of them NUL terminated. Only OPEN records carry names:
+ *
+ *   path   what was opened, relative to the mount point
+ *   ecm    the ECM data it is served from, relative to the backing
+ *          directory, empty for files that are passed through
+ *
+ * READ and RELEASE records refer to the OPEN record with the same handle.
+ */
+
+#define ECM_TRACE_MAGIC "ECMTRACE"
+
+#define ECM_TRACE_OPEN    1
+#define ECM_TRACE_READ    2
+#define ECM_TRACE_RELEASE 3
+
+/* flags of an OPEN */
+#define ECM_TRACE_COOKED  1
+
+struct ecm_trace_record {
+        uint64_t time;          /* us since the start of the trace */
+        uint64_t offset;
+        uint32_t handle;
+        uint32_t size;
+        int32_t result;         /* bytes read, or -errno */
+        uint32_t latency;       /* us spent serving the request */
+        uint8_t op;
+        uint8_t flags;
+        uint16_t path_len;
+        uint16_t ecm_len;
+        uint16_t pad;
+};
@@ -0,0 +1,151 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/***************************************************************************/
+/*
+ * Program to encode a raw disk image to ECM, together with its index
+ *
+ * The sectors are classified and encoded by several threads, the number
+ * of cpus by default, while the .ecm is written out in order. The .edi
+ * index is written from what was encoded, without reading the .ecm back.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libunecm.h"
+
+static void usage(void)
+{
+        printf("Usage: ecm [-j|--threads=<threads>] <image> [<ecm file>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+        struct timespec start, end;
+        struct ecm_map *map;
+        char *ecm_file, *idx_file;
+        uint8_t *index;
+        size_t index_len;
+        off_t raw_size, ecm_size;
+        double secs;
+        int ifd, ofd, c, opt_idx = 0;
+        int threads = 0;
+        static struct option long_opts[] = {
+                { "help", no_argument, 0, '?' },
+                { "threads", required_argument, 0, 'j' },
+                { NULL, 0, 0, 0 }
+        };
+
+        while ((c = getopt_long(argc, argv, "?hj:", long_opts,
+                    &opt_idx)) > 0) {
+                switch (c) {
+                case 'h':
+                case '?':
+                        usage();
+                        exit(0);
+                case 'j':
+                        threads = atoi(optarg);
+                        break;
+                }
+        }
+
+        if (optind != argc - 1 && optind != argc - 2) {
+                usage();
+                exit(1);
+        }
+        /* -j0 or no -j, one thread per cpu */
+        if (threads <= 0) {
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (threads <= 0) {
+                threads = 1;
+        }
+        if (optind == argc - 2) {
+                ecm_file = strdup(argv[optind + 1]);
+        } else {
+                asprintf(&ecm_file, "%s.ecm", argv[optind]);
+        }
+        asprintf(&idx_file, "%s.edi", ecm_file);
+
+        if ((ifd = open(argv[optind], O_RDONLY)) == -1) {
+                printf("Failed to open %s : %s\n", argv[optind],
+                       strerror(errno));
+                exit(1);
+        }
+        if ((ofd = open(ecm_file, O_CREAT|O_TRUNC|O_WRONLY, 0644)) == -1) {
+                printf("Failed to create %s : %s\n", ecm_file,
+                       strerror(errno));
+                exit(1);
+        }
+
+        printf("Encoding %s using %d threads\n", argv[optind], threads);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        map = ecm_encode(ifd, ofd, threads);
+        close(ifd);
+        if (map == NULL || close(ofd)) {
+                printf("Failed to encode %s : %s\n", argv[optind],
+                       strerror(errno));
+                unlink(ecm_file);
+                exit(1);
+        }
+
+        index = ecm_map_index(map, &index_len);
+        if (index == NULL) {
+                printf("Failed to create index : %s\n", strerror(errno));
+                unlink(ecm_file);
+                exit(1);
+        }
+        if ((ofd = open(idx_file, O_CREAT|O_TRUNC|O_WRONLY, 0644)) == -1 ||
+            write(ofd, index, index_len) != (ssize_t)index_len ||
+            close(ofd)) {
+                printf("Failed to write index file %s : %s\n", idx_file,
+                       strerror(errno));
+                unlink(ecm_file);
+                unlink(idx_file);
+                exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        raw_size = ecm_map_raw_size(map);
+        ecm_size = ecm_map_size(map);
+        secs = (end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Wrote %s, %jd bytes (%.1f%% of %jd), and %s\n", ecm_file,
+               (intmax_t)ecm_size,
+               raw_size ? 100.0 * ecm_size / raw_size : 0.0,
+               (intmax_t)raw_size, idx_file);
+        printf("Encoded %jd bytes in %.2f seconds (%.1f MB/s)\n",
+               (intmax_t)raw_size, secs,
+               secs > 0 ? raw_size / secs / 1000000 : 0);
+
+        free(index);
+        ecm_map_free(map);
+        free(ecm_file);
+        free(idx_file);
+        return 0;
+}
@@ -30,21 +30,29 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/vfs.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "ecm-trace.h"
 #include "libunecm.h"
-#include <tdb.h>
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
@@ -60,355 +68,3490 @@
         }                                                       \
 }
 
+struct trace;
+
 struct file {
         struct ecm *ecm;
+        int cooked;
         int fd;
+        uint64_t cache_key;     /* identity of the image in the chunk cache */
+        uint64_t shm_key;       /* and in the shared memory cache */
+        uint64_t sched_key;     /* and in the I/O scheduler */
+        off_t next_offset;      /* where a sequential read would start */
+        struct trace *trace;    /* reads recorded since the open */
+        uint32_t handle;        /* identifies the open in --trace output */
+        struct ecm_map *map;    /* encoded view of the raw image in fd */
+        uint8_t *index;         /* and the .edi for it */
+        size_t index_len;
 };
 
 static char *logfile;
 
-static struct tdb_context *nu_tdb;
-static struct tdb_context *filesize_tdb;
+/* A hash table from paths to a 64 bit value, optionally backed by a log
+ * file so that it survives remounts. Lookups take a shared lock and copy
+ * out the value, so the warmer threads and the fuse threads can hit the
+ * table at the same time without allocating anything.
+ */
+struct path_entry {
+        struct path_entry *next;
+        uint64_t hash;
+        int64_t value;
+        size_t len;
+        char key[];
+};
+
+struct path_cache {
+        pthread_rwlock_t lock;
+        struct path_entry **buckets;
+        size_t size;            /* number of buckets, a power of two */
+        size_t count;
+        size_t limit;           /* most entries to keep, 0 for no limit */
+        size_t evict;           /* next bucket to empty when at the limit */
+        int fd;                 /* log file, or -1 */
+        size_t records;         /* records in the log file */
+};
+
+/* whether a path needs to be uncompressed */
+static struct path_cache nu_cache = {
+        .lock = PTHREAD_RWLOCK_INITIALIZER,
+        .limit = 1 << 20,
+        .fd = -1,
+};
+
+/* sizes of the images and the cooked views, kept in ~/.fuse-unecm */
+static struct path_cache size_cache = {
+        .lock = PTHREAD_RWLOCK_INITIALIZER,
+        .fd = -1,
+};
+
+/* number of warmer threads to start at mount time, 0 disables warming */
+static int warm_threads;
+
+/* queue depth for reading ECM files through io_uring, 0 to use pread */
+static int uring_entries;
+
+/* blocks of ECM data each open image keeps when reading the ECM files
+ * with O_DIRECT, 0 to read them through the page cache
+ */
+static int direct_blocks;
+
+/* threads that help regenerate the sectors of large reads, 0 for none */
+static int decode_threads;
+
+/* directory and size limit of the persistent chunk cache, 0 disables it */
+static char *cache_dir;
+static off_t cache_size;
+
+/* where requests are recorded with --trace, NULL if they are not */
+static FILE *trace_file;
+static uint64_t trace_start;            /* us */
+static uint32_t trace_handles;
+
+/* directory of the recorded access traces, NULL if not prefetching */
+static char *trace_dir;
+
+/* size of the decoded data cache shared by all mounts, 0 to not use it */
+static off_t shm_size;
+
+/* serve requests from several threads instead of running fuse with -s */
+static int multi_threaded;
+
+/* most reads of ECM files the scheduler lets run at once, 0 disables it */
+static int queue_depth = 16;
+
+/* also present a cooked <name>.iso next to each uncompressed image */
+static int cooked_view;
+
+/* present raw <name>.bin images as <name>.bin.ecm and <name>.bin.ecm.edi
+ * instead of uncompressing ECM files
+ */
+static int reverse;
+
+/* directory of the sector maps of raw images in reverse mode */
+static char *map_dir;
+
+/* time of the most recent request from the kernel, in ms */
+static uint64_t last_request;
 
 /* descriptor for the underlying directory */
 static int dir_fd;
 
+/* channel to the kernel, for invalidating what it has cached */
+static struct fuse_chan *fuse_ch;
+
+static int watch_dir(const char *path);
+
+static uint64_t now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Called at the start of every request from the kernel so that the
+ * background warmer can back off while the filesystem is in use.
+ */
+static void note_request(void)
+{
+        if (warm_threads) {
+                __atomic_store_n(&last_request, now_ms(), __ATOMIC_RELAXED);
+        }
+}
+
+/*
+ * Path caches.
+ *
+ * The tables start with a few buckets and double whenever they hold more
+ * entries than buckets. The log file of a persistent table is a header
+ * followed by one record per change, each written with a single write()
+ * to a file opened with O_APPEND. It is read back when the table is
+ * loaded and rewritten with only the live entries once most of its
+ * records are stale.
+ */
+#define PATH_CACHE_BUCKETS 64
+#define PATH_LOG_MAGIC "ECMPATH1"
+
+#define PATH_LOG_SET    0
+#define PATH_LOG_DELETE 1
+
+struct path_record {
+        uint16_t len;
+        uint16_t op;
+        uint32_t pad;
+        int64_t value;
+};
+
+static uint64_t fnv64(uint64_t h, const void *data, size_t len)
+{
+        const uint8_t *p = data;
+
+        while (len--) {
+                h = (h ^ *p++) * 1099511628211ULL;
+        }
+        return h;
+}
+
+static struct path_entry **path_cache_find(struct path_cache *pc,
+                                           const char *key, size_t len,
+                                           uint64_t hash)
+{
+        struct path_entry **e;
+
+        if (pc->buckets == NULL) {
+                return NULL;
+        }
+        for (e = &pc->buckets[hash & (pc->size - 1)]; *e; e = &(*e)->next) {
+                if ((*e)->hash == hash && (*e)->len == len &&
+                    !memcmp((*e)->key, key, len)) {
+                        return e;
+                }
+        }
+        return e;
+}
+
+static void path_cache_grow(struct path_cache *pc)
+{
+        struct path_entry **buckets, *e, *next;
+        size_t size = pc->size ? pc->size * 2 : PATH_CACHE_BUCKETS;
+        size_t i;
+
+        buckets = calloc(size, sizeof(struct path_entry *));
+        if (buckets == NULL) {
+                return;
+        }
+        for (i = 0; i < pc->size; i++) {
+                for (e = pc->buckets[i]; e; e = next) {
+                        next = e->next;
+                        e->next = buckets[e->hash & (size - 1)];
+                        buckets[e->hash & (size - 1)] = e;
+                }
+        }
+        free(pc->buckets);
+        pc->buckets = buckets;
+        pc->size = size;
+}
+
+/* Make room for one more entry by emptying buckets in turn */
+static void path_cache_evict(struct path_cache *pc)
+{
+        struct path_entry *e;
+
+        while (pc->count >= pc->limit) {
+                pc->evict = (pc->evict + 1) & (pc->size - 1);
+                while ((e = pc->buckets[pc->evict])) {
+                        pc->buckets[pc->evict] = e->next;
+                        pc->count--;
+                        free(e);
+                }
+        }
+}
+
+static void path_log_append(struct path_cache *pc, uint16_t op,
+                            const char *key, size_t len, int64_t value)
+{
+        char buf[sizeof(struct path_record) + PATH_MAX];
+        struct path_record r = { .len = len, .op = op, .value = value };
+
+        if (pc->fd == -1 || len >= PATH_MAX) {
+                return;
+        }
+        memcpy(buf, &r, sizeof(r));
+        memcpy(buf + sizeof(r), key, len);
+        if (write(pc->fd, buf, sizeof(r) + len) == -1) {
+                LOG("PATH LOG write failed %s\n", strerror(errno));
+        }
+        pc->records++;
+}
+
+/* must be called with the lock held for writing */
+static int path_cache_store(struct path_cache *pc, const char *key,
+                            size_t len, int64_t value)
+{
+        uint64_t hash = fnv64(14695981039346656037ULL, key, len);
+        struct path_entry **b, *e;
+
+        if (pc->count >= pc->size) {
+                path_cache_grow(pc);
+        }
+        b = path_cache_find(pc, key, len, hash);
+        if (b == NULL) {
+                return -1;
+        }
+        if (*b) {
+                (*b)->value = value;
+                return 0;
+        }
+        if (pc->limit && pc->count >= pc->limit) {
+                path_cache_evict(pc);
+                b = path_cache_find(pc, key, len, hash);
+        }
+        e = malloc(sizeof(struct path_entry) + len);
+        if (e == NULL) {
+                return -1;
+        }
+        e->next = NULL;
+        e->hash = hash;
+        e->value = value;
+        e->len = len;
+        memcpy(e->key, key, len);
+        *b = e;
+        pc->count++;
+        return 0;
+}
+
+/* must be called with the lock held for writing */
+static int path_cache_remove(struct path_cache *pc, const char *key,
+                             size_t len)
+{
+        uint64_t hash = fnv64(14695981039346656037ULL, key, len);
+        struct path_entry **b, *e;
+
+        b = path_cache_find(pc, key, len, hash);
+        if (b == NULL || *b == NULL) {
+                return -1;
+        }
+        e = *b;
+        *b = e->next;
+        pc->count--;
+        free(e);
+        return 0;
+}
+
+/* Returns 0 and the value if 'key' is in the cache */
+static int path_cache_get(struct path_cache *pc, const char *key,
+                          int64_t *value)
+{
+        uint64_t hash;
+        struct path_entry **e;
+        size_t len = strlen(key);
+        int ret = -1;
+
+        hash = fnv64(14695981039346656037ULL, key, len);
+        pthread_rwlock_rdlock(&pc->lock);
+        e = path_cache_find(pc, key, len, hash);
+        if (e && *e) {
+                *value = (*e)->value;
+                ret = 0;
+        }
+        pthread_rwlock_unlock(&pc->lock);
+        return ret;
+}
+
+static void path_cache_set(struct path_cache *pc, const char *key,
+                           int64_t value)
+{
+        size_t len = strlen(key);
+
+        pthread_rwlock_wrlock(&pc->lock);
+        if (path_cache_store(pc, key, len, value) == 0) {
+                path_log_append(pc, PATH_LOG_SET, key, len, value);
+        }
+        pthread_rwlock_unlock(&pc->lock);
+}
+
+static void path_cache_delete(struct path_cache *pc, const char *key)
+{
+        size_t len = strlen(key);
+
+        pthread_rwlock_wrlock(&pc->lock);
+        if (path_cache_remove(pc, key, len) == 0) {
+                path_log_append(pc, PATH_LOG_DELETE, key, len, 0);
+        }
+        pthread_rwlock_unlock(&pc->lock);
+}
+
+static void path_cache_clear(struct path_cache *pc)
+{
+        struct path_entry *e;
+        size_t i;
+
+        pthread_rwlock_wrlock(&pc->lock);
+        for (i = 0; i < pc->size; i++) {
+                while ((e = pc->buckets[i])) {
+                        pc->buckets[i] = e->next;
+                        free(e);
+                }
+        }
+        pc->count = 0;
+        if (pc->fd != -1) {
+                if (ftruncate(pc->fd, strlen(PATH_LOG_MAGIC)) == -1) {
+                        LOG("PATH LOG truncate failed %s\n", strerror(errno));
+                }
+                pc->records = 0;
+        }
+        pthread_rwlock_unlock(&pc->lock);
+}
+
+/* Write a fresh log with only the live entries and switch to it */
+static int path_log_compact(struct path_cache *pc, const char *file)
+{
+        char tmp[PATH_MAX];
+        struct path_entry *e;
+        int fd, old = pc->fd;
+        size_t i;
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+        fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0600);
+        if (fd == -1) {
+                return -1;
+        }
+        if (write(fd, PATH_LOG_MAGIC, strlen(PATH_LOG_MAGIC)) == -1) {
+                goto failed;
+        }
+        pc->fd = fd;
+        pc->records = 0;
+        for (i = 0; i < pc->size; i++) {
+                for (e = pc->buckets[i]; e; e = e->next) {
+                        path_log_append(pc, PATH_LOG_SET, e->key, e->len,
+                                        e->value);
+                }
+        }
+        if (fsync(fd) == -1 || rename(tmp, file) == -1) {
+                pc->fd = old;
+                goto failed;
+        }
+        close(old);
+        return 0;
+
+failed:
+        close(fd);
+        unlink(tmp);
+        return -1;
+}
+
+/* Load a persistent cache from 'file', creating it if needed */
+static int path_cache_load(struct path_cache *pc, const char *file)
+{
+        size_t magic = strlen(PATH_LOG_MAGIC);
+        struct path_record r;
+        char *buf = NULL;
+        off_t pos;
+        struct stat st;
+        int fd;
+
+        fd = open(file, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+                goto failed;
+        }
+        if (st.st_size) {
+                buf = malloc(st.st_size);
+                if (buf == NULL || pread(fd, buf, st.st_size, 0)
+                    != st.st_size) {
+                        goto failed;
+                }
+        }
+        if (st.st_size < (off_t)magic || memcmp(buf, PATH_LOG_MAGIC, magic)) {
+                /* new, or not ours, start over */
+                if (ftruncate(fd, 0) == -1 ||
+                    write(fd, PATH_LOG_MAGIC, magic) == -1) {
+                        goto failed;
+                }
+                st.st_size = magic;
+        }
+
+        pthread_rwlock_wrlock(&pc->lock);
+        for (pos = magic; pos + (off_t)sizeof(r) <= st.st_size;
+             pos += sizeof(r) + r.len) {
+                memcpy(&r, buf + pos, sizeof(r));
+                if (pos + (off_t)sizeof(r) + r.len > st.st_size) {
+                        break;
+                }
+                if (r.op == PATH_LOG_SET) {
+                        path_cache_store(pc, buf + pos + sizeof(r), r.len,
+                                         r.value);
+                } else {
+                        path_cache_remove(pc, buf + pos + sizeof(r), r.len);
+                }
+                pc->records++;
+        }
+        pc->fd = fd;
+        /* drop a record that was cut short */
+        if (pos != st.st_size && ftruncate(fd, pos) == -1) {
+                pthread_rwlock_unlock(&pc->lock);
+                pc->fd = -1;
+                goto failed;
+        }
+        if (pc->records > 2 * pc->count + 1024) {
+                path_log_compact(pc, file);
+        }
+        pthread_rwlock_unlock(&pc->lock);
+        free(buf);
+        return 0;
+
+failed:
+        free(buf);
+        if (fd != -1) {
+                close(fd);
+        }
+        return -1;
+}
+
+/* The ECM data for <file> is <file>.ecm, or one of the compressed forms of
+ * it that libunecm can read as well.
+ */
+static const char *ecm_suffixes[] = {
+        ".ecm",
+        ".ecm.gz",
+#ifdef HAVE_ZSTD
+        ".ecm.zst",
+#endif
+        NULL
+};
+
+/* length of the ECM data suffix 'name' ends in, or 0 */
+static size_t ecm_suffix_len(const char *name)
+{
+        size_t len = strlen(name), n;
+        int i;
+
+        for (i = 0; ecm_suffixes[i]; i++) {
+                n = strlen(ecm_suffixes[i]);
+                if (len > n && !strcmp(name + len - n, ecm_suffixes[i])) {
+                        return n;
+                }
+        }
+        return 0;
+}
+
+/* Find the ECM data for 'file' relative to 'fd' and store its name */
+static int ecm_data_name(int fd, const char *file, char *name, size_t size)
+{
+        struct stat st;
+        int i;
+
+        for (i = 0; ecm_suffixes[i]; i++) {
+                snprintf(name, size, "%s%s", file, ecm_suffixes[i]);
+                if (fstatat(fd, name, &st, AT_NO_AUTOMOUNT) == 0) {
+                        return 0;
+                }
+        }
+        return -1;
+}
+
 /* This function takes a path to a file and returns true if this needs
  * ecm unpacking.
  * For a file <file> we need to unpack the file if
  *   <file>         does not exist
- *   <file>.ecm     exists
+ *   <file>.ecm     exists, or <file>.ecm.gz or <file>.ecm.zst
  *   <file>.ecm.edi exists
  * In that situation READDIR will just turn a single instance for the name
  * <file> and hide the entries for <file>.ecm and <file>.ecm.edi
  *
- * IF all three files exist, we do not mutate any of the READDIR data
- * and return all three names. Then we just redirect all I/O to the unpacked
- * file. The reason we do not hide the <file>.ecm and <file>.ecm.edi is to make
- * it possible for the user to see that something is odd/wrong and possibly
- * take action. (action == delete the unpacked file, it is redundant.)
+ * IF all three files exist, we do not mutate any of the READDIR data
+ * and return all three names. Then we just redirect all I/O to the unpacked
+ * file. The reason we do not hide the <file>.ecm and <file>.ecm.edi is to make
+ * it possible for the user to see that something is odd/wrong and possibly
+ * take action. (action == delete the unpacked file, it is redundant.)
+ */
+static int need_ecm_uncompress(const char *file) {
+        char stripped[PATH_MAX];
+        char tmp[PATH_MAX];
+        struct stat st;
+        int64_t val;
+        int ret = 1;
+
+        LOG("NEED_ECM_UNCOMPRESS [%s]\n", file);
+        if (path_cache_get(&nu_cache, file, &val) == 0) {
+                return val;
+        }
+
+        LOG("NEED_ECM_UNCOMPRESS SLOW PATH [%s]\n", file);
+
+        snprintf(stripped, PATH_MAX,"%s", file);
+        if (strlen(stripped) > 4 &&
+            !strcmp(stripped + strlen(stripped) - 4, ".edi")) {
+                stripped[strlen(stripped) - 4] = 0;
+        }
+        stripped[strlen(stripped) - ecm_suffix_len(stripped)] = 0;
+
+        if (fstatat(dir_fd, stripped, &st, AT_NO_AUTOMOUNT) == 0) {
+                ret = 0;
+                goto finished;
+        }
+        if (ecm_data_name(dir_fd, stripped, tmp, PATH_MAX) != 0) {
+                ret = 0;
+                goto finished;
+        }
+        snprintf(tmp, PATH_MAX, "%s.ecm.edi", stripped);
+        if (fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) != 0) {
+                ret = 0;
+                goto finished;
+        }
+        
+finished:
+        path_cache_set(&nu_cache, file, ret);
+        return ret;
+}
+
+/* returns the size of the uncompressed file, or 0 if it could not be
+ * determined.
+ */
+static off_t get_uncompressed_size(const char *path)
+{
+        struct ecm *ecm;
+        off_t pos;
+        int64_t size;
+
+        LOG("GET_UNCOMPRESSED_SIZE [%s]\n", path);
+
+        if (path_cache_get(&size_cache, path, &size) == 0) {
+                return size;
+        }
+
+        LOG("GET_UNCOMPRESSED_SIZE SLOW PATH [%s]\n", path);
+
+        ecm = ecm_open_file(dir_fd, path);
+        if (ecm == NULL) {
+                LOG("Failed to open ECM file %s in get_uncompressed_size\n",
+                    path);
+                return 0;
+        }
+        pos = ecm_get_file_size(ecm);
+        ecm_close_file(ecm);
+        LOG("GET_UNCOMPRESSED_SIZE [%s] %jd\n", path, (intmax_t)pos);
+
+        path_cache_set(&size_cache, path, pos);
+
+        return pos;
+}
+
+/* Cooked views are named after the image, with a trailing .bin replaced
+ * by .iso, or .iso appended. Turns an image name into its cooked name.
+ */
+static void cooked_name(char *name, size_t size)
+{
+        size_t len = strlen(name);
+
+        if (len > 4 && !strcmp(name + len - 4, ".bin")) {
+                name[len - 4] = 0;
+        }
+        strncat(name, ".iso", size - strlen(name) - 1);
+}
+
+/* returns the size of the cooked view of an image, or -1 if the image
+ * can not be presented as 2048 byte sectors.
+ */
+static off_t get_cooked_size(const char *path, const char *ecm_path)
+{
+        struct ecm *ecm;
+        int64_t size;
+
+        LOG("GET_COOKED_SIZE [%s]\n", path);
+
+        if (path_cache_get(&size_cache, path, &size) == 0) {
+                return size;
+        }
+
+        LOG("GET_COOKED_SIZE SLOW PATH [%s]\n", path);
+
+        ecm = ecm_open_file(dir_fd, ecm_path);
+        if (ecm == NULL) {
+                LOG("Failed to open ECM file %s in get_cooked_size\n",
+                    ecm_path);
+                return -1;
+        }
+        size = ecm_get_cooked_size(ecm);
+        ecm_close_file(ecm);
+        LOG("GET_COOKED_SIZE [%s] %jd\n", path, (intmax_t)size);
+
+        path_cache_set(&size_cache, path, size);
+
+        return size;
+}
+
+/*
+ * Reverse mode.
+ *
+ * Each raw <image>.bin is presented as <image>.bin.ecm and
+ * <image>.bin.ecm.edi, encoded on the fly, unless there already is a real
+ * <image>.bin.ecm next to it. Encoding needs to know which sectors can be
+ * stored as Mode 1 or Mode 2, which takes a pass over the whole image.
+ * The resulting map is saved in map_dir, under the same key as the chunk
+ * cache uses, so this is only done once for every version of an image.
+ */
+#define ENCODED_ECM   1
+#define ENCODED_INDEX 2
+
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t cache_key(const char *path, struct stat *st);
+
+/* Returns the sector map of the raw image at 'path' */
+static struct ecm_map *get_map(const char *path)
+{
+        char name[PATH_MAX], tmp[PATH_MAX];
+        struct ecm_map *map = NULL;
+        struct stat st;
+        int fd, map_fd;
+
+        fd = openat(dir_fd, path, O_RDONLY);
+        if (fd == -1) {
+                return NULL;
+        }
+        if (fstat(fd, &st)) {
+                close(fd);
+                return NULL;
+        }
+        snprintf(name, sizeof(name), "%s/%016" PRIx64, map_dir,
+                 cache_key(path, &st));
+
+        /* so that an image is only classified once at a time */
+        pthread_mutex_lock(&map_mutex);
+        map_fd = open(name, O_RDONLY);
+        if (map_fd != -1) {
+                map = ecm_map_load(map_fd);
+                close(map_fd);
+        }
+        if (map == NULL) {
+                LOG("GET_MAP SLOW PATH [%s]\n", path);
+                map = ecm_map_build(fd, sysconf(_SC_NPROCESSORS_ONLN));
+        }
+        if (map && map_fd == -1) {
+                snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", name,
+                         (long)syscall(SYS_gettid));
+                map_fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+                if (map_fd != -1) {
+                        if (ecm_map_save(map, map_fd) || rename(tmp, name)) {
+                                unlink(tmp);
+                        }
+                        close(map_fd);
+                }
+        }
+        pthread_mutex_unlock(&map_mutex);
+        close(fd);
+        if (map == NULL) {
+                LOG("Failed to classify the sectors of %s\n", path);
+        }
+        return map;
+}
+
+/* Returns ENCODED_ECM or ENCODED_INDEX if 'name' in 'dir' is an encoded
+ * view, with the name of its raw image in 'raw', or 0.
+ */
+static int encoded_image(int dir, const char *name, char *raw, size_t size)
+{
+        size_t len = strlen(name);
+        char ecm[PATH_MAX];
+        struct stat st;
+        int type;
+
+        if (len > 12 && !strcmp(name + len - 12, ".bin.ecm.edi")) {
+                type = ENCODED_INDEX;
+                len -= 8;
+        } else if (len > 8 && !strcmp(name + len - 8, ".bin.ecm")) {
+                type = ENCODED_ECM;
+                len -= 4;
+        } else {
+                return 0;
+        }
+        snprintf(raw, size, "%.*s", (int)len, name);
+        if (fstatat(dir, raw, &st, AT_NO_AUTOMOUNT) || !S_ISREG(st.st_mode)) {
+                return 0;
+        }
+        /* a real <image>.ecm takes precedence */
+        snprintf(ecm, sizeof(ecm), "%s.ecm", raw);
+        if (fstatat(dir, ecm, &st, AT_NO_AUTOMOUNT) == 0) {
+                return 0;
+        }
+        return type;
+}
+
+/*
+ * I/O scheduler.
+ *
+ * Everything that reads and decodes ECM files goes through sched_enter()
+ * and sched_leave(). At most queue_depth of them run at once and the rest
+ * wait in one queue per priority class:
+ *
+ *   SCHED_RANDOM      foreground reads that seek
+ *   SCHED_SEQUENTIAL  foreground reads that continue the previous one
+ *   SCHED_PREFETCH    reading ahead of what has been asked for
+ *   SCHED_BACKGROUND  warming and scrubbing
+ *
+ * A free slot goes to the highest class that has waiters, and within a
+ * class to the waiter whose image has the fewest reads running, so one
+ * client streaming an image can not starve another. The lower classes
+ * may only fill part of the slots, which keeps slots free for a seek to
+ * start right away however much prefetch and background work is queued.
+ */
+#define SCHED_RANDOM     0
+#define SCHED_SEQUENTIAL 1
+#define SCHED_PREFETCH   2
+#define SCHED_BACKGROUND 3
+#define SCHED_CLASSES    4
+
+struct sched_waiter {
+        struct sched_waiter *next;
+        uint64_t image;
+        pthread_cond_t cond;
+        int granted;
+};
+
+struct sched_image {
+        uint64_t image;
+        int running;
+};
+
+static struct {
+        pthread_mutex_t mutex;
+        int limit[SCHED_CLASSES];       /* slots a class and those below
+                                         * it may hold together */
+        int running[SCHED_CLASSES];
+        struct sched_waiter *head[SCHED_CLASSES];
+        struct sched_waiter **tail[SCHED_CLASSES];
+        struct sched_image *images;     /* queue_depth entries */
+} sched = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Key of the image whose data is in 'name', the device and inode of that
+ * file or of its compressed form, so that reads, prefetch, warming and
+ * scrubbing of an image are counted together whichever view or path they
+ * come through.
+ */
+static uint64_t sched_key(int dir_fd, const char *name)
+{
+        static const char *suffix[] = { "", ".gz", ".zst" };
+        uint64_t h = 14695981039346656037ULL;
+        char tmp[PATH_MAX];
+        struct stat st;
+        size_t i;
+
+        for (i = 0; i < sizeof(suffix) / sizeof(suffix[0]); i++) {
+                snprintf(tmp, PATH_MAX, "%s%s", name, suffix[i]);
+                if (fstatat(dir_fd, tmp, &st, 0) == 0) {
+                        h = fnv64(h, &st.st_dev, sizeof(st.st_dev));
+                        return fnv64(h, &st.st_ino, sizeof(st.st_ino));
+                }
+        }
+        return fnv64(h, name, strlen(name));
+}
+
+static void sched_init(void)
+{
+        int i;
+
+        if (queue_depth <= 0) {
+                queue_depth = 0;
+                return;
+        }
+        sched.images = calloc(queue_depth, sizeof(struct sched_image));
+        if (sched.images == NULL) {
+                queue_depth = 0;
+                return;
+        }
+        sched.limit[SCHED_RANDOM] = queue_depth;
+        sched.limit[SCHED_SEQUENTIAL] = queue_depth > 1 ? queue_depth - 1 : 1;
+        sched.limit[SCHED_PREFETCH] = queue_depth > 1 ? queue_depth / 2 : 1;
+        sched.limit[SCHED_BACKGROUND] = queue_depth > 3 ? queue_depth / 4 : 1;
+        for (i = 0; i < SCHED_CLASSES; i++) {
+                sched.tail[i] = &sched.head[i];
+        }
+}
+
+/* must be called with sched.mutex held */
+static struct sched_image *sched_image(uint64_t image)
+{
+        int i, free_slot = -1;
+
+        for (i = 0; i < queue_depth; i++) {
+                if (sched.images[i].running &&
+                    sched.images[i].image == image) {
+                        return &sched.images[i];
+                }
+                if (!sched.images[i].running && free_slot == -1) {
+                        free_slot = i;
+                }
+        }
+        /* there is always a free entry when a slot is free */
+        sched.images[free_slot].image = image;
+        return &sched.images[free_slot];
+}
+
+/* must be called with sched.mutex held */
+static int sched_can_run(int class)
+{
+        int i, running = 0;
+
+        /* a read of this class counts against its own limit and those
+         * of all the classes above it
+         */
+        for (i = SCHED_CLASSES - 1; i >= 0; i--) {
+                running += sched.running[i];
+                if (i <= class && running >= sched.limit[i]) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* must be called with sched.mutex held */
+static void sched_start(int class, uint64_t image)
+{
+        sched.running[class]++;
+        sched_image(image)->running++;
+}
+
+/* Hand free slots to waiters, must be called with sched.mutex held */
+static void sched_dispatch(void)
+{
+        struct sched_waiter **w, **best;
+        int class, running, best_running;
+
+        for (class = 0; class < SCHED_CLASSES; class++) {
+                while (sched.head[class]) {
+                        if (!sched_can_run(class)) {
+                                /* the classes below have lower limits */
+                                return;
+                        }
+                        best = NULL;
+                        best_running = INT_MAX;
+                        for (w = &sched.head[class]; *w; w = &(*w)->next) {
+                                running = sched_image((*w)->image)->running;
+                                if (running < best_running) {
+                                        best = w;
+                                        best_running = running;
+                                }
+                        }
+                        w = best;
+                        best = &(*w)->next;
+                        if (sched.tail[class] == best) {
+                                sched.tail[class] = w;
+                        }
+                        sched_start(class, (*w)->image);
+                        (*w)->granted = 1;
+                        pthread_cond_signal(&(*w)->cond);
+                        *w = *best;
+                }
+        }
+}
+
+/* Wait for a slot for reading from 'image' */
+static void sched_enter(int class, uint64_t image)
+{
+        struct sched_waiter waiter;
+        uint64_t start;
+        int i;
+
+        if (!queue_depth) {
+                return;
+        }
+        pthread_mutex_lock(&sched.mutex);
+        for (i = 0; i <= class && sched.head[i] == NULL; i++) {
+                ;
+        }
+        if (i > class && sched_can_run(class)) {
+                sched_start(class, image);
+                pthread_mutex_unlock(&sched.mutex);
+                return;
+        }
+
+        start = now_ms();
+        waiter.next = NULL;
+        waiter.image = image;
+        waiter.granted = 0;
+        pthread_cond_init(&waiter.cond, NULL);
+        *sched.tail[class] = &waiter;
+        sched.tail[class] = &waiter.next;
+        while (!waiter.granted) {
+                pthread_cond_wait(&waiter.cond, &sched.mutex);
+        }
+        pthread_mutex_unlock(&sched.mutex);
+        pthread_cond_destroy(&waiter.cond);
+        LOG("SCHED class %d waited %" PRIu64 " ms\n", class,
+            now_ms() - start);
+}
+
+static void sched_leave(int class, uint64_t image)
+{
+        if (!queue_depth) {
+                return;
+        }
+        pthread_mutex_lock(&sched.mutex);
+        sched.running[class]--;
+        sched_image(image)->running--;
+        sched_dispatch();
+        pthread_mutex_unlock(&sched.mutex);
+}
+
+/*
+ * Background warmer.
+ *
+ * When enabled with --warm=<threads> a small pool of threads walks the
+ * underlying directory right after mount and runs every entry through
+ * need_ecm_uncompress() and get_uncompressed_size(). This populates the
+ * existence and size caches, and pulls the .ecm.edi index files into the
+ * page cache, before the first READDIR/GETATTR from the user has to.
+ *
+ * The threads run at idle I/O priority and lowest CPU priority, and
+ * whenever a request from the kernel has been seen in the last
+ * WARM_IDLE_MS milliseconds they sleep until the filesystem is idle again.
+ */
+#define WARM_IDLE_MS 100
+
+struct warm_dir {
+        struct warm_dir *next;
+        char path[];
+};
+
+static struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        struct warm_dir *dirs;
+        int busy;
+} warm = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond  = PTHREAD_COND_INITIALIZER,
+};
+
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE    3
+#define IOPRIO_CLASS_SHIFT   13
+#define IOPRIO_WHO_PROCESS   1
+#endif
+
+static void warm_yield(void)
+{
+        while (now_ms() - __atomic_load_n(&last_request, __ATOMIC_RELAXED)
+               < WARM_IDLE_MS) {
+                usleep(WARM_IDLE_MS * 1000);
+        }
+}
+
+/* must be called with warm.mutex held */
+static void warm_push(const char *path)
+{
+        struct warm_dir *d;
+
+        d = malloc(sizeof(struct warm_dir) + strlen(path) + 1);
+        if (d == NULL) {
+                return;
+        }
+        strcpy(d->path, path);
+        d->next = warm.dirs;
+        warm.dirs = d;
+        pthread_cond_signal(&warm.cond);
+}
+
+static void warm_dir(const char *path)
+{
+        DIR *dir;
+        struct dirent *ent;
+        int fd;
+
+        /* what we cache from here on has to be invalidated on changes */
+        watch_dir(path);
+
+        fd = openat(dir_fd, path, O_DIRECTORY);
+        if (fd == -1) {
+                return;
+        }
+        dir = fdopendir(fd);
+        if (dir == NULL) {
+                close(fd);
+                return;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                char full_path[PATH_MAX];
+                struct stat st;
+                uint64_t key;
+
+                if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                        continue;
+                }
+                if (strcmp(path, ".")) {
+                        snprintf(full_path, PATH_MAX, "%s/%s",
+                                 path, ent->d_name);
+                } else {
+                        snprintf(full_path, PATH_MAX, "%s", ent->d_name);
+                }
+
+                warm_yield();
+
+                if (fstatat(dir_fd, full_path, &st,
+                            AT_NO_AUTOMOUNT|AT_SYMLINK_NOFOLLOW)) {
+                        continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                        pthread_mutex_lock(&warm.mutex);
+                        warm_push(full_path);
+                        pthread_mutex_unlock(&warm.mutex);
+                        continue;
+                }
+
+                /* same lookups as READDIR followed by GETATTR would do */
+                if (reverse) {
+                        char name[NAME_MAX + 8], raw[NAME_MAX + 8];
+                        struct ecm_map *map;
+
+                        snprintf(name, sizeof(name), "%s.ecm", ent->d_name);
+                        if (encoded_image(fd, name, raw, sizeof(raw)) !=
+                            ENCODED_ECM) {
+                                continue;
+                        }
+                        key = sched_key(dir_fd, full_path);
+                        sched_enter(SCHED_BACKGROUND, key);
+                        map = get_map(full_path);
+                        sched_leave(SCHED_BACKGROUND, key);
+                        if (map) {
+                                ecm_map_free(map);
+                        }
+                        continue;
+                }
+                if (need_ecm_uncompress(full_path) &&
+                    strlen(full_path) > 8 &&
+                    !strcmp(full_path + strlen(full_path) - 8, ".ecm.edi")) {
+                        full_path[strlen(full_path) - 4] = 0;
+                        key = sched_key(dir_fd, full_path);
+                        sched_enter(SCHED_BACKGROUND, key);
+                        get_uncompressed_size(full_path);
+                        sched_leave(SCHED_BACKGROUND, key);
+                        full_path[strlen(full_path) - 4] = 0;
+                        need_ecm_uncompress(full_path);
+                }
+        }
+        closedir(dir);
+}
+
+static void *warm_worker(void *arg)
+{
+        struct warm_dir *d;
+
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+        pthread_mutex_lock(&warm.mutex);
+        while (1) {
+                while (warm.dirs == NULL && warm.busy) {
+                        pthread_cond_wait(&warm.cond, &warm.mutex);
+                }
+                if (warm.dirs == NULL) {
+                        break;
+                }
+                d = warm.dirs;
+                warm.dirs = d->next;
+                warm.busy++;
+                pthread_mutex_unlock(&warm.mutex);
+
+                warm_dir(d->path);
+                free(d);
+
+                pthread_mutex_lock(&warm.mutex);
+                warm.busy--;
+        }
+        /* wake up the other workers so they can see we are done */
+        pthread_cond_broadcast(&warm.cond);
+        pthread_mutex_unlock(&warm.mutex);
+
+        LOG("WARM worker finished\n");
+        return NULL;
+}
+
+static void warm_start(void)
+{
+        pthread_t thread;
+        int i;
+
+        LOG("WARM starting %d threads\n", warm_threads);
+
+        pthread_mutex_lock(&warm.mutex);
+        warm_push(".");
+        pthread_mutex_unlock(&warm.mutex);
+
+        for (i = 0; i < warm_threads; i++) {
+                if (pthread_create(&thread, NULL, warm_worker, NULL)) {
+                        LOG("WARM failed to create thread %s\n",
+                            strerror(errno));
+                        break;
+                }
+                pthread_detach(thread);
+        }
+}
+
+/*
+ * Persistent chunk cache.
+ *
+ * Decoded data of ECM images can be kept in a cache directory, typically
+ * on a local SSD, so that it survives restarts of the daemon and does not
+ * have to be fetched and decoded from slow storage again. The images are
+ * split into CACHE_CHUNK sized chunks and every chunk is a file named
+ * after the identity of the image (its path, size and mtime) and the
+ * chunk index. Each file starts with a header holding a checksum of the
+ * data, and files that do not check out are removed and treated as a miss.
+ *
+ * Chunks are written to a temporary file and renamed into place so a crash
+ * never leaves a partial chunk behind. The mtime of a chunk is refreshed
+ * every time it is used, and when the cache grows beyond its limit the
+ * least recently used chunks are removed until it is below 90% again.
+ */
+#define CACHE_CHUNK (256 * 1024)
+#define CACHE_MAGIC "ECMC"
+
+struct cache_header {
+        char magic[4];
+        uint32_t len;
+        uint64_t key;
+        uint64_t chunk;
+        uint64_t sum;
+};
+
+static struct {
+        pthread_mutex_t mutex;  /* held while evicting */
+        int fd;
+        off_t limit;
+        off_t used;
+} cache = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .fd = -1,
+};
+
+static uint64_t cache_sum(const char *buf, size_t len)
+{
+        uint64_t h = 14695981039346656037ULL, w;
+        size_t i;
+
+        /* a word at a time, this is on the read path */
+        for (i = 0; i + 8 <= len; i += 8) {
+                memcpy(&w, buf + i, 8);
+                h = (h ^ w) * 1099511628211ULL;
+        }
+        return fnv64(h, buf + i, len - i);
+}
+
+static uint64_t cache_key(const char *path, struct stat *st)
+{
+        uint64_t h = 14695981039346656037ULL;
+
+        h = fnv64(h, path, strlen(path));
+        h = fnv64(h, &st->st_size, sizeof(st->st_size));
+        h = fnv64(h, &st->st_mtim, sizeof(st->st_mtim));
+        return h;
+}
+
+static void cache_name(char *name, size_t len, uint64_t key, uint64_t chunk)
+{
+        snprintf(name, len, "%016" PRIx64 "-%08" PRIx64, key, chunk);
+}
+
+struct cache_entry {
+        char name[32];
+        off_t size;
+        struct timespec mtime;
+};
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+        const struct cache_entry *ea = a, *eb = b;
+
+        if (ea->mtime.tv_sec != eb->mtime.tv_sec) {
+                return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+        }
+        if (ea->mtime.tv_nsec != eb->mtime.tv_nsec) {
+                return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+        }
+        return 0;
+}
+
+/* Scan the cache directory, recount its size, and if 'limit' is not -1
+ * remove the oldest chunks until no more than 'limit' bytes are used.
+ * Leftover temporary files are removed as well.
+ * Must be called with cache.mutex held.
+ */
+static void cache_scan(off_t limit)
+{
+        struct cache_entry *entries = NULL, *e;
+        size_t count = 0, size = 0, i;
+        struct dirent *ent;
+        off_t used = 0;
+        DIR *dir;
+        int fd;
+
+        fd = openat(cache.fd, ".", O_RDONLY|O_DIRECTORY);
+        if (fd == -1) {
+                return;
+        }
+        dir = fdopendir(fd);
+        if (dir == NULL) {
+                close(fd);
+                return;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                struct stat st;
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+                if (strstr(ent->d_name, ".tmp")) {
+                        unlinkat(cache.fd, ent->d_name, 0);
+                        continue;
+                }
+                if (strlen(ent->d_name) >= sizeof(e->name) ||
+                    fstatat(cache.fd, ent->d_name, &st, 0)) {
+                        continue;
+                }
+                if (count == size) {
+                        size = size ? 2 * size : 1024;
+                        e = realloc(entries, size * sizeof(*e));
+                        if (e == NULL) {
+                                break;
+                        }
+                        entries = e;
+                }
+                e = &entries[count++];
+                strcpy(e->name, ent->d_name);
+                e->size = st.st_blocks * 512;
+                e->mtime = st.st_mtim;
+                used += e->size;
+        }
+        closedir(dir);
+
+        if (limit != -1 && used > limit) {
+                qsort(entries, count, sizeof(*entries), cache_entry_cmp);
+                for (i = 0; i < count && used > limit; i++) {
+                        if (unlinkat(cache.fd, entries[i].name, 0) == 0) {
+                                used -= entries[i].size;
+                        }
+                }
+                LOG("CACHE evicted %zu chunks\n", i);
+        }
+        free(entries);
+        __atomic_store_n(&cache.used, used, __ATOMIC_RELAXED);
+}
+
+static int cache_init(const char *path, off_t limit)
+{
+        mkdir(path, 0700);
+        cache.fd = open(path, O_RDONLY|O_DIRECTORY);
+        if (cache.fd == -1) {
+                return -1;
+        }
+        cache.limit = limit;
+        cache_scan(limit);
+        return 0;
+}
+
+/* Returns the number of bytes in the cached chunk, or -1 on a miss */
+static ssize_t cache_get(uint64_t key, uint64_t chunk, char *buf)
+{
+        struct cache_header hdr;
+        struct iovec iov[2];
+        char name[32];
+        ssize_t ret;
+        int fd;
+
+        cache_name(name, sizeof(name), key, chunk);
+        fd = openat(cache.fd, name, O_RDONLY);
+        if (fd == -1) {
+                return -1;
+        }
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = buf;
+        iov[1].iov_len = CACHE_CHUNK;
+        ret = readv(fd, iov, 2) - sizeof(hdr);
+        if (ret < 0 || memcmp(hdr.magic, CACHE_MAGIC, 4) ||
+            hdr.key != key || hdr.chunk != chunk || hdr.len != ret ||
+            hdr.sum != cache_sum(buf, ret)) {
+                struct stat st;
+
+                LOG("CACHE removing bad chunk %s\n", name);
+                if (fstat(fd, &st) == 0 &&
+                    unlinkat(cache.fd, name, 0) == 0) {
+                        __atomic_sub_fetch(&cache.used, st.st_blocks * 512,
+                                           __ATOMIC_RELAXED);
+                }
+                close(fd);
+                return -1;
+        }
+        /* mark it as recently used for the eviction */
+        futimens(fd, NULL);
+        close(fd);
+        return ret;
+}
+
+static void cache_put(uint64_t key, uint64_t chunk, const char *buf,
+                      size_t len)
+{
+        struct cache_header hdr;
+        struct iovec iov[2];
+        char name[32], tmp[64];
+        struct stat st;
+        off_t used;
+        int fd;
+
+        cache_name(name, sizeof(name), key, chunk);
+        snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", name,
+                 (long)syscall(SYS_gettid));
+        fd = openat(cache.fd, tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        if (fd == -1) {
+                return;
+        }
+        memcpy(hdr.magic, CACHE_MAGIC, 4);
+        hdr.len = len;
+        hdr.key = key;
+        hdr.chunk = chunk;
+        hdr.sum = cache_sum(buf, len);
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = discard_const(buf);
+        iov[1].iov_len = len;
+        if (writev(fd, iov, 2) != (ssize_t)(sizeof(hdr) + len) ||
+            fstat(fd, &st) ||
+            renameat(cache.fd, tmp, cache.fd, name)) {
+                close(fd);
+                unlinkat(cache.fd, tmp, 0);
+                return;
+        }
+        close(fd);
+
+        used = __atomic_add_fetch(&cache.used, st.st_blocks * 512,
+                                  __ATOMIC_RELAXED);
+        if (used > cache.limit && pthread_mutex_trylock(&cache.mutex) == 0) {
+                cache_scan(cache.limit / 10 * 9);
+                pthread_mutex_unlock(&cache.mutex);
+        }
+}
+
+/* Read from an ECM image through the chunk cache */
+static ssize_t cache_read(struct file *file, char *buf, off_t offset,
+                          size_t size)
+{
+        ssize_t total = 0;
+        char *chunk_buf;
+
+        chunk_buf = malloc(CACHE_CHUNK);
+        if (chunk_buf == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+        while (size) {
+                uint64_t chunk = offset / CACHE_CHUNK;
+                size_t skip = offset % CACHE_CHUNK;
+                ssize_t n;
+
+                n = cache_get(file->cache_key, chunk, chunk_buf);
+                if (n == -1) {
+                        n = ecm_read(file->ecm, chunk_buf,
+                                     chunk * CACHE_CHUNK, CACHE_CHUNK);
+                        if (n == -1) {
+                                free(chunk_buf);
+                                return -1;
+                        }
+                        if (n > 0) {
+                                cache_put(file->cache_key, chunk,
+                                          chunk_buf, n);
+                        }
+                }
+                if (n <= (ssize_t)skip) {
+                        break;
+                }
+                n -= skip;
+                if (n > (ssize_t)size) {
+                        n = size;
+                }
+                memcpy(buf + total, chunk_buf + skip, n);
+                total  += n;
+                offset += n;
+                size   -= n;
+        }
+        free(chunk_buf);
+        return total;
+}
+
+/*
+ * Shared memory cache.
+ *
+ * Several fuse-unecm mounts of the same user, over the same image library,
+ * can share decoded data through a POSIX shared memory segment, so that an
+ * image that is popular with all of them is only decoded once. The segment
+ * is created by the first mount that uses it, with the size it asks for,
+ * and the others attach to it as it is.
+ *
+ * The segment holds a table of slots, each with room for one SHM_CHUNK of
+ * an image, grouped in sets of SHM_WAYS. A chunk is identified by the
+ * device, inode, size and mtime of its ECM file and its index, and can
+ * only be stored in the set its identity hashes to. Every slot is guarded
+ * by a sequence count that is odd while the slot is being written:
+ *
+ *   readers take no locks, they copy the data out and check that the
+ *   count was even and did not change while they were copying
+ *
+ *   a writer claims a slot by making its count odd with a compare and
+ *   swap, and simply skips storing the chunk if some other process got
+ *   there first
+ *
+ * Within a set the least recently stored slot is replaced.
+ */
+#define SHM_CHUNK   (64 * 1024)
+#define SHM_WAYS    4
+#define SHM_MAGIC   0x45434d5348310000ULL  /* "ECMSH1" */
+
+struct shm_slot {
+        uint64_t seq;
+        uint64_t key;
+        uint64_t chunk;
+        uint64_t stored;        /* value of the clock when stored */
+        uint32_t len;
+        uint32_t pad;
+};
+
+struct shm_header {
+        uint64_t magic;
+        uint64_t sets;
+        uint64_t clock;
+        uint64_t pad;
+};
+
+static struct {
+        struct shm_header *hdr;
+        struct shm_slot *slots;
+        uint8_t *data;
+        uint64_t sets;
+} shm;
+
+static uint64_t shm_key(struct stat *st)
+{
+        uint64_t h = 14695981039346656037ULL;
+
+        h = fnv64(h, &st->st_dev, sizeof(st->st_dev));
+        h = fnv64(h, &st->st_ino, sizeof(st->st_ino));
+        h = fnv64(h, &st->st_size, sizeof(st->st_size));
+        h = fnv64(h, &st->st_mtim, sizeof(st->st_mtim));
+        return h | 1;           /* 0 marks an empty slot */
+}
+
+static int shm_init(off_t size)
+{
+        char name[64];
+        uint64_t sets, len;
+        struct stat st;
+        void *map;
+        int fd, i;
+
+        snprintf(name, sizeof(name), "/fuse-unecm.%d", (int)getuid());
+        fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+        if (fd != -1) {
+                sets = size / (SHM_WAYS * (SHM_CHUNK +
+                                           sizeof(struct shm_slot)));
+                if (sets == 0) {
+                        sets = 1;
+                }
+                len = sizeof(struct shm_header) +
+                        sets * SHM_WAYS * (sizeof(struct shm_slot) +
+                                           SHM_CHUNK);
+                if (ftruncate(fd, len)) {
+                        close(fd);
+                        shm_unlink(name);
+                        return -1;
+                }
+        } else if (errno == EEXIST) {
+                fd = shm_open(name, O_RDWR, 0600);
+                if (fd == -1) {
+                        return -1;
+                }
+        } else {
+                return -1;
+        }
+
+        /* the creator may not have sized it yet */
+        for (i = 0; i < 100; i++) {
+                if (fstat(fd, &st)) {
+                        close(fd);
+                        return -1;
+                }
+                if (st.st_size >= (off_t)sizeof(struct shm_header)) {
+                        break;
+                }
+                usleep(10000);
+        }
+        if (i == 100) {
+                close(fd);
+                errno = EINVAL;
+                return -1;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return -1;
+        }
+        shm.hdr = map;
+
+        if (__atomic_load_n(&shm.hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+                /* we created it, or the creator has not got this far yet */
+                uint64_t expected = 0;
+
+                sets = (st.st_size - sizeof(struct shm_header)) /
+                        (SHM_WAYS * (sizeof(struct shm_slot) + SHM_CHUNK));
+                if (__atomic_compare_exchange_n(&shm.hdr->sets, &expected,
+                                                sets, 0, __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED)) {
+                        __atomic_store_n(&shm.hdr->magic, SHM_MAGIC,
+                                         __ATOMIC_RELEASE);
+                }
+                for (i = 0; i < 100 && __atomic_load_n(&shm.hdr->magic,
+                                                       __ATOMIC_ACQUIRE)
+                             != SHM_MAGIC; i++) {
+                        usleep(10000);
+                }
+        }
+        shm.sets = __atomic_load_n(&shm.hdr->sets, __ATOMIC_RELAXED);
+        if (shm.sets == 0 || sizeof(struct shm_header) + shm.sets * SHM_WAYS *
+            (sizeof(struct shm_slot) + SHM_CHUNK) > (uint64_t)st.st_size) {
+                munmap(map, st.st_size);
+                shm.hdr = NULL;
+                errno = EINVAL;
+                return -1;
+        }
+        shm.slots = (struct shm_slot *)(shm.hdr + 1);
+        shm.data = (uint8_t *)(shm.slots + shm.sets * SHM_WAYS);
+        return 0;
+}
+
+static uint64_t shm_set(uint64_t key, uint64_t chunk)
+{
+        uint64_t h = key ^ (chunk * 0x9E3779B97F4A7C15ULL);
+
+        h ^= h >> 29;
+        return (h % shm.sets) * SHM_WAYS;
+}
+
+/* Returns the number of bytes of the chunk, or -1 if it is not there */
+static ssize_t shm_get(uint64_t key, uint64_t chunk, char *buf)
+{
+        uint64_t first = shm_set(key, chunk), seq;
+        struct shm_slot *slot;
+        uint32_t len;
+        int i;
+
+        for (i = 0; i < SHM_WAYS; i++) {
+                slot = &shm.slots[first + i];
+                seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+                if ((seq & 1) ||
+                    __atomic_load_n(&slot->key, __ATOMIC_RELAXED) != key ||
+                    __atomic_load_n(&slot->chunk, __ATOMIC_RELAXED) != chunk) {
+                        continue;
+                }
+                len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+                if (len > SHM_CHUNK) {
+                        continue;
+                }
+                memcpy(buf, shm.data + (first + i) * SHM_CHUNK, len);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+                        /* overwritten while we were copying */
+                        return -1;
+                }
+                return len;
+        }
+        return -1;
+}
+
+static void shm_put(uint64_t key, uint64_t chunk, const char *buf, size_t len)
+{
+        uint64_t first = shm_set(key, chunk), seq;
+        struct shm_slot *slot, *victim = NULL;
+        int i;
+
+        for (i = 0; i < SHM_WAYS; i++) {
+                slot = &shm.slots[first + i];
+                if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) == key &&
+                    __atomic_load_n(&slot->chunk, __ATOMIC_RELAXED) == chunk) {
+                        /* someone else stored it in the meantime */
+                        return;
+                }
+                if (victim == NULL ||
+                    __atomic_load_n(&slot->stored, __ATOMIC_RELAXED) <
+                    __atomic_load_n(&victim->stored, __ATOMIC_RELAXED)) {
+                        victim = slot;
+                }
+        }
+
+        seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) ||
+            !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+        }
+        __atomic_store_n(&victim->key, key, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->chunk, chunk, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->len, len, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->stored,
+                         __atomic_add_fetch(&shm.hdr->clock, 1,
+                                            __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        memcpy(shm.data + (victim - shm.slots) * SHM_CHUNK, buf, len);
+        __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Read from an ECM image through the shared memory cache, and the chunk
+ * cache below it if there is one.
+ */
+static ssize_t shm_read(struct file *file, char *buf, off_t offset,
+                        size_t size)
+{
+        ssize_t total = 0;
+        char *chunk_buf;
+
+        chunk_buf = malloc(SHM_CHUNK);
+        if (chunk_buf == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+        while (size) {
+                uint64_t chunk = offset / SHM_CHUNK;
+                size_t skip = offset % SHM_CHUNK;
+                ssize_t n;
+
+                n = shm_get(file->shm_key, chunk, chunk_buf);
+                if (n == -1) {
+                        if (file->cache_key) {
+                                n = cache_read(file, chunk_buf,
+                                               chunk * SHM_CHUNK, SHM_CHUNK);
+                        } else {
+                                n = ecm_read(file->ecm, chunk_buf,
+                                             chunk * SHM_CHUNK, SHM_CHUNK);
+                        }
+                        if (n == -1) {
+                                free(chunk_buf);
+                                return -1;
+                        }
+                        if (n > 0) {
+                                shm_put(file->shm_key, chunk, chunk_buf, n);
+                        }
+                }
+                if (n <= (ssize_t)skip) {
+                        break;
+                }
+                n -= skip;
+                if (n > (ssize_t)size) {
+                        n = size;
+                }
+                memcpy(buf + total, chunk_buf + skip, n);
+                total  += n;
+                offset += n;
+                size   -= n;
+        }
+        free(chunk_buf);
+        return total;
+}
+
+/*
+ * Inode table.
+ *
+ * Every inode the kernel knows about is a struct node and its fuse inode
+ * number is the address of the node. A node refers to its backing file by
+ * name, relative to the O_PATH descriptor held by its parent directory
+ * node, so after the LOOKUP no path has to be built or resolved again.
+ * Whether a node is an uncompressed ECM image, and what its size is, is
+ * worked out once when the node is created.
+ *
+ * A node is freed when the kernel has forgotten all lookups of it and it
+ * has no child nodes left.
+ */
+struct listing;
+
+struct node {
+        struct node *next;      /* hash chain */
+        struct node *parent;
+        uint64_t refs;          /* kernel lookups plus child nodes */
+        int unhashed;           /* replaced, no longer in the hash table */
+        int fd;                 /* O_PATH descriptor, directories only */
+        int watched;            /* directory is watched with inotify */
+        struct listing *listing;/* cached READDIR output of a directory */
+        uint64_t listing_gen;   /* bumped whenever the listing is dropped */
+        int prefetched;         /* learned prefetch has been started */
+        int ecm;                /* this is the uncompressed <name>.ecm */
+        int cooked;             /* this is the cooked view of ecm_name */
+        int encoded;            /* ENCODED_* view of the raw ecm_name */
+        struct ecm_map *map;    /* sectors of ecm_name for encoded views */
+        off_t size;             /* uncompressed size for ECM images */
+        char *name;             /* name in the parent directory */
+        char *ecm_name;         /* the .ecm file for ECM images */
+        char *path;             /* path from the root, for the caches */
+};
+
+static struct node root_node;
+
+static struct {
+        pthread_mutex_t mutex;
+        struct node **buckets;
+        size_t size;
+        size_t count;
+} nodes = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define ATTR_TIMEOUT 1.0
+
+static struct node *ino_to_node(fuse_ino_t ino)
+{
+        if (ino == FUSE_ROOT_ID) {
+                return &root_node;
+        }
+        return (struct node *)(uintptr_t)ino;
+}
+
+static fuse_ino_t node_to_ino(struct node *node)
+{
+        if (node == &root_node) {
+                return FUSE_ROOT_ID;
+        }
+        return (uintptr_t)node;
+}
+
+static size_t node_hash(struct node *parent, const char *name, size_t size)
+{
+        uint64_t h = 14695981039346656037ULL ^ (uintptr_t)parent;
+
+        while (*name) {
+                h = (h ^ (uint8_t)*name++) * 1099511628211ULL;
+        }
+        return h & (size - 1);
+}
+
+/* must be called with nodes.mutex held */
+static struct node *node_find(struct node *parent, const char *name)
+{
+        struct node *node;
+
+        if (nodes.size == 0) {
+                return NULL;
+        }
+        node = nodes.buckets[node_hash(parent, name, nodes.size)];
+        for (; node; node = node->next) {
+                if (node->parent == parent && !strcmp(node->name, name)) {
+                        return node;
+                }
+        }
+        return NULL;
+}
+
+/* must be called with nodes.mutex held */
+static int node_insert(struct node *node)
+{
+        struct node **b;
+
+        if (nodes.count >= nodes.size) {
+                size_t i, size = nodes.size ? 2 * nodes.size : 1024;
+
+                b = calloc(size, sizeof(struct node *));
+                if (b == NULL) {
+                        return -1;
+                }
+                for (i = 0; i < nodes.size; i++) {
+                        while (nodes.buckets[i]) {
+                                struct node *n = nodes.buckets[i];
+                                size_t h = node_hash(n->parent, n->name, size);
+
+                                nodes.buckets[i] = n->next;
+                                n->next = b[h];
+                                b[h] = n;
+                        }
+                }
+                free(nodes.buckets);
+                nodes.buckets = b;
+                nodes.size = size;
+        }
+        b = &nodes.buckets[node_hash(node->parent, node->name, nodes.size)];
+        node->next = *b;
+        *b = node;
+        nodes.count++;
+        return 0;
+}
+
+static void listing_unref(struct listing *listing);
+
+static void node_free(struct node *node)
+{
+        if (node->fd != -1) {
+                close(node->fd);
+        }
+        if (node->listing) {
+                listing_unref(node->listing);
+        }
+        if (node->map) {
+                ecm_map_free(node->map);
+        }
+        free(node->name);
+        free(node->ecm_name);
+        free(node->path);
+        free(node);
+}
+
+/* Drop 'count' references, freeing the node and possibly its parents */
+static void node_unref(struct node *node, uint64_t count)
+{
+        pthread_mutex_lock(&nodes.mutex);
+        while (1) {
+                struct node *parent = node->parent;
+                struct node **b;
+
+                node->refs -= count;
+                if (node->refs || node == &root_node) {
+                        break;
+                }
+                if (!node->unhashed) {
+                        b = &nodes.buckets[node_hash(parent, node->name,
+                                                     nodes.size)];
+                        while (*b != node) {
+                                b = &(*b)->next;
+                        }
+                        *b = node->next;
+                        nodes.count--;
+                }
+                node_free(node);
+
+                node = parent;
+                count = 1;
+        }
+        pthread_mutex_unlock(&nodes.mutex);
+}
+
+/* Find the image that 'name' is the cooked view of, trying <base>.bin
+ * and then <base> for a name <base>.iso. Returns 0 and the name of the
+ * image in 'raw' if there is one.
+ */
+static int cooked_image(struct node *parent, const char *name,
+                        char *raw, size_t size)
+{
+        char path[PATH_MAX];
+        int len = strlen(name);
+        int i;
+
+        if (len <= 4 || strcmp(name + len - 4, ".iso")) {
+                return -1;
+        }
+        for (i = 0; i < 2; i++) {
+                snprintf(raw, size, "%.*s%s", len - 4, name,
+                         i == 0 ? ".bin" : "");
+                if (strcmp(parent->path, ".")) {
+                        snprintf(path, PATH_MAX, "%s/%s", parent->path, raw);
+                } else {
+                        snprintf(path, PATH_MAX, "%s", raw);
+                }
+                if (need_ecm_uncompress(path)) {
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+/* Create a node for 'name' in 'parent' by looking at the backing files.
+ * Returns NULL and sets errno if there is no such file.
+ */
+static struct node *node_new(struct node *parent, const char *name)
+{
+        struct node *node, *old;
+        char tmp[PATH_MAX];
+        struct stat st;
+
+        node = calloc(1, sizeof(struct node));
+        if (node == NULL) {
+                return NULL;
+        }
+        node->fd = -1;
+        node->parent = parent;
+        node->refs = 1;
+        node->name = strdup(name);
+        if (strcmp(parent->path, ".")) {
+                asprintf(&node->path, "%s/%s", parent->path, name);
+        } else {
+                node->path = strdup(name);
+        }
+        if (node->name == NULL || node->path == NULL) {
+                node_free(node);
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        if (fstatat(parent->fd, name, &st, AT_NO_AUTOMOUNT) == 0) {
+                if (S_ISDIR(st.st_mode)) {
+                        node->fd = openat(parent->fd, name,
+                                          O_PATH|O_DIRECTORY);
+                        if (node->fd == -1) {
+                                node_free(node);
+                                return NULL;
+                        }
+                        node->watched = watch_dir(node->path) == 0;
+                }
+        } else if (errno == ENOENT && reverse) {
+                uint8_t *index;
+                size_t len;
+
+                node->encoded = encoded_image(parent->fd, name, tmp,
+                                              sizeof(tmp));
+                if (node->encoded == 0) {
+                        node_free(node);
+                        errno = ENOENT;
+                        return NULL;
+                }
+                node->ecm_name = strdup(tmp);
+                /* the path of the raw image, its name is a prefix of ours */
+                snprintf(tmp, PATH_MAX, "%s", node->path);
+                tmp[strlen(tmp) - strlen(name) + strlen(node->ecm_name)] = 0;
+                node->map = get_map(tmp);
+                if (node->ecm_name == NULL || node->map == NULL) {
+                        node_free(node);
+                        errno = EIO;
+                        return NULL;
+                }
+                if (node->encoded == ENCODED_ECM) {
+                        node->size = ecm_map_size(node->map);
+                } else {
+                        index = ecm_map_index(node->map, &len);
+                        if (index == NULL) {
+                                node_free(node);
+                                return NULL;
+                        }
+                        free(index);
+                        node->size = len;
+                }
+        } else if (errno == ENOENT && need_ecm_uncompress(node->path)) {
+                node->ecm = 1;
+                ecm_data_name(parent->fd, name, tmp, PATH_MAX);
+                node->ecm_name = strdup(tmp);
+                snprintf(tmp, PATH_MAX, "%s.ecm", node->path);
+                node->size = get_uncompressed_size(tmp);
+        } else if (errno == ENOENT && cooked_view &&
+                   cooked_image(parent, name, tmp, sizeof(tmp)) == 0) {
+                char ecm_path[PATH_MAX];
+
+                node->ecm = 1;
+                node->cooked = 1;
+                ecm_data_name(parent->fd, tmp, ecm_path, PATH_MAX);
+                node->ecm_name = strdup(ecm_path);
+                if (strcmp(parent->path, ".")) {
+                        snprintf(ecm_path, PATH_MAX, "%s/%s.ecm",
+                                 parent->path, tmp);
+                } else {
+                        snprintf(ecm_path, PATH_MAX, "%s.ecm", tmp);
+                }
+                node->size = get_cooked_size(node->path, ecm_path);
+                if (node->size < 0) {
+                        node_free(node);
+                        errno = ENOENT;
+                        return NULL;
+                }
+        } else {
+                node_free(node);
+                errno = ENOENT;
+                return NULL;
+        }
+
+        pthread_mutex_lock(&nodes.mutex);
+        old = node_find(parent, name);
+        if (old) {
+                /* somebody else got there first */
+                old->refs++;
+                pthread_mutex_unlock(&nodes.mutex);
+                node_free(node);
+                return old;
+        }
+        if (node_insert(node)) {
+                pthread_mutex_unlock(&nodes.mutex);
+                node_free(node);
+                errno = ENOMEM;
+                return NULL;
+        }
+        parent->refs++;
+        pthread_mutex_unlock(&nodes.mutex);
+
+        return node;
+}
+
+static int node_stat(struct node *node, struct stat *st)
+{
+        if (node == &root_node) {
+                return fstat(dir_fd, st);
+        }
+        if (node->ecm || node->encoded) {
+                if (fstatat(node->parent->fd, node->ecm_name, st,
+                            AT_NO_AUTOMOUNT)) {
+                        return -1;
+                }
+                st->st_size = node->size;
+                return 0;
+        }
+        return fstatat(node->parent->fd, node->name, st, AT_NO_AUTOMOUNT);
+}
+
+/*
+ * Directory watches.
+ *
+ * need_ecm_uncompress(), the image sizes and the READDIR listings are all
+ * cached. Every backing directory the filesystem looks into is watched
+ * with inotify, and when a file in it is created, removed, renamed or
+ * rewritten the cached entries for that name and the listing of the
+ * directory are dropped. Nodes for the name are taken out of the hash
+ * table so the next LOOKUP builds them afresh, and the kernel is told to
+ * forget what it has cached for the name.
+ *
+ * A directory that can not be watched, for example because the inotify
+ * limits have been reached, does not get a cached listing.
+ */
+#define WATCH_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+                      IN_CLOSE_WRITE|IN_ATTRIB)
+
+static struct {
+        pthread_mutex_t mutex;
+        int fd;
+        char **paths;           /* directory of each watch descriptor */
+        int size;
+} watches = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .fd = -1,
+};
+
+/* Returns 0 if the directory is, or now is, being watched */
+static int watch_dir(const char *path)
+{
+        char proc_path[PATH_MAX];
+        int wd, ret = 0;
+
+        if (watches.fd == -1) {
+                return -1;
+        }
+        /* go through dir_fd, the mount point hides the backing directory */
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d/%s",
+                 dir_fd, path);
+        wd = inotify_add_watch(watches.fd, proc_path,
+                               WATCH_EVENTS|IN_ONLYDIR);
+        if (wd == -1) {
+                LOG("WATCH failed for [%s] %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        pthread_mutex_lock(&watches.mutex);
+        if (wd >= watches.size) {
+                int size = watches.size ? watches.size : 64;
+                char **paths;
+
+                while (size <= wd) {
+                        size *= 2;
+                }
+                paths = realloc(watches.paths, size * sizeof(char *));
+                if (paths == NULL) {
+                        ret = -1;
+                        goto out;
+                }
+                memset(paths + watches.size, 0,
+                       (size - watches.size) * sizeof(char *));
+                watches.paths = paths;
+                watches.size = size;
+        }
+        if (watches.paths[wd] == NULL) {
+                watches.paths[wd] = strdup(path);
+        }
+out:
+        pthread_mutex_unlock(&watches.mutex);
+        if (ret) {
+                inotify_rm_watch(watches.fd, wd);
+        }
+        return ret;
+}
+
+/* must be called with nodes.mutex held */
+static struct node *node_by_path(const char *path)
+{
+        struct node *node = &root_node;
+        char tmp[PATH_MAX], *name, *save;
+
+        if (!strcmp(path, ".")) {
+                return node;
+        }
+        snprintf(tmp, sizeof(tmp), "%s", path);
+        for (name = strtok_r(tmp, "/", &save); name && node;
+             name = strtok_r(NULL, "/", &save)) {
+                node = node_find(node, name);
+        }
+        return node;
+}
+
+/* must be called with nodes.mutex held */
+static void node_drop_listing(struct node *node)
+{
+        if (node->listing) {
+                listing_unref(node->listing);
+                node->listing = NULL;
+        }
+        node->listing_gen++;
+}
+
+/* must be called with nodes.mutex held */
+static void node_unhash(struct node *node)
+{
+        struct node **b;
+
+        b = &nodes.buckets[node_hash(node->parent, node->name, nodes.size)];
+        while (*b != node) {
+                b = &(*b)->next;
+        }
+        *b = node->next;
+        nodes.count--;
+        node->unhashed = 1;
+}
+
+static void path_cache_delete_at(struct path_cache *pc, const char *dir,
+                                 const char *name)
+{
+        char path[PATH_MAX];
+
+        if (strcmp(dir, ".")) {
+                snprintf(path, sizeof(path), "%s/%s", dir, name);
+        } else {
+                snprintf(path, sizeof(path), "%s", name);
+        }
+        path_cache_delete(pc, path);
+}
+
+/* Something happened to 'name' in the backing directory 'dir' */
+static void watch_invalidate(const char *dir, const char *name)
+{
+        char base[NAME_MAX + 1], cooked[NAME_MAX + 16];
+        char names[6][NAME_MAX + 16];
+        struct node *parent, *node;
+        int i, n = 0;
+        size_t len;
+
+        LOG("WATCH [%s] [%s] changed\n", dir, name);
+
+        /* the image all the names of an ECM image have in common */
+        snprintf(base, sizeof(base), "%s", name);
+        len = strlen(base);
+        if (len > 4 && !strcmp(base + len - 4, ".gzi")) {
+                base[len -= 4] = 0;
+        }
+        if (len > 4 && !strcmp(base + len - 4, ".edi")) {
+                base[len -= 4] = 0;
+        }
+        base[len - ecm_suffix_len(base)] = 0;
+
+        /* the names the image and its files can be seen or looked up as */
+        snprintf(cooked, sizeof(cooked), "%s", base);
+        cooked_name(cooked, sizeof(cooked));
+        snprintf(names[n++], sizeof(names[0]), "%s", name);
+        if (strcmp(base, name)) {
+                snprintf(names[n++], sizeof(names[0]), "%s", base);
+        }
+        snprintf(names[n++], sizeof(names[0]), "%s", cooked);
+        for (i = 0; reverse && i < 2; i++) {
+                /* the encoded views of a raw image */
+                snprintf(names[n], sizeof(names[0]), "%s%s", base,
+                         i == 0 ? ".ecm" : ".ecm.edi");
+                if (strcmp(names[n], name)) {
+                        n++;
+                }
+        }
+
+        for (i = 0; i < n; i++) {
+                path_cache_delete_at(&nu_cache, dir, names[i]);
+        }
+        for (i = 0; ecm_suffixes[i]; i++) {
+                snprintf(names[n], sizeof(names[0]), "%s%s", base,
+                         ecm_suffixes[i]);
+                path_cache_delete_at(&nu_cache, dir, names[n]);
+        }
+        snprintf(names[n], sizeof(names[0]), "%s.ecm.edi", base);
+        path_cache_delete_at(&nu_cache, dir, names[n]);
+        /* sizes are kept under <image>.ecm and under the cooked name */
+        snprintf(names[n], sizeof(names[0]), "%s.ecm", base);
+        path_cache_delete_at(&size_cache, dir, names[n]);
+        path_cache_delete_at(&size_cache, dir, cooked);
+
+        pthread_mutex_lock(&nodes.mutex);
+        parent = node_by_path(dir);
+        if (parent == NULL) {
+                pthread_mutex_unlock(&nodes.mutex);
+                return;
+        }
+        node_drop_listing(parent);
+        for (i = 0; i < n; i++) {
+                node = node_find(parent, names[i]);
+                if (node) {
+                        node_unhash(node);
+                }
+        }
+        parent->refs++;
+        pthread_mutex_unlock(&nodes.mutex);
+
+        for (i = 0; i < n && fuse_ch; i++) {
+                fuse_lowlevel_notify_inval_entry(fuse_ch, node_to_ino(parent),
+                                                 names[i], strlen(names[i]));
+        }
+        node_unref(parent, 1);
+}
+
+/* Some events were lost, forget everything that might be stale */
+static void watch_invalidate_all(void)
+{
+        size_t i;
+        struct node *node;
+
+        LOG("WATCH queue overflow, dropping all caches\n");
+
+        path_cache_clear(&nu_cache);
+        path_cache_clear(&size_cache);
+
+        pthread_mutex_lock(&nodes.mutex);
+        node_drop_listing(&root_node);
+        for (i = 0; i < nodes.size; i++) {
+                for (node = nodes.buckets[i]; node; node = node->next) {
+                        node_drop_listing(node);
+                }
+        }
+        pthread_mutex_unlock(&nodes.mutex);
+}
+
+static void *watch_worker(void *arg)
+{
+        char buf[65536] __attribute__((aligned(8)));
+        struct inotify_event *ev;
+        ssize_t len, i;
+
+        while (1) {
+                len = read(watches.fd, buf, sizeof(buf));
+                if (len <= 0) {
+                        if (len == -1 && errno == EINTR) {
+                                continue;
+                        }
+                        LOG("WATCH read failed %s\n", strerror(errno));
+                        return NULL;
+                }
+                for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+                        char *dir = NULL;
+
+                        ev = (struct inotify_event *)&buf[i];
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                watch_invalidate_all();
+                                continue;
+                        }
+                        pthread_mutex_lock(&watches.mutex);
+                        if (ev->wd >= 0 && ev->wd < watches.size) {
+                                dir = watches.paths[ev->wd];
+                                if (ev->mask & IN_IGNORED) {
+                                        watches.paths[ev->wd] = NULL;
+                                        free(dir);
+                                        dir = NULL;
+                                }
+                        }
+                        /* paths are only freed by this thread */
+                        pthread_mutex_unlock(&watches.mutex);
+
+                        if (dir && ev->len) {
+                                watch_invalidate(dir, ev->name);
+                        }
+                }
+        }
+        return NULL;
+}
+
+static void watch_start(void)
+{
+        pthread_t thread;
+
+        if (watches.fd == -1) {
+                return;
+        }
+        if (pthread_create(&thread, NULL, watch_worker, NULL)) {
+                LOG("WATCH failed to create thread %s\n", strerror(errno));
+                return;
+        }
+        pthread_detach(thread);
+}
+
+/*
+ * Cached directory listings.
+ *
+ * The names READDIR returns for a directory, after hiding and renaming the
+ * files of ECM images, are worked out once and kept with the directory
+ * node until something in the directory changes. Every open directory
+ * holds a reference to the listing it started with, so its offsets, the
+ * index of the next entry, stay valid even if the listing is replaced
+ * while it is being read.
+ */
+struct listing_entry {
+        char *name;
+        ino_t ino;
+        mode_t mode;
+};
+
+struct listing {
+        int refs;
+        size_t count;
+        struct listing_entry *entries;
+};
+
+static void listing_unref(struct listing *listing)
+{
+        size_t i;
+
+        if (__atomic_sub_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL)) {
+                return;
+        }
+        for (i = 0; i < listing->count; i++) {
+                free(listing->entries[i].name);
+        }
+        free(listing->entries);
+        free(listing);
+}
+
+static int listing_add(struct listing *listing, size_t *size,
+                       const char *name, ino_t ino, mode_t mode)
+{
+        struct listing_entry *e;
+
+        if (listing->count == *size) {
+                *size = *size ? 2 * *size : 64;
+                e = realloc(listing->entries, *size * sizeof(*e));
+                if (e == NULL) {
+                        return -1;
+                }
+                listing->entries = e;
+        }
+        e = &listing->entries[listing->count];
+        e->name = strdup(name);
+        if (e->name == NULL) {
+                return -1;
+        }
+        e->ino = ino;
+        e->mode = mode;
+        listing->count++;
+        return 0;
+}
+
+/* Read a backing directory and work out what READDIR should return */
+static struct listing *listing_build(struct node *node)
+{
+        struct listing *listing;
+        struct dirent *ent;
+        size_t size = 0;
+        DIR *dir;
+        int fd;
+
+        fd = openat(node->fd, ".", O_RDONLY|O_DIRECTORY);
+        dir = fd == -1 ? NULL : fdopendir(fd);
+        if (dir == NULL) {
+                if (fd != -1) {
+                        close(fd);
+                }
+                return NULL;
+        }
+        listing = calloc(1, sizeof(struct listing));
+        if (listing == NULL) {
+                closedir(dir);
+                errno = ENOMEM;
+                return NULL;
+        }
+        listing->refs = 1;
+
+        while (1) {
+                char full_path[PATH_MAX];
+                char tmp[PATH_MAX];
+                char raw[PATH_MAX];
+                const char *name;
+                struct stat st;
+
+                errno = 0;
+                ent = readdir(dir);
+                if (ent == NULL) {
+                        if (errno) {
+                                goto failed;
+                        }
+                        break;
+                }
+                name = ent->d_name;
+
+                if (strcmp(node->path, ".")) {
+                        snprintf(full_path, PATH_MAX, "%s/%s",
+                                 node->path, name);
+                } else {
+                        snprintf(full_path, PATH_MAX, "%s", name);
+                }
+
+                if (reverse) {
+                        /* <image>.bin is listed as <image>.bin.ecm and
+                         * <image>.bin.ecm.edi
+                         */
+                        snprintf(tmp, PATH_MAX, "%s.ecm", name);
+                        if (encoded_image(node->fd, tmp, raw,
+                                          sizeof(raw)) == ENCODED_ECM) {
+                                if (listing_add(listing, &size, tmp,
+                                                ent->d_ino, S_IFREG)) {
+                                        errno = ENOMEM;
+                                        goto failed;
+                                }
+                                strcat(tmp, ".edi");
+                                name = tmp;
+                        }
+                } else if (need_ecm_uncompress(full_path)) {
+                        snprintf(tmp, PATH_MAX, "%s", name);
+                        if (strlen(tmp) > 8 &&
+                            !strcmp(tmp + strlen(tmp) - 8, ".ecm.edi")) {
+                                /* <image>.ecm.edi is listed as <image> */
+                                tmp[strlen(tmp) - 8] = 0;
+                        } else if (cooked_view && ecm_suffix_len(tmp)) {
+                                /* and <image>.ecm as its cooked view */
+                                tmp[strlen(tmp) - ecm_suffix_len(tmp)] = 0;
+                                cooked_name(tmp, sizeof(tmp));
+                                if (fstatat(node->fd, tmp, &st,
+                                            AT_NO_AUTOMOUNT) == 0) {
+                                        tmp[0] = 0;
+                                }
+                        } else {
+                                tmp[0] = 0;
+                        }
+                        if (tmp[0] == 0) {
+                                continue;
+                        }
+                        name = tmp;
+                }
+
+                if (listing_add(listing, &size, name, ent->d_ino,
+                                ent->d_type << 12)) {
+                        errno = ENOMEM;
+                        goto failed;
+                }
+        }
+        closedir(dir);
+        return listing;
+
+failed:
+        fd = errno;
+        closedir(dir);
+        listing_unref(listing);
+        errno = fd;
+        return NULL;
+}
+
+/* Returns a reference to the listing of a directory, from the cache if
+ * the directory is watched.
+ */
+static struct listing *node_listing(struct node *node)
+{
+        struct listing *listing;
+        uint64_t gen;
+
+        pthread_mutex_lock(&nodes.mutex);
+        listing = node->listing;
+        if (listing) {
+                __atomic_add_fetch(&listing->refs, 1, __ATOMIC_RELAXED);
+        }
+        gen = node->listing_gen;
+        pthread_mutex_unlock(&nodes.mutex);
+        if (listing) {
+                return listing;
+        }
+
+        listing = listing_build(node);
+        if (listing == NULL || !node->watched) {
+                return listing;
+        }
+
+        /* only keep it if nothing changed while we were reading */
+        pthread_mutex_lock(&nodes.mutex);
+        if (node->listing == NULL && node->listing_gen == gen) {
+                node->listing = listing;
+                __atomic_add_fetch(&listing->refs, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&nodes.mutex);
+        return listing;
+}
+
+static void fuse_unecm_lookup(fuse_req_t req, fuse_ino_t parent,
+                              const char *name)
+{
+        struct node *dir = ino_to_node(parent);
+        struct fuse_entry_param e;
+        struct node *node;
+
+        LOG("LOOKUP [%s] [%s]\n", dir->path, name);
+        note_request();
+
+        memset(&e, 0, sizeof(e));
+        e.attr_timeout = ATTR_TIMEOUT;
+        e.entry_timeout = ATTR_TIMEOUT;
+
+        pthread_mutex_lock(&nodes.mutex);
+        node = node_find(dir, name);
+        if (node) {
+                node->refs++;
+        }
+        pthread_mutex_unlock(&nodes.mutex);
+
+        if (node == NULL) {
+                node = node_new(dir, name);
+                if (node == NULL) {
+                        fuse_reply_err(req, errno);
+                        return;
+                }
+        }
+        if (node_stat(node, &e.attr)) {
+                int err = errno;
+
+                LOG("LOOKUP [%s] %s\n", node->path, strerror(err));
+                node_unref(node, 1);
+                fuse_reply_err(req, err);
+                return;
+        }
+        e.ino = node_to_ino(node);
+        fuse_reply_entry(req, &e);
+}
+
+static void fuse_unecm_forget(fuse_req_t req, fuse_ino_t ino,
+                              unsigned long nlookup)
+{
+        node_unref(ino_to_node(ino), nlookup);
+        fuse_reply_none(req);
+}
+
+static void fuse_unecm_getattr(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi)
+{
+        struct node *node = ino_to_node(ino);
+        struct stat st;
+
+        LOG("GETATTR [%s]\n", node->path);
+        note_request();
+
+        if (node_stat(node, &st)) {
+                LOG("GETATTR fstatat failed [%s] %s\n",
+                    node->path, strerror(errno));
+                fuse_reply_err(req, errno);
+                return;
+        }
+        fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+/*
+ * Request capture.
+ *
+ * With --trace=<file> every OPEN, READ and RELEASE of a file is written to
+ * <file> in the format described in ecm-trace.h, with its time and how
+ * long it took, so that the load can be replayed later with ecm-replay.
+ * Each record is written with a single fwrite() so records from several
+ * threads do not interleave.
+ */
+static uint64_t now_us(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void capture_start(const char *path)
+{
+        trace_file = fopen(path, "w");
+        if (trace_file == NULL) {
+                printf("Failed to create trace %s : %s\n", path,
+                       strerror(errno));
+                exit(1);
+        }
+        setvbuf(trace_file, NULL, _IOFBF, 1024 * 1024);
+        fwrite(ECM_TRACE_MAGIC, 8, 1, trace_file);
+        trace_start = now_us();
+}
+
+static void capture(int op, struct file *file, uint64_t start, off_t offset,
+                    size_t size, ssize_t result, int flags, const char *path,
+                    const char *ecm)
+{
+        char buf[sizeof(struct ecm_trace_record) + 2 * PATH_MAX];
+        struct ecm_trace_record r;
+        size_t path_len = path ? strlen(path) : 0;
+        size_t ecm_len = ecm ? strlen(ecm) : 0;
+        uint64_t now = now_us();
+
+        memset(&r, 0, sizeof(r));
+        r.time = htole64(start - trace_start);
+        r.offset = htole64(offset);
+        r.handle = htole32(file->handle);
+        r.size = htole32(size);
+        r.result = htole32(result < 0 ? -errno : result);
+        r.latency = htole32(now - start);
+        r.op = op;
+        r.flags = flags;
+        r.path_len = htole16(path_len);
+        r.ecm_len = htole16(ecm_len);
+
+        memcpy(buf, &r, sizeof(r));
+        memcpy(buf + sizeof(r), path, path_len);
+        memcpy(buf + sizeof(r) + path_len, ecm, ecm_len);
+        fwrite(buf, sizeof(r) + path_len + ecm_len, 1, trace_file);
+}
+
+/*
+ * Learned prefetch.
+ *
+ * With --prefetch the ranges of an image that are read in the first
+ * TRACE_SECONDS after it is opened are recorded, in TRACE_GRAIN sized
+ * units and in the order they were first read, and saved when the image
+ * is closed. The trace is keyed by the identity of the image, like the
+ * chunk cache, so it is forgotten when the image changes.
+ *
+ * The next time the image is opened a thread reads the recorded ranges
+ * ahead of the emulator, at prefetch priority, and pushes the decoded data
+ * into the kernel page cache of the file, and into the chunk cache if
+ * there is one. A short trace, for example from a file manager reading
+ * the first few sectors, does not replace a longer one.
  */
-static int need_ecm_uncompress(const char *file) {
-        char stripped[PATH_MAX];
-        char tmp[PATH_MAX];
-        struct stat st;
-        TDB_DATA key, data;
-        uint8_t ret = 1;
+#define TRACE_SHIFT    16
+#define TRACE_GRAIN    (1 << TRACE_SHIFT)
+#define TRACE_MAX      1024
+#define TRACE_SECONDS  60
+#define TRACE_MAGIC    "ECMT"
+#define PREFETCH_MAX   (64 << 20)
 
-        LOG("NEED_ECM_UNCOMPRESS [%s]\n", file);
-        key.dptr = discard_const(file);
-        key.dsize = strlen(file);
-        data = tdb_fetch(nu_tdb, key);
-        if (data.dptr) {
-                uint8_t val = data.dptr[0];
-                free(data.dptr);
-                return val;
+struct trace_range {
+        uint32_t start;         /* in TRACE_GRAIN units */
+        uint32_t count;
+};
+
+struct trace {
+        pthread_mutex_t mutex;
+        uint64_t key;
+        uint64_t opened;        /* ms */
+        uint64_t old_grains;    /* size of the trace that was loaded */
+        int count;
+        struct trace_range range[TRACE_MAX];
+};
+
+struct prefetch {
+        struct node *node;
+        struct file file;
+        int count;
+        struct trace_range range[TRACE_MAX];
+};
+
+static uint64_t trace_grains(struct trace_range *range, int count)
+{
+        uint64_t grains = 0;
+        int i;
+
+        for (i = 0; i < count; i++) {
+                grains += range[i].count;
         }
+        return grains;
+}
 
-        LOG("NEED_ECM_UNCOMPRESS SLOW PATH [%s]\n", file);
+/* Returns the number of ranges recorded for an image, or -1 */
+static int trace_load(uint64_t key, struct trace_range *range)
+{
+        char name[PATH_MAX], magic[4];
+        uint32_t count;
+        int fd, i;
 
-        snprintf(stripped, PATH_MAX,"%s", file);
-        if (strlen(stripped) > 4 &&
-            !strcmp(stripped + strlen(stripped) - 4, ".edi")) {
-                stripped[strlen(stripped) - 4] = 0;
+        snprintf(name, sizeof(name), "%s/%016" PRIx64, trace_dir, key);
+        fd = open(name, O_RDONLY);
+        if (fd == -1) {
+                return -1;
         }
-        if (strlen(stripped) > 4 &&
-            !strcmp(stripped + strlen(stripped) - 4, ".ecm")) {
-                stripped[strlen(stripped) - 4] = 0;
+        if (read(fd, magic, 4) != 4 || memcmp(magic, TRACE_MAGIC, 4) ||
+            read(fd, &count, 4) != 4 ||
+            (count = le32toh(count)) > TRACE_MAX ||
+            read(fd, range, count * sizeof(struct trace_range)) !=
+            (ssize_t)(count * sizeof(struct trace_range))) {
+                close(fd);
+                return -1;
         }
+        close(fd);
+        for (i = 0; i < (int)count; i++) {
+                range[i].start = le32toh(range[i].start);
+                range[i].count = le32toh(range[i].count);
+        }
+        return count;
+}
 
-        if (fstatat(dir_fd, stripped, &st, AT_NO_AUTOMOUNT) == 0) {
-                ret = 0;
-                goto finished;
+static void trace_save(struct trace *t)
+{
+        char name[PATH_MAX], tmp[PATH_MAX];
+        uint32_t count = htole32(t->count);
+        int fd, i;
+
+        snprintf(name, sizeof(name), "%s/%016" PRIx64, trace_dir, t->key);
+        snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", name,
+                 (long)syscall(SYS_gettid));
+        for (i = 0; i < t->count; i++) {
+                t->range[i].start = htole32(t->range[i].start);
+                t->range[i].count = htole32(t->range[i].count);
         }
-        snprintf(tmp, PATH_MAX, "%s.ecm", stripped);
-        if (fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) != 0) {
-                ret = 0;
-                goto finished;
+        fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        if (fd == -1) {
+                return;
         }
-        snprintf(tmp, PATH_MAX, "%s.ecm.edi", stripped);
-        if (fstatat(dir_fd, tmp, &st, AT_NO_AUTOMOUNT) != 0) {
-                ret = 0;
-                goto finished;
+        if (write(fd, TRACE_MAGIC, 4) != 4 || write(fd, &count, 4) != 4 ||
+            write(fd, t->range, t->count * sizeof(struct trace_range)) !=
+            (ssize_t)(t->count * sizeof(struct trace_range)) ||
+            rename(tmp, name)) {
+                unlink(tmp);
         }
-        
-finished:
-        data.dptr = &ret;
-        data.dsize = 1;
-        tdb_store(nu_tdb, key, data, TDB_REPLACE);
-        return ret;
+        close(fd);
 }
 
-static int fuse_unecm_read(const char *path, char *buf, size_t size,
-                           off_t offset, struct fuse_file_info *ffi)
+static void trace_record(struct trace *t, off_t offset, size_t size)
 {
-        struct file *file;
-        int ret;
-        
-        if (path[0] == '/') {
-                path++;
+        struct trace_range *last;
+        uint32_t first, end;
+
+        if (size == 0 || now_ms() - t->opened > TRACE_SECONDS * 1000) {
+                return;
         }
+        first = offset >> TRACE_SHIFT;
+        end = ((offset + size - 1) >> TRACE_SHIFT) + 1;
 
-        LOG("READ [%s]\n", path);
+        pthread_mutex_lock(&t->mutex);
+        last = t->count ? &t->range[t->count - 1] : NULL;
+        if (last && first >= last->start &&
+            first <= last->start + last->count) {
+                /* continues, or re-reads, the previous range */
+                if (end > last->start + last->count) {
+                        last->count = end - last->start;
+                }
+        } else if (t->count < TRACE_MAX) {
+                t->range[t->count].start = first;
+                t->range[t->count].count = end - first;
+                t->count++;
+        }
+        pthread_mutex_unlock(&t->mutex);
+}
 
-        file = (void *)ffi->fh;
-        if (file->ecm) {
-                ret = ecm_read(file->ecm, buf, offset, size);
-                if (ret == -1) {
-                        LOG("READ ecm_read failed [%s] %jd:%zu %s\n",
-                            path, offset, size, strerror(errno));
-                        return -errno;
+static void *prefetch_worker(void *arg)
+{
+        struct prefetch *p = arg;
+        fuse_ino_t ino = node_to_ino(p->node);
+        size_t total = 0;
+        char *buf;
+        int i;
+
+        buf = malloc(TRACE_GRAIN);
+        for (i = 0; buf && i < p->count && total < PREFETCH_MAX; i++) {
+                off_t offset = (off_t)p->range[i].start << TRACE_SHIFT;
+                off_t end = offset +
+                        ((off_t)p->range[i].count << TRACE_SHIFT);
+
+                for (; offset < end && total < PREFETCH_MAX;
+                     offset += TRACE_GRAIN) {
+                        struct fuse_bufvec bufv;
+                        ssize_t n;
+
+                        sched_enter(SCHED_PREFETCH, p->file.sched_key);
+                        if (p->file.shm_key) {
+                                n = shm_read(&p->file, buf, offset,
+                                             TRACE_GRAIN);
+                        } else if (p->file.cache_key) {
+                                n = cache_read(&p->file, buf, offset,
+                                               TRACE_GRAIN);
+                        } else {
+                                n = ecm_read(p->file.ecm, buf, offset,
+                                             TRACE_GRAIN);
+                        }
+                        sched_leave(SCHED_PREFETCH, p->file.sched_key);
+                        if (n <= 0) {
+                                break;
+                        }
+                        bufv = FUSE_BUFVEC_INIT(n);
+                        bufv.buf[0].mem = buf;
+                        fuse_lowlevel_notify_store(fuse_ch, ino, offset,
+                                                   &bufv, 0);
+                        total += n;
                 }
-                LOG("READ ECM [%s] %jd:%zu %d\n", path, offset, size, ret);
-                return ret;
         }
-        
-        /* Passthrough to underlying filesystem */
-        ret = pread(file->fd, buf, size, offset);
-        LOG("READ underlying file [%s] %jd:%zu %d\n", path, offset, size, ret);
-        return (ret == -1) ? -errno : ret;
+        LOG("PREFETCH [%s] %zu bytes\n", p->node->path, total);
+
+        free(buf);
+        ecm_close_file(p->file.ecm);
+        node_unref(p->node, 1);
+        free(p);
+        return NULL;
 }
 
-static int fuse_unecm_release(const char *path, struct fuse_file_info *ffi)
+/* Start recording the reads of an image, and prefetch what was read the
+ * last time it was opened.
+ */
+static void trace_open(struct node *node, struct file *file, uint64_t key)
 {
-        struct file *file = (struct file *)ffi->fh;
-        
-        if (path[0] == '/') {
-                path++;
+        struct prefetch *p;
+        pthread_t thread;
+        int count;
+
+        file->trace = calloc(1, sizeof(struct trace));
+        p = malloc(sizeof(struct prefetch));
+        if (file->trace == NULL || p == NULL) {
+                free(file->trace);
+                file->trace = NULL;
+                free(p);
+                return;
         }
+        pthread_mutex_init(&file->trace->mutex, NULL);
+        file->trace->key = key;
+        file->trace->opened = now_ms();
 
-        LOG("RELEASE [%s]\n", path);
+        count = trace_load(key, p->range);
+        if (count <= 0) {
+                free(p);
+                return;
+        }
+        file->trace->old_grains = trace_grains(p->range, count);
 
-        if (file == NULL) {
-                return 0;
+        /* the kernel keeps the pages as long as the node, so once is
+         * enough even if the image is opened many times
+         */
+        if (__atomic_exchange_n(&node->prefetched, 1, __ATOMIC_RELAXED)) {
+                free(p);
+                return;
         }
-        if (file->ecm) {
-                ecm_close_file(file->ecm);
+
+        p->count = count;
+        p->node = node;
+        p->file = *file;
+        p->file.trace = NULL;
+        /* a handle of its own, it may outlive the one of the open */
+        p->file.ecm = ecm_open_file(node->parent->fd, node->ecm_name);
+        if (p->file.ecm == NULL) {
+                free(p);
+                return;
+        }
+        if (direct_blocks) {
+                ecm_set_direct_io(p->file.ecm, direct_blocks);
         }
-        if (file->fd != -1) {
-                close(file->fd);
+        pthread_mutex_lock(&nodes.mutex);
+        node->refs++;
+        pthread_mutex_unlock(&nodes.mutex);
+        if (pthread_create(&thread, NULL, prefetch_worker, p)) {
+                LOG("PREFETCH failed to create thread %s\n", strerror(errno));
+                ecm_close_file(p->file.ecm);
+                node_unref(node, 1);
+                free(p);
+                return;
         }
-        free(file);
+        pthread_detach(thread);
+}
 
-        return 0;
+static void trace_close(struct file *file)
+{
+        struct trace *t = file->trace;
+
+        if (t->count && trace_grains(t->range, t->count) >= t->old_grains / 2) {
+                trace_save(t);
+        }
+        pthread_mutex_destroy(&t->mutex);
+        free(t);
 }
 
-static int fuse_unecm_open(const char *path, struct fuse_file_info *ffi)
+static void fuse_unecm_open(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi)
 {
-        struct stat st;
-        int ret;
-        struct file *file = malloc(sizeof(struct file));
+        struct node *node = ino_to_node(ino);
+        struct file *file;
+        uint64_t key = 0, start = now_us();
+
+        LOG("OPEN [%s]\n", node->path);
+        note_request();
 
+        file = malloc(sizeof(struct file));
+        if (file == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
+        }
         file->ecm = NULL;
+        file->cooked = node->cooked;
         file->fd = -1;
+        file->cache_key = 0;
+        file->shm_key = 0;
+        file->sched_key = 0;
+        file->next_offset = 0;
+        file->trace = NULL;
+        file->handle = 0;
+        file->map = NULL;
+        file->index = NULL;
+        file->index_len = 0;
 
-        if (path[0] == '/') {
-                path++;
+        if (node->ecm || node->encoded) {
+                file->sched_key = sched_key(node->parent->fd, node->ecm_name);
         }
+        if (node->encoded) {
+                file->fd = openat(node->parent->fd, node->ecm_name, O_RDONLY);
+                if (node->encoded == ENCODED_ECM) {
+                        file->map = node->map;
+                } else {
+                        file->index = ecm_map_index(node->map,
+                                                    &file->index_len);
+                }
+                if (file->fd == -1 || (file->map == NULL &&
+                                       file->index == NULL)) {
+                        int err = file->fd == -1 ? errno : ENOMEM;
 
-        LOG("OPEN [%s]\n", path);
+                        if (file->fd != -1) {
+                                close(file->fd);
+                        }
+                        free(file);
+                        LOG("OPEN ENCODED [%s] %s\n", node->path,
+                            strerror(err));
+                        fuse_reply_err(req, err);
+                        return;
+                }
+        } else if (node->ecm) {
+                file->ecm = ecm_open_file(node->parent->fd, node->ecm_name);
+                if (file->ecm == NULL) {
+                        free(file);
+                        LOG("OPEN Failed to open ECM [%s]\n", node->path);
+                        fuse_reply_err(req, ENOENT);
+                        return;
+                }
+                if (direct_blocks) {
+                        if (ecm_set_direct_io(file->ecm, direct_blocks)) {
+                                LOG("OPEN O_DIRECT not available [%s]\n",
+                                    node->path);
+                        } else {
+                                /* the decoded data is the only copy in
+                                 * the page cache, keep it across opens
+                                 */
+                                fi->keep_cache = 1;
+                        }
+                }
+                if (uring_entries &&
+                    ecm_set_io_uring(file->ecm, uring_entries)) {
+                        LOG("OPEN io_uring not available [%s]\n",
+                            node->path);
+                }
+                if (cache.fd != -1 || shm.hdr ||
+                    (trace_dir && !node->cooked)) {
+                        struct stat st;
 
-        ret = fstatat(dir_fd, path, &st, AT_NO_AUTOMOUNT);
-        if (ret && errno == ENOENT) {
-                if (need_ecm_uncompress(path)) {
-                        char tmp[PATH_MAX];
-
-                        snprintf(tmp, PATH_MAX, "%s.ecm", path);
-                        file->ecm = ecm_open_file(dir_fd, tmp);
-                        if (file->ecm == NULL) {
-                                free(file);
-                                LOG("OPEN Failed to open ECM [%s]\n", path);
-                                return -ENOENT;
+                        if (fstatat(node->parent->fd, node->ecm_name, &st,
+                                    0) == 0) {
+                                key = cache_key(node->path, &st);
+                                if (shm.hdr && !node->cooked) {
+                                        file->shm_key = shm_key(&st);
+                                }
                         }
+                }
+                if (cache.fd != -1) {
+                        file->cache_key = key;
+                }
+                if (trace_dir && !node->cooked && key) {
+                        trace_open(node, file, key);
+                        /* keep what was prefetched across opens */
+                        fi->keep_cache = 1;
+                }
+        } else {
+                file->fd = openat(node->parent->fd, node->name, O_RDONLY);
+                if (file->fd == -1) {
+                        int err = errno;
 
-                        ffi->fh = (uint64_t)file;
-                        return 0;
+                        free(file);
+                        LOG("OPEN FD [%s] %s\n", node->path, strerror(err));
+                        fuse_reply_err(req, err);
+                        return;
                 }
         }
+        fi->fh = (uintptr_t)file;
+        LOG("OPEN [%s] SUCCESS\n", node->path);
+        if (trace_file) {
+                char ecm_path[PATH_MAX];
 
-        file->fd = openat(dir_fd, path, O_RDONLY);
-        if (file->fd == -1) {
-                free(file);
-                LOG("OPEN FD [%s] %s\n", path, strerror(errno));
-                return -errno;
+                ecm_path[0] = 0;
+                if (node->ecm && strcmp(node->parent->path, ".")) {
+                        snprintf(ecm_path, PATH_MAX, "%s/%s",
+                                 node->parent->path, node->ecm_name);
+                } else if (node->ecm) {
+                        snprintf(ecm_path, PATH_MAX, "%s", node->ecm_name);
+                }
+                file->handle = __atomic_add_fetch(&trace_handles, 1,
+                                                  __ATOMIC_RELAXED);
+                capture(ECM_TRACE_OPEN, file, start, 0, 0, 0,
+                        node->cooked ? ECM_TRACE_COOKED : 0, node->path,
+                        ecm_path);
         }
-        ffi->fh = (uint64_t)file;
-        LOG("OPEN FD [%s] SUCCESS\n", path);
-        return 0;
+        fuse_reply_open(req, fi);
 }
 
-/* returns the size of the uncompressed file, or 0 if it could not be
- * determined.
- */
-static off_t get_uncompressed_size(const char *path)
+static void fuse_unecm_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t offset, struct fuse_file_info *fi)
 {
-        struct ecm *ecm;
-        size_t pos;
-        TDB_DATA key, data;
+        struct node *node = ino_to_node(ino);
+        struct file *file = (struct file *)(uintptr_t)fi->fh;
+        uint64_t start = now_us();
+        char *buf;
+        ssize_t ret;
+        int class;
 
-        LOG("GET_UNCOMPRESSED_SIZE [%s]\n", path);
+        LOG("READ [%s]\n", node->path);
+        note_request();
 
-        key.dptr = discard_const(path);
-        key.dsize = strlen(path);
-        data = tdb_fetch(filesize_tdb, key);
-        if (data.dptr) {
-                off_t size = *(off_t *)data.dptr;
-                free(data.dptr);
-                return size;
+        buf = malloc(size);
+        if (buf == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
         }
 
-        LOG("GET_UNCOMPRESSED_SIZE SLOW PATH [%s]\n", path);
+        class = offset == file->next_offset ? SCHED_SEQUENTIAL : SCHED_RANDOM;
+        file->next_offset = offset + size;
+        if (file->trace) {
+                trace_record(file->trace, offset, size);
+        }
+        if (file->ecm || file->map) {
+                sched_enter(class, file->sched_key);
+        }
 
-        ecm = ecm_open_file(dir_fd, path);
-        if (ecm == NULL) {
-                LOG("Failed to open ECM file %s in get_uncompressed_size\n",
-                    path);
-                return 0;
+        if (file->map) {
+                ret = ecm_map_read(file->map, file->fd, buf, offset, size);
+                LOG("READ ENCODED [%s] %jd:%zu %zd\n", node->path,
+                    (intmax_t)offset, size, ret);
+        } else if (file->index) {
+                ret = 0;
+                if (offset < (off_t)file->index_len) {
+                        ret = file->index_len - offset;
+                        if (ret > (ssize_t)size) {
+                                ret = size;
+                        }
+                        memcpy(buf, file->index + offset, ret);
+                }
+        } else if (file->ecm && file->cooked) {
+                ret = ecm_read_cooked(file->ecm, buf, offset, size);
+                LOG("READ COOKED [%s] %jd:%zu %zd\n", node->path,
+                    (intmax_t)offset, size, ret);
+        } else if (file->ecm && file->shm_key) {
+                ret = shm_read(file, buf, offset, size);
+                LOG("READ SHM [%s] %jd:%zu %zd\n", node->path,
+                    (intmax_t)offset, size, ret);
+        } else if (file->ecm && file->cache_key) {
+                ret = cache_read(file, buf, offset, size);
+                LOG("READ CACHE [%s] %jd:%zu %zd\n", node->path,
+                    (intmax_t)offset, size, ret);
+        } else if (file->ecm) {
+                ret = ecm_read(file->ecm, buf, offset, size);
+                if (ret == -1) {
+                        LOG("READ ecm_read failed [%s] %jd:%zu %s\n",
+                            node->path, (intmax_t)offset, size,
+                            strerror(errno));
+                } else {
+                        LOG("READ ECM [%s] %jd:%zu %zd\n", node->path,
+                            (intmax_t)offset, size, ret);
+                }
+        } else {
+                /* Passthrough to underlying filesystem */
+                ret = pread(file->fd, buf, size, offset);
+                LOG("READ underlying file [%s] %jd:%zu %zd\n", node->path,
+                    (intmax_t)offset, size, ret);
         }
-        pos = ecm_get_file_size(ecm);
-        ecm_close_file(ecm);
-        LOG("GET_UNCOMPRESSED_SIZE [%s] %zu\n", path, pos);
+        if (file->ecm || file->map) {
+                sched_leave(class, file->sched_key);
+        }
+        if (trace_file) {
+                int err = errno;
 
-        data.dptr = (uint8_t *)&pos;
-        data.dsize = sizeof(pos);
-        tdb_store(filesize_tdb, key, data, TDB_REPLACE);
+                capture(ECM_TRACE_READ, file, start, offset, size, ret, 0,
+                        NULL, NULL);
+                errno = err;
+        }
 
-        return pos;
+        if (ret == -1) {
+                fuse_reply_err(req, errno);
+        } else {
+                fuse_reply_buf(req, buf, ret);
+        }
+        free(buf);
 }
 
-static int fuse_unecm_getattr(const char *path, struct stat *stbuf)
+static void fuse_unecm_release(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi)
 {
-        int ret;
+        struct file *file = (struct file *)(uintptr_t)fi->fh;
 
-        LOG("GETATTR [%s]\n", path);
+        LOG("RELEASE [%s]\n", ino_to_node(ino)->path);
 
-        if (path[0] == '/') {
-                path++;
+        if (file) {
+                if (trace_file) {
+                        capture(ECM_TRACE_RELEASE, file, now_us(), 0, 0, 0,
+                                0, NULL, NULL);
+                }
+                if (file->trace) {
+                        trace_close(file);
+                }
+                if (file->ecm) {
+                        ecm_close_file(file->ecm);
+                }
+                if (file->fd != -1) {
+                        close(file->fd);
+                }
+                free(file->index);
+                free(file);
         }
+        fuse_reply_err(req, 0);
+}
 
-        ret = fstatat(dir_fd, path, stbuf, AT_NO_AUTOMOUNT|AT_EMPTY_PATH);
-        if (ret && errno == ENOENT) {
-                if (need_ecm_uncompress(path)) {
-                        char tmp[PATH_MAX];
-                        int fd;
-
-                        snprintf(tmp, PATH_MAX, "%s.ecm", path);
-                        ret = fstatat(dir_fd, tmp, stbuf, AT_NO_AUTOMOUNT);
-                        if (ret) {
-                                LOG("GETATTR fstatat failed [%s] %s\n",
-                                    path, strerror(errno));
-                                return -errno;
-                        }
+static void fuse_unecm_opendir(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi)
+{
+        struct node *node = ino_to_node(ino);
+        struct listing *listing;
 
-                        stbuf->st_size = get_uncompressed_size(tmp);
-                        LOG("GETATTR [%s] SUCCESS\n", path);
-                        return 0;
-                }
+        LOG("OPENDIR [%s]\n", node->path);
+        note_request();
+
+        if (node->fd == -1) {
+                fuse_reply_err(req, ENOTDIR);
+                return;
         }
-        if (ret) {
-                LOG("GETATTR [%s] SUCCESS\n", path);
-                return -errno;
+        listing = node_listing(node);
+        if (listing == NULL) {
+                fuse_reply_err(req, errno);
+                return;
         }
-        LOG("GETATTR [%s] SUCCESS\n", path);
-        return 0;
+        fi->fh = (uintptr_t)listing;
+        fuse_reply_open(req, fi);
 }
 
-static int fuse_unecm_readdir(const char *path, void *buf,
-                              fuse_fill_dir_t filler,
-                              off_t offset, struct fuse_file_info *fi)
+static void fuse_unecm_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                               off_t offset, struct fuse_file_info *fi)
 {
-        DIR *dir;
-        struct dirent *ent;
-        int fd;
+        struct node *node = ino_to_node(ino);
+        struct listing *listing = (struct listing *)(uintptr_t)fi->fh;
+        size_t pos = 0;
+        char *buf;
 
-        if (path[0] == '/') {
-                path++;
+        LOG("READDIR [%s] %jd\n", node->path, (intmax_t)offset);
+        note_request();
+
+        buf = malloc(size);
+        if (buf == NULL) {
+                fuse_reply_err(req, ENOMEM);
+                return;
         }
-        if (path[0] == '\0') {
-                path = ".";
+
+        /* the offset of an entry is the index of the one after it */
+        for (; offset >= 0 && (size_t)offset < listing->count; offset++) {
+                struct listing_entry *e = &listing->entries[offset];
+                struct stat st;
+                size_t len;
+
+                memset(&st, 0, sizeof(st));
+                st.st_ino = e->ino;
+                st.st_mode = e->mode;
+                len = fuse_add_direntry(req, buf + pos, size - pos,
+                                        e->name, &st, offset + 1);
+                if (len > size - pos) {
+                        break;
+                }
+                pos += len;
         }
+        fuse_reply_buf(req, buf, pos);
+        free(buf);
+}
 
-        LOG("READDIR [%s]\n", path);
+static void fuse_unecm_releasedir(fuse_req_t req, fuse_ino_t ino,
+                                  struct fuse_file_info *fi)
+{
+        listing_unref((struct listing *)(uintptr_t)fi->fh);
+        fuse_reply_err(req, 0);
+}
 
-        fd = openat(dir_fd, path, O_DIRECTORY);
-        dir = fdopendir(fd);
-        if (dir == NULL) {
-                return -errno;
+static void fuse_unecm_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+        struct statvfs stbuf;
+
+        LOG("STATFS [%s]\n", ino_to_node(ino)->path);
+
+        if (fstatvfs(dir_fd, &stbuf)) {
+                fuse_reply_err(req, errno);
+                return;
         }
-        while ((ent = readdir(dir)) != NULL) {
-                struct ecm *e = NULL;
-                char full_path[PATH_MAX];
+        fuse_reply_statfs(req, &stbuf);
+}
 
-                if (strcmp(path, ".")) {
-                        snprintf(full_path, PATH_MAX, "%s/%s",
-                                 path, ent->d_name);
-                } else {
-                        strcpy(full_path, ent->d_name);
-                }
+/*
+ * On-demand verification.
+ *
+ * Reading the extended attribute "user.ecm.verify" of an uncompressed
+ * image starts a verification of the whole image against its EDC in the
+ * background and returns "RUNNING". Once it has finished, reading the
+ * attribute again returns the result, "OK", "CORRUPT ..." or "Out of
+ * memory", after which the next read starts a new verification.
+ *
+ *   getfattr -n user.ecm.verify foo.bin
+ *
+ * Only one image is verified at a time.
+ */
+#define VERIFY_XATTR "user.ecm.verify"
 
-                if (need_ecm_uncompress(full_path)) {
-                        char tmp[PATH_MAX];
+#define VERIFY_IDLE    0
+#define VERIFY_RUNNING 1
+#define VERIFY_DONE    2
 
-                        snprintf(tmp, PATH_MAX, "%s", ent->d_name);
-                        if (strlen(tmp) > 8 &&
-                            !strcmp(tmp + strlen(tmp) - 8, ".ecm.edi")) {
-                                tmp[strlen(tmp) - 8] = 0;
-                                filler(buf, tmp, NULL, 0);
-                        }
-                        continue;
+static struct {
+        pthread_mutex_t mutex;
+        int state;
+        char path[PATH_MAX];
+        char result[256];
+} verify = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *verify_thread(void *arg)
+{
+        char tmp[PATH_MAX];
+        struct ecm *ecm;
+        off_t offset;
+        uint64_t image;
+        int ret, threads, i;
+
+        /* a scrub is background work, the threads of ecm_verify()
+         * inherit these priorities
+         */
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+        snprintf(tmp, PATH_MAX, "%s.ecm", verify.path);
+        image = sched_key(dir_fd, tmp);
+
+        /* one background slot for each thread, and no more threads than
+         * background work may have slots
+         */
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (queue_depth && threads > sched.limit[SCHED_BACKGROUND]) {
+                threads = sched.limit[SCHED_BACKGROUND];
+        }
+        if (threads < 1) {
+                threads = 1;
+        }
+        for (i = 0; i < threads; i++) {
+                sched_enter(SCHED_BACKGROUND, image);
+        }
+        ecm = ecm_open_file(dir_fd, tmp);
+        if (ecm == NULL) {
+                ret = ECM_VERIFY_READ_ERROR;
+                offset = 0;
+        } else {
+                ret = ecm_verify(ecm, threads, &offset);
+                ecm_close_file(ecm);
+        }
+        for (i = 0; i < threads; i++) {
+                sched_leave(SCHED_BACKGROUND, image);
+        }
+
+        pthread_mutex_lock(&verify.mutex);
+        switch (ret) {
+        case ECM_VERIFY_OK:
+                snprintf(verify.result, sizeof(verify.result), "OK");
+                break;
+        case ECM_VERIFY_READ_ERROR:
+                snprintf(verify.result, sizeof(verify.result),
+                         "CORRUPT unreadable data at offset %jd",
+                         (intmax_t)offset);
+                break;
+        case ECM_VERIFY_NO_MEMORY:
+                snprintf(verify.result, sizeof(verify.result),
+                         "Out of memory");
+                break;
+        default:
+                snprintf(verify.result, sizeof(verify.result),
+                         "CORRUPT EDC mismatch");
+                break;
+        }
+        verify.state = VERIFY_DONE;
+        pthread_mutex_unlock(&verify.mutex);
+
+        LOG("VERIFY [%s] %s\n", verify.path, verify.result);
+        return NULL;
+}
+
+static void fuse_unecm_getxattr(fuse_req_t req, fuse_ino_t ino,
+                                const char *name, size_t size)
+{
+        struct node *node = ino_to_node(ino);
+        char result[sizeof(verify.result)];
+        pthread_t thread;
+        size_t len;
+
+        LOG("GETXATTR [%s] %s\n", node->path, name);
+        note_request();
+
+        if (strcmp(name, VERIFY_XATTR) || !node->ecm || node->cooked) {
+                fuse_reply_err(req, ENODATA);
+                return;
+        }
+
+        pthread_mutex_lock(&verify.mutex);
+        if (verify.state != VERIFY_IDLE && strcmp(verify.path, node->path)) {
+                if (verify.state == VERIFY_RUNNING) {
+                        pthread_mutex_unlock(&verify.mutex);
+                        fuse_reply_err(req, EBUSY);
+                        return;
+                }
+                verify.state = VERIFY_IDLE;
+        }
+        if (verify.state == VERIFY_IDLE) {
+                snprintf(verify.path, PATH_MAX, "%s", node->path);
+                verify.state = VERIFY_RUNNING;
+                if (pthread_create(&thread, NULL, verify_thread, NULL)) {
+                        verify.state = VERIFY_IDLE;
+                        pthread_mutex_unlock(&verify.mutex);
+                        fuse_reply_err(req, EAGAIN);
+                        return;
                 }
+                pthread_detach(thread);
+        }
+        snprintf(result, sizeof(result), "%s",
+                 verify.state == VERIFY_RUNNING ? "RUNNING" : verify.result);
+        len = strlen(result);
+        if (size >= len && verify.state == VERIFY_DONE) {
+                verify.state = VERIFY_IDLE;
+        }
+        pthread_mutex_unlock(&verify.mutex);
 
-                filler(buf, ent->d_name, NULL, 0);
+        if (size == 0) {
+                fuse_reply_xattr(req, len);
+        } else if (size < len) {
+                fuse_reply_err(req, ERANGE);
+        } else {
+                fuse_reply_buf(req, result, len);
         }
-        closedir(dir);
-        return 0;
 }
 
-static int fuse_unecm_statfs(const char *path, struct statvfs* stbuf)
+static void fuse_unecm_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-        LOG("STATFS [%s]\n", path);
+        struct node *node = ino_to_node(ino);
+        size_t len = strlen(VERIFY_XATTR) + 1;
+
+        LOG("LISTXATTR [%s]\n", node->path);
 
-        return fstatvfs(dir_fd, stbuf);
+        if (!node->ecm || node->cooked) {
+                len = 0;
+        }
+        if (size == 0) {
+                fuse_reply_xattr(req, len);
+        } else if (size < len) {
+                fuse_reply_err(req, ERANGE);
+        } else {
+                fuse_reply_buf(req, VERIFY_XATTR, len);
+        }
+}
+
+static void fuse_unecm_init(void *userdata, struct fuse_conn_info *conn)
+{
+        /* threads have to be started here, after fuse_daemonize(), or
+         * they would be lost in the fork.
+         */
+        sched_init();
+        if (warm_threads) {
+                warm_start();
+        }
+        watch_start();
+        if (decode_threads && ecm_set_decode_threads(decode_threads)) {
+                LOG("Failed to start decode threads\n");
+        }
 }
 
-static struct fuse_operations unecm_oper = {
+static struct fuse_lowlevel_ops unecm_oper = {
+        .init           = fuse_unecm_init,
+        .lookup         = fuse_unecm_lookup,
+        .forget         = fuse_unecm_forget,
         .getattr        = fuse_unecm_getattr,
         .open           = fuse_unecm_open,
-        .release        = fuse_unecm_release,
         .read           = fuse_unecm_read,
+        .release        = fuse_unecm_release,
+        .opendir        = fuse_unecm_opendir,
         .readdir        = fuse_unecm_readdir,
+        .releasedir     = fuse_unecm_releasedir,
         .statfs         = fuse_unecm_statfs,
+        .getxattr       = fuse_unecm_getxattr,
+        .listxattr      = fuse_unecm_listxattr,
 };
 
 static void print_usage(char *name)
 {
         printf("Usage: %s [-?|--help] [-a|--allow-other] "
                "[-m|--mountpoint=mountpoint] "
-               "[-l|--logfile=<file> [-f|--foreground]", name);
+               "[-l|--logfile=<file> [-f|--foreground] "
+               "[-w|--warm=<threads>] [-u|--io-uring=<depth>] "
+               "[-c|--cooked] [-j|--decode-threads=<threads>] "
+               "[-t|--multi-threaded] [-C|--cache-size=<MiB>] "
+               "[-D|--cache-dir=<directory>] "
+               "[-q|--queue-depth=<reads>] "
+               "[-d|--direct-io=<blocks>] [-p|--prefetch] "
+               "[-T|--trace=<file>] [-S|--shm-cache=<MiB>] "
+               "[-r|--reverse]", name);
         exit(0);
 }
 
 int main(int argc, char *argv[])
 {
         int c, ret = 0, opt_idx = 0;
-        char tdbdir[PATH_MAX];
-        char tdbfile[PATH_MAX];
+        char statedir[PATH_MAX];
+        char statefile[PATH_MAX];
         char *mnt = NULL;
+        int prefetch = 0;
+        char *trace_path = NULL;
         static struct option long_opts[] = {
                 { "help", no_argument, 0, '?' },
                 { "allow-other", no_argument, 0, 'a' },
+                { "cooked", no_argument, 0, 'c' },
                 { "foreground", no_argument, 0, 'f' },
                 { "logfile", required_argument, 0, 'l' },
                 { "mountpoint", required_argument, 0, 'm' },
+                { "warm", required_argument, 0, 'w' },
+                { "io-uring", required_argument, 0, 'u' },
+                { "decode-threads", required_argument, 0, 'j' },
+                { "multi-threaded", no_argument, 0, 't' },
+                { "cache-size", required_argument, 0, 'C' },
+                { "cache-dir", required_argument, 0, 'D' },
+                { "queue-depth", required_argument, 0, 'q' },
+                { "direct-io", required_argument, 0, 'd' },
+                { "prefetch", no_argument, 0, 'p' },
+                { "trace", required_argument, 0, 'T' },
+                { "shm-cache", required_argument, 0, 'S' },
+                { "reverse", no_argument, 0, 'r' },
                 { NULL, 0, 0, 0 }
         };
-        int fuse_unecm_argc = 6;
+        int fuse_unecm_argc = 5;
         char *fuse_unecm_argv[16] = {
                 "fuse-unecm",
                 "<export>",
                 "-omax_write=32768",
                 "-ononempty",
-                "-s",
                 "-odefault_permissions",
                 NULL,
                 NULL,
@@ -420,10 +3563,16 @@ int main(int argc, char *argv[])
                 NULL,
                 NULL,
                 NULL,
+                NULL,
         };
         char fs_name[1024], fs_type[1024];
+        struct fuse_args args;
+        struct fuse_session *se;
+        struct fuse_chan *ch;
+        char *mountpoint;
+        int multithreaded, foreground;
         
-        while ((c = getopt_long(argc, argv, "?hafl:m:", long_opts,
+        while ((c = getopt_long(argc, argv, "?hacC:d:D:fj:l:m:pq:rS:tT:u:w:", long_opts,
                     &opt_idx)) > 0) {
                 switch (c) {
                 case 'h':
@@ -433,18 +3582,61 @@ int main(int argc, char *argv[])
                 case 'a':
                         fuse_unecm_argv[fuse_unecm_argc++] = "-oallow_other";
                         break;
+                case 'c':
+                        cooked_view = 1;
+                        break;
+                case 'C':
+                        cache_size = (off_t)atoll(optarg) << 20;
+                        break;
+                case 'd':
+                        direct_blocks = atoi(optarg);
+                        break;
+                case 'D':
+                        cache_dir = strdup(optarg);
+                        break;
                 case 'f':
                         fuse_unecm_argv[fuse_unecm_argc++] = "-f";
                         break;
+                case 'j':
+                        decode_threads = atoi(optarg);
+                        break;
                 case 'l':
                         logfile = strdup(optarg);
                         break;
                 case 'm':
                         mnt = strdup(optarg);
                         break;
+                case 'p':
+                        prefetch = 1;
+                        break;
+                case 'q':
+                        queue_depth = atoi(optarg);
+                        break;
+                case 'r':
+                        reverse = 1;
+                        break;
+                case 'S':
+                        shm_size = (off_t)atoi(optarg) << 20;
+                        break;
+                case 't':
+                        multi_threaded = 1;
+                        break;
+                case 'T':
+                        trace_path = optarg;
+                        break;
+                case 'u':
+                        uring_entries = atoi(optarg);
+                        break;
+                case 'w':
+                        warm_threads = atoi(optarg);
+                        break;
                 }
         }
 
+        if (!multi_threaded) {
+                fuse_unecm_argv[fuse_unecm_argc++] = "-s";
+        }
+
         snprintf(fs_name, sizeof(fs_name), "-ofsname=%s", mnt);
         fuse_unecm_argv[fuse_unecm_argc++] = fs_name;
 
@@ -457,27 +3649,101 @@ int main(int argc, char *argv[])
                 ret = 10;
                 exit(1);
         }
+        if (reverse && cooked_view) {
+                fprintf(stderr, "--cooked can not be used with --reverse\n");
+                exit(1);
+        }
 
         dir_fd = open(mnt, O_DIRECTORY);
         fuse_unecm_argv[1] = mnt;
 
-        snprintf(tdbdir, sizeof(tdbdir), "%s/.fuse-unecm",
+        snprintf(statedir, sizeof(statedir), "%s/.fuse-unecm",
                  getpwuid(getuid())->pw_dir);
-        mkdir(tdbdir, 0700);
+        mkdir(statedir, 0700);
+
+        if (cache_size) {
+                if (cache_dir == NULL) {
+                        asprintf(&cache_dir, "%s/cache", statedir);
+                }
+                if (cache_init(cache_dir, cache_size)) {
+                        printf("Failed to open chunk cache %s : %s\n",
+                               cache_dir, strerror(errno));
+                        exit(1);
+                }
+        }
+
+        if (trace_path) {
+                capture_start(trace_path);
+        }
+        if (shm_size && shm_init(shm_size)) {
+                printf("Failed to attach shared memory cache : %s\n",
+                       strerror(errno));
+                exit(1);
+        }
+        if (prefetch) {
+                asprintf(&trace_dir, "%s/traces", statedir);
+                mkdir(trace_dir, 0700);
+        }
+        if (reverse) {
+                asprintf(&map_dir, "%s/maps", statedir);
+                mkdir(map_dir, 0700);
+        }
 
-        nu_tdb = tdb_open(NULL, 10000001, TDB_INTERNAL, O_RDWR, 0);
-        if (nu_tdb == NULL) {
-                printf("Failed to open NEEDS-UNCOMPRESSION TDB\n");
+        snprintf(statefile, sizeof(statefile), "%s/file_sizes", statedir);
+        if (path_cache_load(&size_cache, statefile)) {
+                printf("Failed to open FILE-SIZE cache %s : %s\n", statefile,
+                       strerror(errno));
                 exit(1);
         }
 
-        snprintf(tdbfile, sizeof(tdbfile), "%s/file_size.tdb", tdbdir);
-        errno = 0;
-        filesize_tdb = tdb_open(tdbfile, 10000001, 0, O_CREAT|O_RDWR, 0600);
-        if (filesize_tdb == NULL) {
-                printf("Failed to open FILE-SIZE TDB : %s\n", strerror(errno));
+        root_node.fd = dir_fd;
+        root_node.refs = 1;
+        root_node.name = ".";
+        root_node.path = ".";
+
+        watches.fd = inotify_init1(IN_CLOEXEC);
+        if (watches.fd == -1) {
+                printf("inotify not available, directory listings will "
+                       "not be cached : %s\n", strerror(errno));
+        }
+        root_node.watched = watch_dir(".") == 0;
+
+        args.argc = fuse_unecm_argc;
+        args.argv = fuse_unecm_argv;
+        args.allocated = 0;
+        if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+                               &foreground) == -1) {
                 exit(1);
         }
+        ch = fuse_mount(mountpoint, &args);
+        if (ch == NULL) {
+                printf("Failed to mount %s\n", mountpoint);
+                exit(1);
+        }
+        se = fuse_lowlevel_new(&args, &unecm_oper, sizeof(unecm_oper), NULL);
+        if (se == NULL) {
+                fuse_unmount(mountpoint, ch);
+                exit(1);
+        }
+        fuse_set_signal_handlers(se);
+        fuse_session_add_chan(se, ch);
+        fuse_ch = ch;
+        fuse_daemonize(foreground);
+
+        if (multithreaded) {
+                ret = fuse_session_loop_mt(se);
+        } else {
+                ret = fuse_session_loop(se);
+        }
+
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+        fuse_session_destroy(se);
+        if (trace_file) {
+                fclose(trace_file);
+        }
+        fuse_unmount(mountpoint, ch);
+        fuse_opt_free_args(&args);
 
-        return fuse_main(fuse_unecm_argc, fuse_unecm_argv, &unecm_oper, NULL);
+        return ret ? 1 : 0;
 }
@@ -31,14 +31,29 @@
 #define _FILE_OFFSET_BITS 64
 
 #include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#endif
 
 #include "libunecm.h"
 
@@ -48,34 +63,58 @@
 #define BLOCK_MODE_2_FORM_1 2
 #define BLOCK_MODE_2_FORM_2 3
 
+struct ecm_uring;
+struct ecm_container;
+struct ecm_direct;
+
 struct ecm {
-        int fd;
+        int fd;                 /* -1 when opened with ecm_open_mem() */
+        const uint8_t *mem;
+        size_t mem_len;
+        struct ecm_container *container;
+        struct ecm_direct *direct;
         uint32_t idx_size;
         off_t *idx_data;
+        struct ecm_uring *uring;
 
-        off_t unpacked_offset;
-        off_t ecm_offset;
-        size_t skip;
-        size_t unpacked_size;
-};
+        off_t unpacked_size;
+        int cooked_offset;
 
-#define LOG(...) { \
-        if (logfile) { \
-            FILE *fh = fopen(logfile, "a+"); \
-            fprintf(fh, "[UNECM] "); \
-            fprintf(fh, __VA_ARGS__); \
-            fclose(fh); \
-        } \
-}
+        /* identifies the ECM file across handles, see ecm_read() */
+        dev_t dev;
+        ino_t ino;
 
+        /* updated atomically, the cache counters are kept by the caches
+         * themselves, see ecm_get_stats()
+         */
+        struct ecm_stats stats;
+};
 
-extern char *logfile;
+/* A position in the file. This is kept on the stack of each reader rather
+ * than in struct ecm so that several threads can read from the same
+ * struct ecm at once.
+ */
+struct ecm_cursor {
+        off_t unpacked_offset;
+        off_t ecm_offset;
+        off_t skip;             /* into the run at ecm_offset */
+};
 
 /* LUTs used for computing ECC/EDC */
+static pthread_once_t eccedc_once = PTHREAD_ONCE_INIT;
 static uint8_t ecc_f_lut[256];
 static uint8_t ecc_b_lut[256];
 static uint32_t edc_lut[256];
 
+/* EDC/ECC of a Mode 1 sector with all zero user data.
+ * [0] is for address 00:00:00 and [1 + n] is what setting bit n of the
+ * address flips. See eccedc_generate_zero().
+ */
+#define ZERO_PARITY_SIZE (BIN_BLOCK_SIZE - 0x810)
+static uint8_t mode_1_zero_parity[25][ZERO_PARITY_SIZE];
+
+static void eccedc_generate(uint8_t *sector, int type, size_t end);
+
 /* Init routine */
 static void eccedc_init(void)
 {
@@ -91,6 +130,28 @@ static void eccedc_init(void)
                 }
                 edc_lut[i] = edc;
         }
+
+        /* The EDC and ECC are linear in the sector contents so for zero
+         * user data they are a fixed part XOR one part per address bit.
+         */
+        for (i = 0; i < 25; i++) {
+                uint8_t sector[BIN_BLOCK_SIZE];
+
+                memset(sector, 0, sizeof(sector));
+                memset(sector + 1, 0xFF, 10);
+                sector[0x0F] = 0x01;
+                if (i) {
+                        sector[0x0C + (i - 1) / 8] = 1 << ((i - 1) % 8);
+                }
+                eccedc_generate(sector, BLOCK_MODE_1, BIN_BLOCK_SIZE);
+                for (j = 0; j < ZERO_PARITY_SIZE; j++) {
+                        mode_1_zero_parity[i][j] = sector[0x810 + j];
+                        if (i) {
+                                mode_1_zero_parity[i][j] ^=
+                                        mode_1_zero_parity[0][j];
+                        }
+                }
+        }
 }
 
 
@@ -99,7 +160,7 @@ static void eccedc_init(void)
 ** Compute EDC for a block
 */
 static uint32_t edc_partial_computeblock(uint32_t  edc, const uint8_t  *src,
-                                         uint16_t  size)
+                                         uint32_t  size)
 {
         while (size--) {
                 edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
@@ -119,8 +180,11 @@ static void edc_computeblock(const uint8_t *src, uint16_t size, uint8_t *dest)
 /***************************************************************************/
 /*
 ** Compute ECC for a block (can do either P or Q)
+** The block starts with 'head' zero bytes that are not stored, 'src'
+** holds the bytes that follow them.
 */
-static void ecc_computeblock(uint8_t *src,
+static void ecc_computeblock(const uint8_t *src,
+                             uint32_t head,
                              uint32_t major_count,
                              uint32_t minor_count,
                              uint32_t major_mult,
@@ -136,7 +200,7 @@ static void ecc_computeblock(uint8_t *src,
                 uint8_t ecc_b = 0;
 
                 for (minor = 0; minor < minor_count; minor++) {
-                        uint8_t temp = src[index];
+                        uint8_t temp = index < head ? 0 : src[index - head];
                         index += minor_inc;
                         if (index >= size) {
                                 index -= size;
@@ -152,40 +216,43 @@ static void ecc_computeblock(uint8_t *src,
 }
 
 /*
-** Generate ECC P and Q codes for a block
+** Generate ECC P and Q codes for a block.
+** The codes cover 0x810 bytes from the address onwards. For Mode 2 the
+** address counts as zero, so 'head' is 4 and 'src' points just past it.
+** The Q code covers the P code so P is always needed, but Q can be left
+** out when nothing beyond the P code is going to be looked at.
 */
-static void ecc_generate(uint8_t *sector, int zeroaddress)
+static void ecc_generate(uint8_t *src, uint32_t head, int want_q)
 {
-        uint8_t address[4], i;
-
-        /* Save the address and zero it out */
-        if (zeroaddress) {
-                for(i = 0; i < 4; i++) {
-                        address[i] = sector[12 + i];
-                        sector[12 + i] = 0;
-                }
-        }
         /* Compute ECC P code */
-        ecc_computeblock(sector + 0xC, 86, 24,  2, 86, sector + 0x81C);
+        ecc_computeblock(src, head, 86, 24,  2, 86, src + 0x810 - head);
         /* Compute ECC Q code */
-        ecc_computeblock(sector + 0xC, 52, 43, 86, 88, sector + 0x8C8);
-        /* Restore the address */
-        if (zeroaddress) {
-                for(i = 0; i < 4; i++) {
-                        sector[12 + i] = address[i];
-                }
+        if (want_q) {
+                ecc_computeblock(src, head, 52, 43, 86, 88,
+                                 src + 0x8BC - head);
         }
 }
 
 /*
-** Generate ECC/EDC information for a sector (must be 2352 = 0x930 bytes)
-** Returns 0 on success
+** Generate ECC/EDC information for a sector.
+**
+** For Mode 1 'sector' is the full 2352 = 0x930 byte sector. For Mode 2 it
+** is the 2336 = 0x920 bytes following the header, which is what ECM
+** files unpack to, and it does not matter what precedes it in memory.
+**
+** Only bytes before 'end' are going to be used by the caller, so the EDC,
+** ECC P and ECC Q are each only computed when they lie before 'end' or
+** when a later field that is needed depends on them. Pass BIN_BLOCK_SIZE
+** to regenerate the whole sector.
 */
-static void eccedc_generate(uint8_t *sector, int type) {
+static void eccedc_generate(uint8_t *sector, int type, size_t end) {
         int i;
 
         switch(type) {
         case BLOCK_MODE_1: /* Mode 1 */
+                if (end <= 0x810) {
+                        break;
+                }
                 /* Compute EDC */
                 edc_computeblock(sector + 0x00, 0x810, sector + 0x810);
                 /* Write out zero bytes */
@@ -193,309 +260,3192 @@ static void eccedc_generate(uint8_t *sector, int type) {
                         sector[0x814 + i] = 0;
                 }
                 /* Generate ECC P/Q codes */
-                ecc_generate(sector, 0);
+                if (end > 0x81C) {
+                        ecc_generate(sector + 0xC, 0, end > 0x8C8);
+                }
                 break;
         case BLOCK_MODE_2_FORM_1: /* Mode 2 form 1 */
+                if (end <= 0x808) {
+                        break;
+                }
                 /* Compute EDC */
-                edc_computeblock(sector + 0x10, 0x808, sector + 0x818);
+                edc_computeblock(sector, 0x808, sector + 0x808);
                 /* Generate ECC P/Q codes */
-                ecc_generate(sector, 1);
+                if (end > 0x80C) {
+                        ecc_generate(sector, 4, end > 0x8B8);
+                }
                 break;
         case BLOCK_MODE_2_FORM_2: /* Mode 2 form 2 */
+                if (end <= 0x91C) {
+                        break;
+                }
                 /* Compute EDC */
-                edc_computeblock(sector + 0x10, 0x91C, sector + 0x92C);
+                edc_computeblock(sector, 0x91C, sector + 0x91C);
                 break;
         }
 }
 
-static int ecm_read_tag(int fd, uint32_t *count, uint8_t *type, off_t *pos)
+static int is_zero(const uint8_t *buf, size_t len)
 {
-        uint32_t num;
-        int t;
-        uint8_t c;
-        int bits = 5;
+        return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
 
-        if (pread(fd, &c, 1, (*pos)++) == 0) {
-                return -1;
-        }
+/*
+** Fast path for sectors whose payload is all zeroes, as found in pregaps
+** and padding. Mode 2 sectors then have all zero EDC/ECC as the address
+** is not covered, and for Mode 1 the EDC/ECC is put together from the
+** precomputed parts for the bits set in the address.
+** 'sector' is laid out as for eccedc_generate().
+** Returns 1 if the sector was completed, 0 if eccedc_generate() is needed.
+*/
+static int eccedc_generate_zero(uint8_t *sector, int type)
+{
+        uint8_t *parity;
+        int i, j;
 
-        t = c & 3;
-        num = (c >> 2) & 0x1F;
-        while(c & 0x80) {
-                if (pread(fd, &c, 1, (*pos)++) == 0) {
-                        return -1;
+        switch(type) {
+        case BLOCK_MODE_1:
+                if (!is_zero(sector + 0x010, 0x800)) {
+                        return 0;
                 }
-                num |= ((unsigned int)c & 0x7F) << bits;
-                bits += 7;
+                parity = sector + 0x810;
+                memcpy(parity, mode_1_zero_parity[0], ZERO_PARITY_SIZE);
+                for (i = 0; i < 24; i++) {
+                        if (!(sector[0x0C + i / 8] & (1 << (i % 8)))) {
+                                continue;
+                        }
+                        for (j = 0; j < ZERO_PARITY_SIZE; j++) {
+                                parity[j] ^= mode_1_zero_parity[i + 1][j];
+                        }
+                }
+                return 1;
+        case BLOCK_MODE_2_FORM_1:
+                if (!is_zero(sector, 0x808)) {
+                        return 0;
+                }
+                memset(sector + 0x808, 0, 0x920 - 0x808);
+                return 1;
+        case BLOCK_MODE_2_FORM_2:
+                if (!is_zero(sector, 0x91C)) {
+                        return 0;
+                }
+                memset(sector + 0x91C, 0, 0x920 - 0x91C);
+                return 1;
         }
-        *type = t;
-        *count = num;
         return 0;
 }
 
-static void ecm_seek(struct ecm *ecm, off_t offset)
-{
-        int idx = offset / 65536;
-
-        ecm->unpacked_offset = ecm->idx_data[2 * idx];
-        ecm->ecm_offset = ecm->idx_data[2 * idx + 1];
-        ecm->skip = 0;
-
-        while (1) {
-                off_t current = ecm->ecm_offset;
-                uint8_t ecm_type;
-                uint32_t ecm_len;
-                int u_len, e_len;
+/***************************************************************************/
+/*
+** Direct I/O.
+**
+** Normally the ECM file is read through the page cache, so a hot image is
+** held in memory twice: the ECM data in the page cache of the backing
+** file and the decoded sectors in the page cache of the fuse file. With
+** ecm_set_direct_io() the ECM file is read with O_DIRECT instead, in
+** aligned DIRECT_BLOCK sized blocks, and only the most recently used few
+** of them are kept, in a small cache of the handle's own.
+**
+** Tags and payloads are mostly only a few bytes apart, so most reads are
+** served from the block that the previous one brought in.
+*/
+#define DIRECT_BLOCK (128 * 1024)
+#define DIRECT_ALIGN 4096
 
-                ecm_read_tag(ecm->fd, &ecm_len, &ecm_type, &current);
-                if (ecm_len == 0xFFFFFFFF) {
-                        return;
-                }
-                ecm_len++;
+struct direct_block {
+        off_t offset;           /* -1 when the slot is empty */
+        uint64_t used;
+        size_t len;
+        uint8_t *data;
+};
 
-                switch (ecm_type) {
-                case BLOCK_BYTES:
-                        u_len = ecm_len;
-                        e_len = ecm_len;
-                        break;
-                case BLOCK_MODE_1:
-                        u_len = BIN_BLOCK_SIZE * ecm_len;
-                        e_len = 0x803 * ecm_len;
-                        break;
-                case BLOCK_MODE_2_FORM_1:
-                        u_len = 2336 * ecm_len;
-                        e_len = 0x804 * ecm_len;
-                        break;
-                case BLOCK_MODE_2_FORM_2:
-                        u_len = 2336 * ecm_len;
-                        e_len = 0x918 * ecm_len;
-                        break;
-                }
+struct ecm_direct {
+        int fd;
+        pthread_mutex_t mutex;
+        uint64_t tick;
+        uint64_t hits;
+        uint64_t misses;
+        int count;
+        struct direct_block block[];
+};
 
-                if (offset < ecm->unpacked_offset + u_len) {
-                        break;
-                }
+static void direct_free(struct ecm_direct *d)
+{
+        int i;
 
-                ecm->unpacked_offset += u_len;
-                ecm->ecm_offset = current + e_len;
+        for (i = 0; i < d->count; i++) {
+                free(d->block[i].data);
         }
-        ecm->skip = offset - ecm->unpacked_offset;
+        pthread_mutex_destroy(&d->mutex);
+        close(d->fd);
+        free(d);
 }
 
-struct ecm *ecm_open_file(int dir_fd, const char *file)
+/* The block starting at 'offset', from the cache if it is there.
+ * Must be called with the mutex held.
+ */
+static struct direct_block *direct_block(struct ecm_direct *d, off_t offset)
 {
-        struct ecm *ecm;
-        uint8_t magic[4];
-        int idx_fd, i, len;
-        char *idx_file;
-        
-        ecm = malloc(sizeof(struct ecm));
-        if (ecm == NULL) {
-                return NULL;
+        struct direct_block *b = &d->block[0];
+        ssize_t len;
+        int i;
+
+        for (i = 0; i < d->count; i++) {
+                if (d->block[i].offset == offset) {
+                        d->block[i].used = ++d->tick;
+                        d->hits++;
+                        return &d->block[i];
+                }
+                if (d->block[i].used < b->used) {
+                        b = &d->block[i];
+                }
         }
 
-        ecm->unpacked_size = -1;
-        ecm->fd = openat(dir_fd, file, 0);
-        if (ecm->fd == -1) {
-                free(ecm);
+        d->misses++;
+        b->offset = -1;
+        if (b->data == NULL &&
+            posix_memalign((void **)&b->data, DIRECT_ALIGN, DIRECT_BLOCK)) {
+                b->data = NULL;
                 return NULL;
         }
-
-        if (read(ecm->fd, magic, 4) != 4 || strcmp(magic, "ECM")) {
-                close(ecm->fd);
-                free(ecm);
+        len = pread(d->fd, b->data, DIRECT_BLOCK, offset);
+        if (len == -1) {
                 return NULL;
         }
+        b->offset = offset;
+        b->len = len;
+        b->used = ++d->tick;
+        return b;
+}
 
-        asprintf(&idx_file, "%s.edi", file);
-        idx_fd = openat(dir_fd, idx_file, 0);
-        free(idx_file);
+static ssize_t direct_pread(struct ecm_direct *d, void *buf, size_t len,
+                            off_t offset)
+{
+        ssize_t total = 0;
 
-        if (idx_fd == -1) {
-                close(ecm->fd);
-                free(ecm);
-                return NULL;
-        }
-        
-        read(idx_fd, &ecm->idx_size, sizeof(uint32_t));
-        ecm->idx_size = le32toh(ecm->idx_size);
+        pthread_mutex_lock(&d->mutex);
+        while (len) {
+                struct direct_block *b;
+                size_t skip = offset % DIRECT_BLOCK, n;
 
-        len = 2 * ecm->idx_size * sizeof(off_t);
-        ecm->idx_data = malloc(len);
-        if (ecm->idx_data == NULL) {
-                close(idx_fd);
-                close(ecm->fd);
-                free(ecm);
-                return NULL;
+                b = direct_block(d, offset - skip);
+                if (b == NULL) {
+                        pthread_mutex_unlock(&d->mutex);
+                        return -1;
+                }
+                if (skip >= b->len) {
+                        break;
+                }
+                n = b->len - skip;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy((uint8_t *)buf + total, b->data + skip, n);
+                total  += n;
+                offset += n;
+                len    -= n;
         }
+        pthread_mutex_unlock(&d->mutex);
+        return total;
+}
 
-        lseek(idx_fd, 2 * sizeof(uint32_t), SEEK_SET);
-        if (read(idx_fd, ecm->idx_data, len) != len) {
-                close(idx_fd);
-                close(ecm->fd);
-                free(ecm->idx_data);
-                free(ecm);
-                return NULL;
+/* Read from the file itself, the compressed data if it is a container */
+static ssize_t ecm_raw_pread(struct ecm *ecm, void *buf, size_t len,
+                             off_t offset)
+{
+        if (ecm->mem) {
+                if (offset >= ecm->mem_len) {
+                        return 0;
+                }
+                if (len > ecm->mem_len - offset) {
+                        len = ecm->mem_len - offset;
+                }
+                memcpy(buf, ecm->mem + offset, len);
+                return len;
         }
-
-        for (i = 0; i < ecm->idx_size; i ++) {
-                ecm->idx_data[2 * i] = le64toh(ecm->idx_data[2 * i]);
-                ecm->idx_data[2 * i + 1] = le64toh(ecm->idx_data[2 * i + 1]);
+        if (ecm->direct) {
+                return direct_pread(ecm->direct, buf, len, offset);
         }
-        close(idx_fd);
-
-        return ecm;
+        return pread(ecm->fd, buf, len, offset);
 }
 
-void ecm_close_file(struct ecm *ecm)
+/***************************************************************************/
+/*
+** Compressed containers.
+**
+** An ECM file can also be stored compressed, as BGZF (bgzip, .ecm.gz) or,
+** when built with HAVE_ZSTD, as seekable zstd (.ecm.zst). Both consist of
+** independently compressed blocks, so with a table of where every block
+** starts in the compressed and the uncompressed file any part of the ECM
+** data can be reached by decompressing just the blocks that hold it. The
+** most recently used blocks are kept decompressed in a small cache.
+**
+** For BGZF the table is read from the .gzi index written by 'bgzip -i' if
+** there is one, otherwise it is built by walking the block headers. For
+** zstd it is the seek table at the end of the file.
+*/
+#define CONTAINER_BGZF 1
+#define CONTAINER_ZSTD 2
+
+/* number of decompressed blocks kept per file, see ecm_set_cache() */
+#define CONTAINER_CACHE 8
+
+struct container_block {
+        int64_t index;          /* -1 when the slot is empty */
+        uint64_t used;
+        uint8_t *data;
+        size_t len;
+};
+
+struct ecm_container {
+        int type;
+        uint32_t count;
+        off_t *cpos;            /* count + 1 entries, the last is the end */
+        off_t *upos;
+
+        pthread_mutex_t mutex;
+        uint64_t tick;
+        uint64_t hits;
+        uint64_t misses;
+        int cache_count;
+        struct container_block *cache;
+        z_stream z;
+};
+
+static void container_free(struct ecm_container *c)
 {
-        close(ecm->fd);
-        free(ecm->idx_data);
-        free(ecm);
+        int i;
+
+        for (i = 0; i < c->cache_count; i++) {
+                free(c->cache[i].data);
+        }
+        if (c->type == CONTAINER_BGZF) {
+                inflateEnd(&c->z);
+        }
+        pthread_mutex_destroy(&c->mutex);
+        free(c->cache);
+        free(c->cpos);
+        free(c->upos);
+        free(c);
 }
 
-static int ecm_unpack_block(struct ecm *ecm, char *sector, int len)
+static int container_add(struct ecm_container *c, uint32_t *size,
+                         off_t cpos, off_t upos)
 {
-        uint8_t ecm_type;
-        uint32_t ecm_len;
-        off_t ecm_offset = ecm->ecm_offset;
-        uint8_t buf[2352];
-        int idx;
-        size_t skip;
-        static int first_time = 1;
-        
-        if (first_time) {
-                eccedc_init();
-                first_time =0;
-        }
-        
-        if (ecm_read_tag(ecm->fd, &ecm_len, &ecm_type, &ecm_offset) < 0) {
-                return -1;
-        }
-        if (ecm_len == 0xFFFFFFFF) {
-                return 0;
+        if (c->count + 1 >= *size) {
+                off_t *cp, *up;
+
+                *size = *size ? 2 * *size : 1024;
+                cp = realloc(c->cpos, *size * sizeof(off_t));
+                if (cp == NULL) {
+                        return -1;
+                }
+                c->cpos = cp;
+                up = realloc(c->upos, *size * sizeof(off_t));
+                if (up == NULL) {
+                        return -1;
+                }
+                c->upos = up;
         }
-        ecm_len++;
+        c->cpos[c->count] = cpos;
+        c->upos[c->count] = upos;
+        return 0;
+}
 
-        switch (ecm_type) {
-        case BLOCK_BYTES:
-                if (ecm_type != BLOCK_BYTES) {
+/* Add the BGZF blocks from cpos to the end of the file to the table */
+static int bgzf_scan(struct ecm_container *c, uint32_t *size, int fd,
+                     off_t cpos, off_t upos, off_t end)
+{
+        while (cpos < end) {
+                uint8_t hdr[18], isize[4];
+                uint32_t bsize;
+
+                /* gzip header with a single 'BC' extra subfield */
+                if (pread(fd, hdr, 18, cpos) != 18 ||
+                    hdr[0] != 0x1f || hdr[1] != 0x8b || !(hdr[3] & 4) ||
+                    hdr[12] != 'B' || hdr[13] != 'C') {
+                        return -1;
+                }
+                bsize = (hdr[16] | hdr[17] << 8) + 1;
+                if (pread(fd, isize, 4, cpos + bsize - 4) != 4) {
+                        return -1;
+                }
+                if (container_add(c, size, cpos, upos)) {
                         return -1;
                 }
-                skip = ecm->skip;
+                c->count++;
+                cpos += bsize;
+                upos += isize[0] | isize[1] << 8 | isize[2] << 16 |
+                        (uint32_t)isize[3] << 24;
+        }
+        return container_add(c, size, cpos, upos);
+}
+
+/* Table of the BGZF blocks from a .gzi index. The index lists where each
+ * block but the first starts, and the blocks from the last one listed to
+ * the end of the file are found with bgzf_scan().
+ */
+static int bgzf_read_gzi(struct ecm_container *c, int gzi_fd, int fd,
+                         off_t end)
+{
+        uint64_t n, i, pair[2];
+        uint32_t size = 0;
+        off_t cpos = 0, upos = 0;
 
-                if (len > ecm_len - skip) {
-                        len = ecm_len - skip;
+        if (read(gzi_fd, &n, 8) != 8) {
+                return -1;
+        }
+        n = le64toh(n);
+        for (i = 0; i < n; i++) {
+                if (read(gzi_fd, pair, 16) != 16 ||
+                    container_add(c, &size, cpos, upos)) {
+                        return -1;
                 }
-                
-                return pread(ecm->fd, sector, len, ecm_offset + skip);
+                c->count++;
+                cpos = le64toh(pair[0]);
+                upos = le64toh(pair[1]);
+        }
+        return bgzf_scan(c, &size, fd, cpos, upos, end);
+}
 
-        case BLOCK_MODE_1:
-                idx = ecm->skip / BIN_BLOCK_SIZE;
-                skip = ecm->skip % BIN_BLOCK_SIZE;
+static int bgzf_open(struct ecm_container *c, int dir_fd, const char *file,
+                     int fd, off_t end)
+{
+        char *gzi_file;
+        int gzi_fd, ret = -1;
 
-                memset(buf, 0, 16);
-                memset(buf + 1, 0xFF, 10);
+        if (inflateInit2(&c->z, 16 + MAX_WBITS) != Z_OK) {
+                return -1;
+        }
+        c->type = CONTAINER_BGZF;
 
-                buf[0x0F] = 0x01;
-                pread(ecm->fd, buf + 0x00C, 0x003,
-                      ecm_offset + idx * 0x803);
-                pread(ecm->fd, buf + 0x010, 0x800,
-                      ecm_offset + 0x003 + idx * 0x803);
-                eccedc_generate(buf, 1);
+        /* there is no name to find the .gzi by for ecm_open_fd() */
+        gzi_fd = -1;
+        if (file) {
+                asprintf(&gzi_file, "%s.gzi", file);
+                gzi_fd = openat(dir_fd, gzi_file, O_RDONLY);
+                free(gzi_file);
+        }
+        if (gzi_fd != -1) {
+                ret = bgzf_read_gzi(c, gzi_fd, fd, end);
+                close(gzi_fd);
+        }
+        if (ret) {
+                uint32_t size = 0;
 
-                if (len > BIN_BLOCK_SIZE - skip) {
-                        len = BIN_BLOCK_SIZE - skip;
-                }
-                memcpy(sector, buf + 16 + skip, len);
-                return len;
-                
-        case BLOCK_MODE_2_FORM_1:
-                idx = ecm->skip / 2336;
-                skip = ecm->skip % 2336;
+                free(c->cpos);
+                free(c->upos);
+                c->cpos = c->upos = NULL;
+                c->count = 0;
+                ret = bgzf_scan(c, &size, fd, 0, 0, end);
+        }
+        return ret;
+}
 
-                memset(buf, 0, 16);
-                memset(buf + 1, 0xFF, 10);
+static int bgzf_decompress(struct ecm_container *c, uint8_t *in, size_t in_len,
+                           uint8_t *out, size_t out_len)
+{
+        int ret;
 
-                buf[0x0F] = 0x02;
-                pread(ecm->fd, buf + 0x014, 0x804,
-                      ecm_offset + idx * 0x804);
-                buf[0x10] = buf[0x14];
-                buf[0x11] = buf[0x15];
-                buf[0x12] = buf[0x16];
-                buf[0x13] = buf[0x17];
-                eccedc_generate(buf, 2);
+        inflateReset(&c->z);
+        c->z.next_in = in;
+        c->z.avail_in = in_len;
+        c->z.next_out = out;
+        c->z.avail_out = out_len;
+        /* this also checks the CRC32 of the block */
+        ret = inflate(&c->z, Z_FINISH);
+        if (ret != Z_STREAM_END || c->z.avail_out) {
+                return -1;
+        }
+        return 0;
+}
 
-                if (len > 2336 - skip) {
-                        len = 2336 - skip;
-                }
-                memcpy(sector, buf + 16 + skip, len);
-                return len;
+#ifdef HAVE_ZSTD
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
 
-        case BLOCK_MODE_2_FORM_2:
-                idx = ecm->skip / 2336;
-                skip = ecm->skip % 2336;
+static int zstd_open(struct ecm_container *c, int fd, off_t end)
+{
+        uint8_t footer[9], entry[12];
+        uint32_t n, i, size = 0, entry_size;
+        off_t table, cpos = 0, upos = 0;
 
-                memset(buf, 0, 16);
-                memset(buf + 1, 0xFF, 10);
+        c->type = CONTAINER_ZSTD;
+        if (end < 9 || pread(fd, footer, 9, end - 9) != 9 ||
+            le32toh(*(uint32_t *)&footer[5]) != ZSTD_SEEKABLE_MAGIC) {
+                return -1;
+        }
+        n = le32toh(*(uint32_t *)&footer[0]);
+        entry_size = footer[4] & 0x80 ? 12 : 8;
+        table = end - 9 - (off_t)n * entry_size;
+        if (table < 8) {
+                return -1;
+        }
+        for (i = 0; i < n; i++) {
+                if (pread(fd, entry, entry_size, table + i * entry_size)
+                    != entry_size) {
+                        return -1;
+                }
+                if (container_add(c, &size, cpos, upos)) {
+                        return -1;
+                }
+                c->count++;
+                cpos += le32toh(*(uint32_t *)&entry[0]);
+                upos += le32toh(*(uint32_t *)&entry[4]);
+        }
+        return container_add(c, &size, cpos, upos);
+}
+#endif
 
-                buf[0x0F] = 0x02;
-                pread(ecm->fd, buf + 0x014, 0x918,
-                      ecm_offset + idx * 0x918);
-                buf[0x10] = buf[0x14];
-                buf[0x11] = buf[0x15];
-                buf[0x12] = buf[0x16];
-                buf[0x13] = buf[0x17];
-                eccedc_generate(buf, 3);
+/* Decompressed data of block 'index', from the cache if it is there.
+ * Must be called with the container mutex held.
+ */
+static struct container_block *container_block(struct ecm *ecm,
+                                               uint32_t index)
+{
+        struct ecm_container *c = ecm->container;
+        struct container_block *b = &c->cache[0];
+        size_t c_len, u_len;
+        uint8_t *in;
+        int i, ret;
 
-                if (len > 2336 - skip) {
-                        len = 2336 - skip;
+        for (i = 0; i < c->cache_count; i++) {
+                if (c->cache[i].index == index) {
+                        c->cache[i].used = ++c->tick;
+                        c->hits++;
+                        return &c->cache[i];
                 }
-                memcpy(sector, buf + 16 + skip, len);
-                return len;
+                if (c->cache[i].used < b->used) {
+                        b = &c->cache[i];
+                }
+        }
+        c->misses++;
 
+        c_len = c->cpos[index + 1] - c->cpos[index];
+        u_len = c->upos[index + 1] - c->upos[index];
+
+        in = malloc(c_len);
+        if (in == NULL) {
+                return NULL;
+        }
+        if (b->len < u_len || b->data == NULL) {
+                free(b->data);
+                b->data = malloc(u_len ? u_len : 1);
+        }
+        b->index = -1;
+        if (b->data == NULL || ecm_raw_pread(ecm, in, c_len, c->cpos[index])
+            != c_len) {
+                free(in);
+                return NULL;
+        }
+        switch (c->type) {
+        case CONTAINER_BGZF:
+                ret = bgzf_decompress(c, in, c_len, b->data, u_len);
+                break;
+#ifdef HAVE_ZSTD
+        case CONTAINER_ZSTD:
+                ret = ZSTD_decompress(b->data, u_len, in, c_len) == u_len ?
+                        0 : -1;
+                break;
+#endif
         default:
-                printf("Can not unpack type %d\n", ecm_type);
-                exit(10);
+                ret = -1;
+        }
+        free(in);
+        if (ret) {
+                return NULL;
         }
+        b->index = index;
+        b->len = u_len;
+        b->used = ++c->tick;
+        return b;
 }
 
-ssize_t ecm_read(struct ecm *ecm, char *buf, off_t offset, size_t len)
+static ssize_t container_pread(struct ecm *ecm, void *buf, size_t len,
+                               off_t offset)
 {
+        struct ecm_container *c = ecm->container;
         ssize_t total = 0;
-        
+        uint32_t lo, hi;
+
+        pthread_mutex_lock(&c->mutex);
         while (len) {
-                int count;
+                struct container_block *b;
+                size_t skip, n;
 
-                ecm_seek(ecm, offset);
-                count = ecm_unpack_block(ecm, buf, len);
-                if (!count) {
-                        return total;
+                /* last block starting at or before offset */
+                lo = 0;
+                hi = c->count;
+                while (hi - lo > 1) {
+                        uint32_t mid = (lo + hi) / 2;
+
+                        if (c->upos[mid] <= offset) {
+                                lo = mid;
+                        } else {
+                                hi = mid;
+                        }
+                }
+                b = container_block(ecm, lo);
+                if (b == NULL) {
+                        pthread_mutex_unlock(&c->mutex);
+                        return -1;
+                }
+                skip = offset - c->upos[lo];
+                if (skip >= b->len) {
+                        if (lo + 1 >= c->count) {
+                                break;
+                        }
+                        /* empty blocks, such as the BGZF end marker */
+                        offset = c->upos[lo + 1];
+                        continue;
+                }
+                n = b->len - skip;
+                if (n > len) {
+                        n = len;
                 }
-                total  += count;
-                offset += count;
-                buf    += count;
-                len    -= count;
+                memcpy((uint8_t *)buf + total, b->data + skip, n);
+                total  += n;
+                offset += n;
+                len    -= n;
         }
+        pthread_mutex_unlock(&c->mutex);
         return total;
 }
 
-size_t ecm_get_file_size(struct ecm *ecm)
+static const char *container_suffix[] = {
+        ".gz",
+#ifdef HAVE_ZSTD
+        ".zst",
+#endif
+        NULL
+};
+
+/* Recognize a compressed container and build its block table */
+static struct ecm_container *container_open(int dir_fd, const char *file,
+                                            int fd)
 {
-        if (ecm->unpacked_size == -1) {
-                // Find out what the uncompressed size is
-                ecm->unpacked_size = ecm->idx_data[2 * (ecm->idx_size -1)];
-                while (1) {
-                        uint8_t buf[4096];
-                        ssize_t count;
+        struct ecm_container *c;
+        uint8_t magic[4];
+        struct stat st;
+        int i, ret = -1;
 
-                        ecm_seek(ecm, ecm->unpacked_size);
-                        count = ecm_read(ecm, buf, ecm->unpacked_size, 4096);
-                        if (count == 0) {
-                                break;
-                        }
-                        ecm->unpacked_size += count;
-                }
+        if (pread(fd, magic, 4, 0) != 4 || fstat(fd, &st)) {
+                return NULL;
+        }
+        if (!memcmp(magic, "ECM", 4)) {
+                return NULL;
+        }
+
+        c = calloc(1, sizeof(struct ecm_container));
+        if (c == NULL) {
+                return NULL;
+        }
+        c->cache = calloc(CONTAINER_CACHE, sizeof(struct container_block));
+        if (c->cache == NULL) {
+                free(c);
+                return NULL;
+        }
+        c->cache_count = CONTAINER_CACHE;
+        pthread_mutex_init(&c->mutex, NULL);
+        for (i = 0; i < CONTAINER_CACHE; i++) {
+                c->cache[i].index = -1;
+        }
+
+        if (magic[0] == 0x1f && magic[1] == 0x8b) {
+                ret = bgzf_open(c, dir_fd, file, fd, st.st_size);
         }
-        return ecm->unpacked_size;
+#ifdef HAVE_ZSTD
+        if (magic[0] == 0x28 && magic[1] == 0xb5 &&
+            magic[2] == 0x2f && magic[3] == 0xfd) {
+                ret = zstd_open(c, fd, st.st_size);
+        }
+#endif
+        if (ret || c->count == 0) {
+                container_free(c);
+                return NULL;
+        }
+        return c;
+}
+
+/* Read from the ECM data, decompressing it if it is in a container */
+static ssize_t ecm_pread(struct ecm *ecm, void *buf, size_t len, off_t offset)
+{
+        if (ecm->container) {
+                return container_pread(ecm, buf, len, offset);
+        }
+        return ecm_raw_pread(ecm, buf, len, offset);
+}
+
+static int ecm_read_tag(struct ecm *ecm, uint32_t *count, uint8_t *type,
+                        off_t *pos)
+{
+        uint8_t buf[5];
+        ssize_t len;
+        uint32_t num;
+        int i = 0;
+        int bits = 5;
+
+        /* a tag is at most 5 bytes long, fetch them all in one go */
+        len = ecm_pread(ecm, buf, sizeof(buf), *pos);
+        if (len < 1) {
+                return -1;
+        }
+
+        num = (buf[0] >> 2) & 0x1F;
+        while (buf[i] & 0x80) {
+                if (++i >= len) {
+                        return -1;
+                }
+                num |= ((unsigned int)buf[i] & 0x7F) << bits;
+                bits += 7;
+        }
+        *pos += i + 1;
+        *type = buf[0] & 3;
+        *count = num;
+        return 0;
+}
+
+/* Unpacked and packed size of a run of 'count' blocks of a given type */
+static void ecm_run_size(uint8_t type, uint32_t count,
+                         off_t *u_len, off_t *e_len)
+{
+        switch (type) {
+        case BLOCK_BYTES:
+                *u_len = count;
+                *e_len = count;
+                break;
+        case BLOCK_MODE_1:
+                *u_len = (off_t)BIN_BLOCK_SIZE * count;
+                *e_len = (off_t)0x803 * count;
+                break;
+        case BLOCK_MODE_2_FORM_1:
+                *u_len = (off_t)2336 * count;
+                *e_len = (off_t)0x804 * count;
+                break;
+        case BLOCK_MODE_2_FORM_2:
+                *u_len = (off_t)2336 * count;
+                *e_len = (off_t)0x918 * count;
+                break;
+        }
+}
+
+static void ecm_seek(struct ecm *ecm, struct ecm_cursor *cur, off_t offset)
+{
+        off_t idx = offset / 65536;
+
+        if (idx >= ecm->idx_size) {
+                idx = ecm->idx_size - 1;
+        }
+
+        cur->unpacked_offset = ecm->idx_data[2 * idx];
+        cur->ecm_offset = ecm->idx_data[2 * idx + 1];
+        cur->skip = 0;
+
+        while (1) {
+                off_t current = cur->ecm_offset;
+                uint8_t ecm_type;
+                uint32_t ecm_len;
+                off_t u_len, e_len;
+
+                if (ecm_read_tag(ecm, &ecm_len, &ecm_type, &current) < 0) {
+                        return;
+                }
+                if (ecm_len == 0xFFFFFFFF) {
+                        return;
+                }
+                ecm_len++;
+                ecm_run_size(ecm_type, ecm_len, &u_len, &e_len);
+
+                if (offset < cur->unpacked_offset + u_len) {
+                        break;
+                }
+
+                cur->unpacked_offset += u_len;
+                cur->ecm_offset = current + e_len;
+        }
+        cur->skip = offset - cur->unpacked_offset;
+}
+
+/*
+** Reads are done in batches. ecm_read() first walks the tags covering the
+** requested range and queues one struct ecm_io for every payload that has
+** to be read from the file. The reads of a batch are then all issued at
+** once, with io_uring if it has been enabled for the file, and each sector
+** is regenerated by ecm_unpack_block() as soon as its payload has arrived.
+*/
+#define ECM_BATCH 64
+
+/* how much of the .ecm file beyond a batch to ask the kernel to prefetch */
+#define ECM_READAHEAD (256 * 1024)
+
+struct ecm_io {
+        uint8_t *buf;
+        size_t len;
+        off_t offset;
+
+        /* BLOCK_BYTES payloads are read straight into the destination.
+         * A sector is assembled in 'frame', which is 'dst' itself when
+         * the whole sector was asked for. Otherwise it is the bounce
+         * buffer sector[] and once the sector has been regenerated
+         * 'count' bytes starting at 'skip' are copied to 'dst'. EDC/ECC
+         * that lie entirely beyond those bytes are not computed.
+         */
+        uint8_t type;
+        char *dst;
+        size_t skip;
+        size_t count;
+        uint8_t *frame;
+        uint8_t sector[BIN_BLOCK_SIZE];
+};
+
+struct ecm_batch {
+        int count;
+        struct ecm_io io[ECM_BATCH];
+};
+
+/* where in the frame the payload of a sector has to be read to */
+static uint8_t *ecm_io_payload(struct ecm_io *io)
+{
+        return io->frame + (io->type == BLOCK_MODE_1 ? 0x00C : 0x004);
+}
+
+static void ecm_unpack_block(struct ecm_io *io)
+{
+        uint8_t *buf = io->frame;
+
+        switch (io->type) {
+        case BLOCK_MODE_1:
+                /* address and data were read back to back to 0x00C */
+                memmove(buf + 0x010, buf + 0x00F, 0x800);
+                memset(buf, 0, 12);
+                memset(buf + 1, 0xFF, 10);
+                buf[0x0F] = 0x01;
+                break;
+
+        case BLOCK_MODE_2_FORM_1:
+        case BLOCK_MODE_2_FORM_2:
+                /* the subheader was read to 0x004, and is stored twice */
+                memcpy(buf, buf + 0x004, 4);
+                break;
+
+        default:
+                return;
+        }
+
+        if (!eccedc_generate_zero(buf, io->type)) {
+                eccedc_generate(buf, io->type, io->skip + io->count);
+        }
+        if (buf != (uint8_t *)io->dst) {
+                memcpy(io->dst, buf + io->skip, io->count);
+        }
+}
+
+static int ecm_io_sync(struct ecm *ecm, struct ecm_io *io, int count,
+                       int unpack)
+{
+        int i;
+
+        for (i = 0; i < count; i++) {
+                if (ecm_pread(ecm, io[i].buf, io[i].len, io[i].offset)
+                    != io[i].len) {
+                        return -1;
+                }
+                if (unpack) {
+                        ecm_unpack_block(&io[i]);
+                }
+        }
+        return 0;
+}
+
+/***************************************************************************/
+/*
+** Pool of threads that the sectors of large batches are regenerated on.
+** The reads of a batch are all done first, then the batch is queued as a
+** task and the calling thread and the pool workers each take DECODE_GRAIN
+** sectors at a time until all of it has been regenerated. Each sector is
+** written to its own part of the destination so no further locking is
+** needed.
+*/
+#define DECODE_GRAIN 4
+
+/* batches smaller than this are regenerated by the calling thread */
+#define DECODE_MIN (4 * DECODE_GRAIN)
+
+struct decode_task {
+        struct decode_task *next;
+        struct ecm_io *io;
+        int count;
+        int claimed;
+        int done;
+};
+
+static struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t work;
+        pthread_cond_t finished;
+        struct decode_task *tasks;
+        int threads;
+} decode_pool = {
+        PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_COND_INITIALIZER,
+        PTHREAD_COND_INITIALIZER,
+        NULL,
+        0
+};
+
+/* Take the next sectors of a task. Must be called with the pool mutex held.
+ * Returns how many sectors starting at *first were taken.
+ */
+static int decode_claim(struct decode_task *task, int *first)
+{
+        struct decode_task **t;
+        int n = task->count - task->claimed;
+
+        if (n > DECODE_GRAIN) {
+                n = DECODE_GRAIN;
+        }
+        *first = task->claimed;
+        task->claimed += n;
+        if (task->claimed == task->count) {
+                for (t = &decode_pool.tasks; *t; t = &(*t)->next) {
+                        if (*t == task) {
+                                *t = task->next;
+                                break;
+                        }
+                }
+        }
+        return n;
+}
+
+/* Regenerate sectors of a task. Called and returns with the mutex held. */
+static void decode_run(struct decode_task *task, int first, int n)
+{
+        int i;
+
+        pthread_mutex_unlock(&decode_pool.mutex);
+        for (i = first; i < first + n; i++) {
+                ecm_unpack_block(&task->io[i]);
+        }
+        pthread_mutex_lock(&decode_pool.mutex);
+        task->done += n;
+        if (task->done == task->count) {
+                pthread_cond_broadcast(&decode_pool.finished);
+        }
+}
+
+static void *decode_worker(void *arg)
+{
+        struct decode_task *task;
+        int first, n;
+
+        pthread_mutex_lock(&decode_pool.mutex);
+        for (;;) {
+                while (decode_pool.tasks == NULL) {
+                        pthread_cond_wait(&decode_pool.work,
+                                          &decode_pool.mutex);
+                }
+                task = decode_pool.tasks;
+                n = decode_claim(task, &first);
+                decode_run(task, first, n);
+        }
+        return NULL;
+}
+
+static void ecm_decode_parallel(struct ecm_io *io, int count)
+{
+        struct decode_task task;
+        int first, n;
+
+        task.io = io;
+        task.count = count;
+        task.claimed = 0;
+        task.done = 0;
+
+        pthread_mutex_lock(&decode_pool.mutex);
+        task.next = decode_pool.tasks;
+        decode_pool.tasks = &task;
+        pthread_cond_broadcast(&decode_pool.work);
+
+        while (task.claimed < task.count) {
+                n = decode_claim(&task, &first);
+                decode_run(&task, first, n);
+        }
+        while (task.done < task.count) {
+                pthread_cond_wait(&decode_pool.finished, &decode_pool.mutex);
+        }
+        pthread_mutex_unlock(&decode_pool.mutex);
+}
+
+int ecm_set_decode_threads(int threads)
+{
+        pthread_t thread;
+        int ret = 0;
+
+        pthread_mutex_lock(&decode_pool.mutex);
+        while (decode_pool.threads < threads) {
+                if (pthread_create(&thread, NULL, decode_worker, NULL)) {
+                        ret = -1;
+                        break;
+                }
+                pthread_detach(thread);
+                decode_pool.threads++;
+        }
+        pthread_mutex_unlock(&decode_pool.mutex);
+        return ret;
+}
+
+#ifdef HAVE_IO_URING
+/*
+** Minimal io_uring support using the raw system calls so that we do not
+** need to depend on liburing.
+*/
+struct ecm_uring {
+        pthread_mutex_t mutex;
+        int fd;
+        unsigned entries;
+
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/*
+** A ring that has been closed keeps its mutex, and fd -1 tells the readers
+** to use pread instead.
+*/
+static void ecm_uring_close(struct ecm_uring *ring)
+{
+        if (ring->sqes != MAP_FAILED) {
+                munmap(ring->sqes, ring->sqes_size);
+        }
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sq_ring != MAP_FAILED) {
+                munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        if (ring->fd != -1) {
+                close(ring->fd);
+        }
+        ring->fd = -1;
+        ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+}
+
+static void ecm_uring_free(struct ecm_uring *ring)
+{
+        ecm_uring_close(ring);
+        pthread_mutex_destroy(&ring->mutex);
+        free(ring);
+}
+
+static struct ecm_uring *ecm_uring_setup(unsigned entries)
+{
+        struct ecm_uring *ring;
+        struct io_uring_params p;
+        uint8_t *sq, *cq;
+
+        ring = malloc(sizeof(struct ecm_uring));
+        if (ring == NULL) {
+                return NULL;
+        }
+        memset(&p, 0, sizeof(p));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring->fd == -1) {
+                free(ring);
+                return NULL;
+        }
+        pthread_mutex_init(&ring->mutex, NULL);
+        ring->entries = p.sq_entries;
+
+        ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_ring_size > ring->sq_ring_size) {
+                        ring->sq_ring_size = ring->cq_ring_size;
+                }
+                ring->cq_ring_size = ring->sq_ring_size;
+        }
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+        ring->cq_ring = ring->sqes = MAP_FAILED;
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_POPULATE, ring->fd,
+                             IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+                ecm_uring_free(ring);
+                return NULL;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ring = ring->sq_ring;
+        } else {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                                     PROT_READ|PROT_WRITE,
+                                     MAP_SHARED|MAP_POPULATE, ring->fd,
+                                     IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED) {
+                        ecm_uring_free(ring);
+                        return NULL;
+                }
+        }
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                ecm_uring_free(ring);
+                return NULL;
+        }
+
+        sq = ring->sq_ring;
+        ring->sq_head  = (unsigned *)(sq + p.sq_off.head);
+        ring->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+        ring->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+        cq = ring->cq_ring;
+        ring->cq_head  = (unsigned *)(cq + p.cq_off.head);
+        ring->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+        ring->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+        ring->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        return ring;
+}
+
+/*
+** io_uring_enter() failed without submitting anything. Take back the
+** entries the kernel has not seen and wait for the reads that are in
+** flight, so that none of them lands in a buffer after the batch has been
+** redone with pread. If even that fails the ring is closed, which cancels
+** them, and the file is read with pread from then on.
+*/
+static void ecm_uring_drain(struct ecm_uring *ring, unsigned inflight)
+{
+        unsigned head;
+
+        __atomic_store_n(ring->sq_tail,
+                         __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+        while (inflight) {
+                if (syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        ecm_uring_close(ring);
+                        return;
+                }
+                head = *ring->cq_head;
+                while (head != __atomic_load_n(ring->cq_tail,
+                                               __ATOMIC_ACQUIRE)) {
+                        head++;
+                        inflight--;
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+}
+
+/*
+** Submit all the reads of a batch, plus a prefetch hint for the data that
+** follows, and decode the sectors in whatever order they complete unless
+** 'unpack' is 0. Returns -2 if the ring failed, and the whole batch has
+** to be redone without it.
+** Must be called with ring->mutex held.
+*/
+static int ecm_io_uring(struct ecm_uring *ring, int fd, struct ecm_io *io,
+                        int count, off_t readahead, int unpack)
+{
+        unsigned tail, head, queued = 0, inflight = 0;
+        int next = 0, ret = 0;
+
+        tail = *ring->sq_tail;
+        while (next < count || queued || inflight) {
+                struct io_uring_sqe *sqe;
+                int n;
+
+                while (inflight + queued < ring->entries &&
+                       (next < count || readahead >= 0)) {
+                        unsigned idx = tail & *ring->sq_mask;
+
+                        sqe = &ring->sqes[idx];
+                        memset(sqe, 0, sizeof(*sqe));
+                        sqe->fd = fd;
+                        if (next < count) {
+                                sqe->opcode = IORING_OP_READ;
+                                sqe->addr = (uintptr_t)io[next].buf;
+                                sqe->len = io[next].len;
+                                sqe->off = io[next].offset;
+                                sqe->user_data = (uintptr_t)&io[next];
+                                next++;
+                        } else {
+                                sqe->opcode = IORING_OP_FADVISE;
+                                sqe->off = readahead;
+                                sqe->len = ECM_READAHEAD;
+                                sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+                                sqe->user_data = 0;
+                                readahead = -1;
+                        }
+                        ring->sq_array[idx] = idx;
+                        tail++;
+                        queued++;
+                }
+                __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+                n = syscall(__NR_io_uring_enter, ring->fd, queued, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        ecm_uring_drain(ring, inflight);
+                        return -2;
+                }
+                queued -= n;
+                inflight += n;
+
+                head = *ring->cq_head;
+                while (head != __atomic_load_n(ring->cq_tail,
+                                               __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe *cqe;
+                        struct ecm_io *done;
+
+                        cqe = &ring->cqes[head & *ring->cq_mask];
+                        done = (struct ecm_io *)(uintptr_t)cqe->user_data;
+                        if (done) {
+                                /* redo short or failed reads with pread */
+                                if (cqe->res != done->len &&
+                                    pread(fd, done->buf, done->len,
+                                          done->offset) != done->len) {
+                                        ret = -1;
+                                }
+                                if (unpack) {
+                                        ecm_unpack_block(done);
+                                }
+                        }
+                        head++;
+                        inflight--;
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+        return ret;
+}
+#endif
+
+int ecm_set_io_uring(struct ecm *ecm, int entries)
+{
+#ifdef HAVE_IO_URING
+        if (ecm->uring) {
+                return 0;
+        }
+        /* compressed data has to go through container_pread(), direct
+         * I/O through the block cache, and memory has no file to read
+         */
+        if (ecm->container || ecm->direct || ecm->mem) {
+                return -1;
+        }
+        ecm->uring = ecm_uring_setup(entries);
+        if (ecm->uring) {
+                return 0;
+        }
+#endif
+        return -1;
+}
+
+int ecm_set_direct_io(struct ecm *ecm, int blocks)
+{
+        struct ecm_direct *d;
+        char path[64];
+        int i;
+
+        if (ecm->direct) {
+                return 0;
+        }
+        if (ecm->uring || ecm->mem || blocks < 1) {
+                return -1;
+        }
+        d = calloc(1, sizeof(struct ecm_direct) +
+                   blocks * sizeof(struct direct_block));
+        if (d == NULL) {
+                return -1;
+        }
+        /* a second descriptor for the same file, O_DIRECT can not be set
+         * with fcntl() on every filesystem
+         */
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", ecm->fd);
+        d->fd = open(path, O_RDONLY|O_DIRECT);
+        if (d->fd == -1) {
+                free(d);
+                return -1;
+        }
+        pthread_mutex_init(&d->mutex, NULL);
+        d->count = blocks;
+        for (i = 0; i < blocks; i++) {
+                d->block[i].offset = -1;
+        }
+        /* the data that was read through the page cache at open */
+        posix_fadvise(ecm->fd, 0, 0, POSIX_FADV_DONTNEED);
+        ecm->direct = d;
+        return 0;
+}
+
+int ecm_set_cache(struct ecm *ecm, int blocks)
+{
+        struct ecm_container *c = ecm->container;
+        struct container_block *cache;
+        int i;
+
+        if (c == NULL || blocks < 1) {
+                errno = EINVAL;
+                return -1;
+        }
+        pthread_mutex_lock(&c->mutex);
+        for (i = blocks; i < c->cache_count; i++) {
+                free(c->cache[i].data);
+        }
+        cache = realloc(c->cache, blocks * sizeof(struct container_block));
+        if (cache == NULL) {
+                /* only the slots past 'blocks' have been emptied */
+                if (blocks < c->cache_count) {
+                        c->cache_count = blocks;
+                }
+                pthread_mutex_unlock(&c->mutex);
+                errno = ENOMEM;
+                return -1;
+        }
+        for (i = c->cache_count; i < blocks; i++) {
+                memset(&cache[i], 0, sizeof(struct container_block));
+                cache[i].index = -1;
+        }
+        c->cache = cache;
+        c->cache_count = blocks;
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+}
+
+static int ecm_batch_read(struct ecm *ecm, struct ecm_io *io, int count,
+                          int unpack)
+{
+#ifdef HAVE_IO_URING
+        /* if another thread is using the ring, just do it synchronously */
+        if (ecm->uring && pthread_mutex_trylock(&ecm->uring->mutex) == 0) {
+                struct ecm_io *last = &io[count - 1];
+                int ret = -2;
+
+                if (ecm->uring->fd != -1) {
+                        ret = ecm_io_uring(ecm->uring, ecm->fd, io, count,
+                                           last->offset + last->len,
+                                           unpack);
+                }
+                pthread_mutex_unlock(&ecm->uring->mutex);
+                if (ret != -2) {
+                        return ret;
+                }
+        }
+#endif
+        return ecm_io_sync(ecm, io, count, unpack);
+}
+
+static int ecm_batch_flush(struct ecm *ecm, struct ecm_batch *batch)
+{
+        int count = batch->count;
+        uint64_t sectors = 0, bytes = 0;
+        int i, parallel;
+
+        batch->count = 0;
+        if (count == 0) {
+                return 0;
+        }
+        for (i = 0; i < count; i++) {
+                sectors += batch->io[i].type != BLOCK_BYTES;
+                bytes += batch->io[i].len;
+        }
+        __atomic_add_fetch(&ecm->stats.sectors, sectors, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ecm->stats.ecm_reads, count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ecm->stats.ecm_bytes, bytes, __ATOMIC_RELAXED);
+        parallel = count >= DECODE_MIN &&
+                __atomic_load_n(&decode_pool.threads, __ATOMIC_RELAXED);
+        if (ecm_batch_read(ecm, batch->io, count, !parallel)) {
+                return -1;
+        }
+        if (parallel) {
+                ecm_decode_parallel(batch->io, count);
+        }
+        return 0;
+}
+
+static struct ecm_io *ecm_batch_add(struct ecm *ecm, struct ecm_batch *batch)
+{
+        if (batch->count == ECM_BATCH && ecm_batch_flush(ecm, batch)) {
+                return NULL;
+        }
+        return &batch->io[batch->count++];
+}
+
+/* Queue the reads for 'len' bytes at 'offset'. Returns how many bytes that
+ * is, which is less at the end of the file, once the batch has been
+ * flushed they are in 'buf'.
+ */
+static ssize_t ecm_batch_queue(struct ecm *ecm, struct ecm_batch *batch,
+                               char *buf, off_t offset, size_t len)
+{
+        struct ecm_cursor cur;
+        ssize_t total = 0;
+
+        ecm_seek(ecm, &cur, offset);
+        while (len) {
+                off_t pos = cur.ecm_offset;
+                off_t u_len, e_len;
+                uint8_t ecm_type;
+                uint32_t ecm_len;
+                struct ecm_io *io;
+                size_t n = 0;
+
+                if (ecm_read_tag(ecm, &ecm_len, &ecm_type, &pos) < 0) {
+                        goto failed;
+                }
+                if (ecm_len == 0xFFFFFFFF) {
+                        break;
+                }
+                ecm_len++;
+                ecm_run_size(ecm_type, ecm_len, &u_len, &e_len);
+
+                if (ecm_type == BLOCK_BYTES) {
+                        /* runs can be longer than size_t on 32 bit hosts */
+                        n = len;
+                        if (u_len - cur.skip < len) {
+                                n = u_len - cur.skip;
+                        }
+                        io = ecm_batch_add(ecm, batch);
+                        if (io == NULL) {
+                                goto failed;
+                        }
+                        io->type = BLOCK_BYTES;
+                        io->buf = (uint8_t *)buf;
+                        io->len = n;
+                        io->offset = pos + cur.skip;
+                }
+                while (ecm_type != BLOCK_BYTES && n < len
+                       && cur.skip + n < u_len) {
+                        size_t s_len = u_len / ecm_len;
+                        size_t p_len = e_len / ecm_len;
+                        off_t idx = (cur.skip + n) / s_len;
+
+                        io = ecm_batch_add(ecm, batch);
+                        if (io == NULL) {
+                                goto failed;
+                        }
+                        io->type = ecm_type;
+                        io->skip = (cur.skip + n) % s_len;
+                        io->count = s_len - io->skip;
+                        if (io->count > len - n) {
+                                io->count = len - n;
+                        }
+                        io->dst = buf + n;
+                        io->frame = io->count == s_len ?
+                                (uint8_t *)io->dst : io->sector;
+                        io->buf = ecm_io_payload(io);
+                        io->len = p_len;
+                        io->offset = pos + idx * p_len;
+                        n += io->count;
+                }
+
+                buf   += n;
+                len   -= n;
+                total += n;
+                cur.unpacked_offset += u_len;
+                cur.ecm_offset = pos + e_len;
+                cur.skip = 0;
+        }
+        return total;
+
+failed:
+        errno = EIO;
+        return -1;
+}
+
+static ssize_t ecm_read_batched(struct ecm *ecm, char *buf, off_t offset,
+                                size_t len)
+{
+        struct ecm_batch *batch;
+        ssize_t total;
+
+        pthread_once(&eccedc_once, eccedc_init);
+
+        batch = malloc(sizeof(struct ecm_batch));
+        if (batch == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+        batch->count = 0;
+
+        total = ecm_batch_queue(ecm, batch, buf, offset, len);
+        if (total >= 0 && ecm_batch_flush(ecm, batch)) {
+                errno = EIO;
+                total = -1;
+        }
+        free(batch);
+        return total;
+}
+
+int ecm_readv(struct ecm *ecm, struct ecm_iovec *iov, int iovcnt)
+{
+        struct ecm_batch *batch;
+        uint64_t bytes = 0;
+        int i, ret = 0;
+
+        pthread_once(&eccedc_once, eccedc_init);
+
+        batch = malloc(sizeof(struct ecm_batch));
+        if (batch == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+        batch->count = 0;
+
+        /* all the ranges go into the same batches, so their reads are
+         * issued together and their sectors regenerated in parallel
+         */
+        for (i = 0; i < iovcnt; i++) {
+                iov[i].result = ecm_batch_queue(ecm, batch, iov[i].buf,
+                                                iov[i].offset, iov[i].len);
+                if (iov[i].result < 0) {
+                        ret = -1;
+                        break;
+                }
+                bytes += iov[i].result;
+        }
+        if (ret == 0 && ecm_batch_flush(ecm, batch)) {
+                errno = EIO;
+                ret = -1;
+        }
+        free(batch);
+
+        __atomic_add_fetch(&ecm->stats.reads, iovcnt, __ATOMIC_RELAXED);
+        if (ret) {
+                __atomic_add_fetch(&ecm->stats.errors, 1, __ATOMIC_RELAXED);
+        } else {
+                __atomic_add_fetch(&ecm->stats.bytes, bytes,
+                                   __ATOMIC_RELAXED);
+        }
+        return ret;
+}
+
+/*
+** Building a .edi index, the same way as ecm-index does: an entry for the
+** start of the file, then for every 64 KiB of the raw image the unpacked
+** and packed offset of the tag it starts in. Used for the index of an
+** encoded map and for ECM data that is opened without one.
+*/
+struct ecm_index {
+        uint8_t *buf;
+        size_t len;
+        size_t size;
+        uint32_t entries;
+        off_t next;
+};
+
+static int ecm_index_add(struct ecm_index *idx, off_t upos, off_t usize,
+                         off_t cpos)
+{
+        /* the first entry is for the start of the file */
+        if (idx->entries == 0) {
+                idx->next = upos;
+                usize = 1;
+        }
+        while (upos + usize > idx->next) {
+                uint64_t pos[2];
+
+                if (idx->len + sizeof(pos) > idx->size) {
+                        uint8_t *buf;
+
+                        idx->size = 2 * idx->size + 4096;
+                        buf = realloc(idx->buf, idx->size);
+                        if (buf == NULL) {
+                                return -1;
+                        }
+                        idx->buf = buf;
+                }
+                pos[0] = htole64(upos);
+                pos[1] = htole64(cpos);
+                memcpy(idx->buf + idx->len, pos, sizeof(pos));
+                idx->len += sizeof(pos);
+                idx->entries++;
+                idx->next += 65536;
+        }
+        return 0;
+}
+
+/***************************************************************************/
+/*
+** Single-flight reads.
+** When several clients start the same image they tend to issue the same
+** reads at the same time, each through its own handle. Reads that are in
+** progress are kept in a list, and a read that is entirely covered by one
+** of them waits for it to finish and copies the data from its buffer
+** instead of regenerating the same sectors again. The reader that does the
+** work does not return until all the waiters have taken their copy.
+*/
+struct flight {
+        struct flight *next;
+        dev_t dev;
+        ino_t ino;
+        off_t offset;
+        size_t len;
+        const char *buf;
+
+        pthread_cond_t cond;
+        int done;
+        int waiters;
+        ssize_t ret;
+        int err;
+};
+
+static pthread_mutex_t flights_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct flight *flights;
+
+static struct flight *flight_find(struct ecm *ecm, off_t offset, size_t len)
+{
+        struct flight *f;
+
+        for (f = flights; f; f = f->next) {
+                if (f->dev == ecm->dev && f->ino == ecm->ino &&
+                    f->offset <= offset &&
+                    offset + len <= f->offset + f->len) {
+                        return f;
+                }
+        }
+        return NULL;
+}
+
+/* Wait for a read in progress and copy our part of it.
+ * Called and returns with flights_mutex held.
+ */
+static ssize_t flight_join(struct flight *f, char *buf, off_t offset,
+                           size_t len)
+{
+        ssize_t ret;
+
+        f->waiters++;
+        while (!f->done) {
+                pthread_cond_wait(&f->cond, &flights_mutex);
+        }
+        if (f->ret < 0) {
+                ret = -1;
+                errno = f->err;
+        } else {
+                /* the read may have been cut short by the end of file */
+                ret = f->ret - (offset - f->offset);
+                if (ret < 0) {
+                        ret = 0;
+                }
+                if (ret > (ssize_t)len) {
+                        ret = len;
+                }
+                memcpy(buf, f->buf + (offset - f->offset), ret);
+        }
+        if (--f->waiters == 0) {
+                pthread_cond_broadcast(&f->cond);
+        }
+        return ret;
+}
+
+static void ecm_count_read(struct ecm *ecm, ssize_t ret)
+{
+        __atomic_add_fetch(&ecm->stats.reads, 1, __ATOMIC_RELAXED);
+        if (ret < 0) {
+                __atomic_add_fetch(&ecm->stats.errors, 1, __ATOMIC_RELAXED);
+        } else {
+                __atomic_add_fetch(&ecm->stats.bytes, ret, __ATOMIC_RELAXED);
+        }
+}
+
+ssize_t ecm_read(struct ecm *ecm, char *buf, off_t offset, size_t len)
+{
+        struct flight self, *leader, **f;
+        ssize_t ret;
+
+        /* a buffer in memory is not shared with other handles */
+        if (ecm->mem) {
+                ret = ecm_read_batched(ecm, buf, offset, len);
+                ecm_count_read(ecm, ret);
+                return ret;
+        }
+
+        pthread_mutex_lock(&flights_mutex);
+        leader = flight_find(ecm, offset, len);
+        if (leader) {
+                ret = flight_join(leader, buf, offset, len);
+                pthread_mutex_unlock(&flights_mutex);
+                __atomic_add_fetch(&ecm->stats.shared, 1, __ATOMIC_RELAXED);
+                ecm_count_read(ecm, ret);
+                return ret;
+        }
+        self.dev = ecm->dev;
+        self.ino = ecm->ino;
+        self.offset = offset;
+        self.len = len;
+        self.buf = buf;
+        self.done = 0;
+        self.waiters = 0;
+        pthread_cond_init(&self.cond, NULL);
+        self.next = flights;
+        flights = &self;
+        pthread_mutex_unlock(&flights_mutex);
+
+        ret = ecm_read_batched(ecm, buf, offset, len);
+
+        pthread_mutex_lock(&flights_mutex);
+        for (f = &flights; *f != &self; f = &(*f)->next) {
+                ;
+        }
+        *f = self.next;
+        self.ret = ret;
+        self.err = errno;
+        self.done = 1;
+        pthread_cond_broadcast(&self.cond);
+        while (self.waiters) {
+                pthread_cond_wait(&self.cond, &flights_mutex);
+        }
+        pthread_mutex_unlock(&flights_mutex);
+        pthread_cond_destroy(&self.cond);
+
+        ecm_count_read(ecm, ret);
+        errno = self.err;
+        return ret;
+}
+
+/* Take the index from 'count' pairs of little endian unpacked and packed
+ * offsets, as they are stored in a .edi file.
+ */
+static int ecm_set_index(struct ecm *ecm, const uint8_t *pairs, uint32_t count)
+{
+        uint64_t pos[2];
+        uint32_t i;
+
+        if (count == 0) {
+                return -1;
+        }
+        ecm->idx_data = malloc(2 * (size_t)count * sizeof(off_t));
+        if (ecm->idx_data == NULL) {
+                return -1;
+        }
+        for (i = 0; i < count; i++) {
+                memcpy(pos, pairs + i * sizeof(pos), sizeof(pos));
+                ecm->idx_data[2 * i] = le64toh(pos[0]);
+                ecm->idx_data[2 * i + 1] = le64toh(pos[1]);
+        }
+        ecm->idx_size = count;
+        return 0;
+}
+
+static int ecm_load_index(struct ecm *ecm, const uint8_t *edi, size_t len)
+{
+        uint32_t count;
+
+        if (len < 8) {
+                return -1;
+        }
+        memcpy(&count, edi, 4);
+        count = le32toh(count);
+        if ((len - 8) / 16 < count) {
+                return -1;
+        }
+        return ecm_set_index(ecm, edi + 8, count);
+}
+
+static int ecm_read_index(struct ecm *ecm, int idx_fd)
+{
+        struct stat st;
+        uint8_t *edi;
+        ssize_t len;
+        int ret;
+
+        if (fstat(idx_fd, &st) == -1 || st.st_size < 8) {
+                return -1;
+        }
+        edi = malloc(st.st_size);
+        if (edi == NULL) {
+                return -1;
+        }
+        len = pread(idx_fd, edi, st.st_size, 0);
+        ret = len == st.st_size ? ecm_load_index(ecm, edi, len) : -1;
+        free(edi);
+        return ret;
+}
+
+/* Build the index by walking all the tags, for ECM data without a .edi.
+ * The size of the image comes with it.
+ */
+static int ecm_scan_index(struct ecm *ecm)
+{
+        struct ecm_index idx = { NULL, 8, 0, 0, 0 };
+        off_t upos = 0, pos = 4;
+        int ret = -1;
+
+        if (ecm_index_add(&idx, 0, 0, 4)) {
+                goto out;
+        }
+        while (1) {
+                off_t tag = pos, u_len, e_len;
+                uint8_t ecm_type;
+                uint32_t ecm_len;
+
+                if (ecm_read_tag(ecm, &ecm_len, &ecm_type, &pos) < 0) {
+                        goto out;
+                }
+                if (ecm_len == 0xFFFFFFFF) {
+                        break;
+                }
+                ecm_len++;
+                ecm_run_size(ecm_type, ecm_len, &u_len, &e_len);
+                if (ecm_index_add(&idx, upos, u_len, tag)) {
+                        goto out;
+                }
+                upos += u_len;
+                pos += e_len;
+        }
+        ret = ecm_set_index(ecm, idx.buf + 8, idx.entries);
+        ecm->unpacked_size = upos;
+out:
+        free(idx.buf);
+        return ret;
+}
+
+static struct ecm *ecm_new(void)
+{
+        struct ecm *ecm;
+
+        ecm = calloc(1, sizeof(struct ecm));
+        if (ecm == NULL) {
+                return NULL;
+        }
+        ecm->fd = -1;
+        ecm->unpacked_size = -1;
+        return ecm;
+}
+
+/* Check the data and take the index from 'idx_fd', or from the data itself
+ * if it is -1, unless it has been loaded already. Frees the handle on
+ * failure.
+ */
+static struct ecm *ecm_setup(struct ecm *ecm, int idx_fd)
+{
+        uint8_t magic[4];
+        struct stat st;
+
+        if (ecm_pread(ecm, magic, 4, 0) != 4 ||
+            memcmp(magic, "ECM", 4)) {
+                goto failed;
+        }
+
+        if (ecm->fd != -1) {
+                if (fstat(ecm->fd, &st) == -1) {
+                        goto failed;
+                }
+                ecm->dev = st.st_dev;
+                ecm->ino = st.st_ino;
+        }
+
+        if (ecm->idx_data == NULL &&
+            (idx_fd == -1 ? ecm_scan_index(ecm) :
+             ecm_read_index(ecm, idx_fd))) {
+                goto failed;
+        }
+        return ecm;
+
+failed:
+        ecm_close_file(ecm);
+        return NULL;
+}
+
+struct ecm *ecm_open_file(int dir_fd, const char *file)
+{
+        struct ecm *ecm;
+        int idx_fd, len;
+        uint32_t i;
+        char *idx_file, *data_file;
+
+        ecm = ecm_new();
+        if (ecm == NULL) {
+                return NULL;
+        }
+
+        /* <file> can also be stored compressed as <file>.gz or <file>.zst,
+         * and the index is <file>.edi either way.
+         */
+        len = strlen(file);
+        for (i = 0; container_suffix[i]; i++) {
+                size_t n = strlen(container_suffix[i]);
+
+                if (len > n && !strcmp(file + len - n, container_suffix[i])) {
+                        len -= n;
+                        break;
+                }
+        }
+        data_file = strdup(file);
+        ecm->fd = openat(dir_fd, data_file, 0);
+        for (i = 0; ecm->fd == -1 && errno == ENOENT &&
+                     container_suffix[i]; i++) {
+                free(data_file);
+                asprintf(&data_file, "%s%s", file, container_suffix[i]);
+                ecm->fd = openat(dir_fd, data_file, 0);
+        }
+        if (ecm->fd == -1) {
+                free(data_file);
+                free(ecm);
+                return NULL;
+        }
+        ecm->container = container_open(dir_fd, data_file, ecm->fd);
+        free(data_file);
+
+        asprintf(&idx_file, "%.*s.edi", len, file);
+        idx_fd = openat(dir_fd, idx_file, 0);
+        free(idx_file);
+
+        if (idx_fd == -1) {
+                ecm_close_file(ecm);
+                return NULL;
+        }
+        ecm = ecm_setup(ecm, idx_fd);
+        close(idx_fd);
+        return ecm;
+}
+
+struct ecm *ecm_open_fd(int fd, int idx_fd)
+{
+        struct ecm *ecm;
+
+        ecm = ecm_new();
+        if (ecm == NULL) {
+                return NULL;
+        }
+        /* the handle has a descriptor of its own, the caller keeps 'fd' */
+        ecm->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (ecm->fd == -1) {
+                free(ecm);
+                return NULL;
+        }
+        ecm->container = container_open(-1, NULL, ecm->fd);
+        return ecm_setup(ecm, idx_fd);
+}
+
+struct ecm *ecm_open_mem(const void *data, size_t len, const void *edi,
+                         size_t edi_len)
+{
+        struct ecm *ecm;
+
+        ecm = ecm_new();
+        if (ecm == NULL) {
+                return NULL;
+        }
+        ecm->mem = data;
+        ecm->mem_len = len;
+        if (edi && ecm_load_index(ecm, edi, edi_len)) {
+                ecm_close_file(ecm);
+                return NULL;
+        }
+        return ecm_setup(ecm, -1);
+}
+
+void ecm_close_file(struct ecm *ecm)
+{
+#ifdef HAVE_IO_URING
+        if (ecm->uring) {
+                ecm_uring_free(ecm->uring);
+        }
+#endif
+        if (ecm->container) {
+                container_free(ecm->container);
+        }
+        if (ecm->direct) {
+                direct_free(ecm->direct);
+        }
+        if (ecm->fd != -1) {
+                close(ecm->fd);
+        }
+        free(ecm->idx_data);
+        free(ecm);
+}
+
+off_t ecm_get_file_size(struct ecm *ecm)
+{
+        off_t size = __atomic_load_n(&ecm->unpacked_size, __ATOMIC_RELAXED);
+
+        /* Threads that get here at the same time all work out the same
+         * size, so it does not matter which of them stores it.
+         */
+        if (size == -1) {
+                /* Find out what the uncompressed size is by adding up the
+                 * runs after the last index entry. Only the tags are read,
+                 * so a long run at the end of the image costs nothing.
+                 */
+                off_t pos = ecm->idx_data[2 * (ecm->idx_size - 1) + 1];
+
+                size = ecm->idx_data[2 * (ecm->idx_size - 1)];
+                while (1) {
+                        uint8_t ecm_type;
+                        uint32_t ecm_len;
+                        off_t u_len, e_len;
+
+                        if (ecm_read_tag(ecm, &ecm_len, &ecm_type, &pos) < 0
+                            || ecm_len == 0xFFFFFFFF) {
+                                break;
+                        }
+                        ecm_len++;
+                        ecm_run_size(ecm_type, ecm_len, &u_len, &e_len);
+                        size += u_len;
+                        pos += e_len;
+                }
+                __atomic_store_n(&ecm->unpacked_size, size, __ATOMIC_RELAXED);
+        }
+        return size;
+}
+
+void ecm_get_stats(struct ecm *ecm, struct ecm_stats *stats)
+{
+        stats->reads = __atomic_load_n(&ecm->stats.reads, __ATOMIC_RELAXED);
+        stats->bytes = __atomic_load_n(&ecm->stats.bytes, __ATOMIC_RELAXED);
+        stats->shared = __atomic_load_n(&ecm->stats.shared,
+                                        __ATOMIC_RELAXED);
+        stats->errors = __atomic_load_n(&ecm->stats.errors,
+                                        __ATOMIC_RELAXED);
+        stats->sectors = __atomic_load_n(&ecm->stats.sectors,
+                                         __ATOMIC_RELAXED);
+        stats->ecm_reads = __atomic_load_n(&ecm->stats.ecm_reads,
+                                           __ATOMIC_RELAXED);
+        stats->ecm_bytes = __atomic_load_n(&ecm->stats.ecm_bytes,
+                                           __ATOMIC_RELAXED);
+        stats->cache_hits = 0;
+        stats->cache_misses = 0;
+        if (ecm->direct) {
+                pthread_mutex_lock(&ecm->direct->mutex);
+                stats->cache_hits += ecm->direct->hits;
+                stats->cache_misses += ecm->direct->misses;
+                pthread_mutex_unlock(&ecm->direct->mutex);
+        }
+        if (ecm->container) {
+                pthread_mutex_lock(&ecm->container->mutex);
+                stats->cache_hits += ecm->container->hits;
+                stats->cache_misses += ecm->container->misses;
+                pthread_mutex_unlock(&ecm->container->mutex);
+        }
+}
+
+/*
+** Cooked view.
+**
+** For images made of 2352 byte Mode 1 or Mode 2 Form 1 sectors this
+** presents just the 2048 bytes of user data of every sector, like an .iso.
+** The user data is stored verbatim in the ECM payload so it is read
+** straight from the file and no EDC/ECC is ever computed. Anything that
+** does not come from a MODE_1, MODE_2_FORM_1 or BYTES run of the expected
+** layout falls back to a normal ecm_read() of the user data.
+*/
+#define COOKED_SIZE  2048
+#define COOKED_BATCH 32
+
+/* Returns where in each raw sector the user data starts, 16 for Mode 1
+ * and 24 for Mode 2 images, or -1 if there is no cooked view.
+ */
+int ecm_cooked_offset(struct ecm *ecm)
+{
+        static const uint8_t sync[12] = {
+                0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+        };
+        uint8_t header[16];
+        int offset;
+
+        /* like the size, this is the same whichever thread works it out */
+        offset = __atomic_load_n(&ecm->cooked_offset, __ATOMIC_RELAXED);
+        if (offset) {
+                return offset;
+        }
+        if (ecm_get_file_size(ecm) % BIN_BLOCK_SIZE
+            || ecm_read(ecm, (char *)header, 0, 16) != 16
+            || memcmp(header, sync, 12)) {
+                offset = -1;
+        } else if (header[15] == 1) {
+                offset = 16;
+        } else if (header[15] == 2) {
+                offset = 24;
+        } else {
+                offset = -1;
+        }
+        __atomic_store_n(&ecm->cooked_offset, offset, __ATOMIC_RELAXED);
+        return offset;
+}
+
+off_t ecm_get_cooked_size(struct ecm *ecm)
+{
+        if (ecm_cooked_offset(ecm) < 0) {
+                return -1;
+        }
+        return ecm_get_file_size(ecm) / BIN_BLOCK_SIZE * COOKED_SIZE;
+}
+
+ssize_t ecm_read_cooked(struct ecm *ecm, char *buf, off_t offset, size_t len)
+{
+        uint8_t *tmp = NULL;
+        ssize_t total = 0;
+        off_t size;
+        int user;
+
+        user = ecm_cooked_offset(ecm);
+        if (user < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        size = ecm_get_cooked_size(ecm);
+        if (offset >= size) {
+                return 0;
+        }
+        if (len > size - offset) {
+                len = size - offset;
+        }
+
+        while (len) {
+                struct ecm_cursor cur;
+                off_t sector = offset / COOKED_SIZE;
+                size_t skip = offset % COOKED_SIZE;
+                off_t pos, u_len, e_len;
+                uint8_t ecm_type;
+                uint32_t ecm_len;
+                size_t n, s_len, p_len, data, hdr;
+                off_t idx, count, i;
+
+                ecm_seek(ecm, &cur, sector * BIN_BLOCK_SIZE + user + skip);
+                pos = cur.ecm_offset;
+                if (ecm_read_tag(ecm, &ecm_len, &ecm_type, &pos) < 0
+                    || ecm_len == 0xFFFFFFFF) {
+                        goto failed;
+                }
+                ecm_len++;
+                ecm_run_size(ecm_type, ecm_len, &u_len, &e_len);
+
+                n = COOKED_SIZE - skip;
+                if (n > len) {
+                        n = len;
+                }
+
+                if (ecm_type == BLOCK_BYTES) {
+                        if (cur.skip + n > u_len) {
+                                goto slow;
+                        }
+                        if (ecm_pread(ecm, buf, n, pos + cur.skip) != n) {
+                                goto failed;
+                        }
+                        goto next;
+                }
+
+                /* where the user data is in the unpacked and packed sector */
+                if (ecm_type == BLOCK_MODE_1 && user == 16) {
+                        data = 16;
+                } else if (ecm_type == BLOCK_MODE_2_FORM_1 && user == 24) {
+                        data = 8;
+                } else {
+                        goto slow;
+                }
+                s_len = u_len / ecm_len;
+                p_len = e_len / ecm_len;
+                idx = cur.skip / s_len;
+                if (cur.skip % s_len != data + skip) {
+                        /* sectors in this run are not aligned to the image */
+                        goto slow;
+                }
+
+                /* read the payloads of as many sectors of this run as the
+                 * request covers in one go, and pick out the user data
+                 */
+                count = (skip + len + COOKED_SIZE - 1) / COOKED_SIZE;
+                if (count > ecm_len - idx) {
+                        count = ecm_len - idx;
+                }
+                if (count > COOKED_BATCH) {
+                        count = COOKED_BATCH;
+                }
+                if (tmp == NULL) {
+                        tmp = malloc(COOKED_BATCH * 0x918);
+                        if (tmp == NULL) {
+                                goto failed;
+                        }
+                }
+                if (ecm_pread(ecm, tmp, count * p_len, pos + idx * p_len)
+                    != count * p_len) {
+                        goto failed;
+                }
+                /* skip the address (Mode 1) or subheader (Mode 2) */
+                hdr = p_len - COOKED_SIZE;
+                for (i = 0, n = 0; i < count && len > n; i++) {
+                        size_t c = COOKED_SIZE - skip;
+
+                        if (c > len - n) {
+                                c = len - n;
+                        }
+                        memcpy(buf + n, tmp + i * p_len + hdr + skip, c);
+                        n += c;
+                        skip = 0;
+                }
+                goto next;
+
+        slow:
+                if (ecm_read(ecm, buf, sector * BIN_BLOCK_SIZE + user + skip, n)
+                    != n) {
+                        goto failed;
+                }
+        next:
+                buf    += n;
+                offset += n;
+                total  += n;
+                len    -= n;
+        }
+        free(tmp);
+        return total;
+
+failed:
+        free(tmp);
+        errno = EIO;
+        return -1;
+}
+
+/*
+** Combine the EDCs of two consecutive blocks, edc2 being the EDC of the
+** second block computed from zero and len2 its length.
+** Same algorithm as crc32_combine() in zlib.
+*/
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+        uint32_t sum = 0;
+
+        while (vec) {
+                if (vec & 1) {
+                        sum ^= *mat;
+                }
+                vec >>= 1;
+                mat++;
+        }
+        return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+        int n;
+
+        for (n = 0; n < 32; n++) {
+                square[n] = gf2_matrix_times(mat, mat[n]);
+        }
+}
+
+static uint32_t edc_combine(uint32_t edc1, uint32_t edc2, off_t len2)
+{
+        uint32_t even[32];
+        uint32_t odd[32];
+        uint32_t row = 1;
+        int n;
+
+        if (len2 <= 0) {
+                return edc1 ^ edc2;
+        }
+
+        /* operator for one zero bit */
+        odd[0] = 0xD8018001;
+        for (n = 1; n < 32; n++) {
+                odd[n] = row;
+                row <<= 1;
+        }
+        /* operators for two and four zero bits */
+        gf2_matrix_square(even, odd);
+        gf2_matrix_square(odd, even);
+
+        /* apply len2 zero bytes to edc1 */
+        do {
+                gf2_matrix_square(even, odd);
+                if (len2 & 1) {
+                        edc1 = gf2_matrix_times(even, edc1);
+                }
+                len2 >>= 1;
+                if (len2 == 0) {
+                        break;
+                }
+                gf2_matrix_square(odd, even);
+                if (len2 & 1) {
+                        edc1 = gf2_matrix_times(odd, edc1);
+                }
+                len2 >>= 1;
+        } while (len2);
+
+        return edc1 ^ edc2;
+}
+
+/*
+** Verify the whole image against the EDC stored at the end of the file,
+** without writing it anywhere.
+**
+** The unpacked image is split into VERIFY_CHUNK sized pieces that are
+** decoded by 'threads' threads, each piece getting its own EDC. These are
+** then combined in order and compared to the trailer.
+*/
+#define VERIFY_CHUNK (1024 * 1024)
+
+struct verify_job {
+        struct ecm *ecm;
+        off_t size;
+        int nchunks;
+        int next;
+        uint32_t *edc;
+        off_t error;
+        int nomem;
+        pthread_mutex_t mutex;
+};
+
+static void *verify_worker(void *arg)
+{
+        struct verify_job *job = arg;
+        char *buf;
+
+        /* the other threads do the work, ecm_verify() notices if
+         * there are none
+         */
+        buf = malloc(VERIFY_CHUNK);
+        if (buf == NULL) {
+                return NULL;
+        }
+
+        while (1) {
+                off_t offset;
+                ssize_t len, count;
+                int i;
+
+                pthread_mutex_lock(&job->mutex);
+                i = job->next++;
+                pthread_mutex_unlock(&job->mutex);
+                if (i >= job->nchunks) {
+                        break;
+                }
+
+                offset = (off_t)i * VERIFY_CHUNK;
+                len = job->size - offset;
+                if (len > VERIFY_CHUNK) {
+                        len = VERIFY_CHUNK;
+                }
+                count = ecm_read(job->ecm, buf, offset, len);
+                if (count == -1 && errno == ENOMEM) {
+                        pthread_mutex_lock(&job->mutex);
+                        job->nomem = 1;
+                        pthread_mutex_unlock(&job->mutex);
+                        continue;
+                }
+                if (count != len) {
+                        if (count > 0) {
+                                offset += count;
+                        }
+                        pthread_mutex_lock(&job->mutex);
+                        if (job->error == -1 || offset < job->error) {
+                                job->error = offset;
+                        }
+                        pthread_mutex_unlock(&job->mutex);
+                        continue;
+                }
+                job->edc[i] = edc_partial_computeblock(0, (uint8_t *)buf, len);
+        }
+        free(buf);
+        return NULL;
+}
+
+int ecm_verify(struct ecm *ecm, int threads, off_t *offset)
+{
+        struct verify_job job;
+        struct ecm_cursor cur;
+        pthread_t *thread;
+        uint32_t edc = 0, ecm_len;
+        uint8_t ecm_type, trailer[4];
+        int i;
+
+        pthread_once(&eccedc_once, eccedc_init);
+
+        *offset = -1;
+        if (threads < 1) {
+                threads = 1;
+        }
+
+        job.ecm = ecm;
+        job.size = ecm_get_file_size(ecm);
+        job.nchunks = (job.size + VERIFY_CHUNK - 1) / VERIFY_CHUNK;
+        job.next = 0;
+        job.error = -1;
+        job.nomem = 0;
+        job.edc = calloc(job.nchunks + 1, sizeof(uint32_t));
+        thread = calloc(threads, sizeof(pthread_t));
+        if (job.edc == NULL || thread == NULL) {
+                free(job.edc);
+                free(thread);
+                return ECM_VERIFY_NO_MEMORY;
+        }
+        pthread_mutex_init(&job.mutex, NULL);
+
+        for (i = 0; i < threads; i++) {
+                if (pthread_create(&thread[i], NULL, verify_worker, &job)) {
+                        break;
+                }
+        }
+        if (i == 0) {
+                verify_worker(&job);
+        }
+        while (i--) {
+                pthread_join(thread[i], NULL);
+        }
+        pthread_mutex_destroy(&job.mutex);
+        free(thread);
+
+        if (job.nomem || job.next < job.nchunks) {
+                free(job.edc);
+                return ECM_VERIFY_NO_MEMORY;
+        }
+        if (job.error != -1) {
+                free(job.edc);
+                *offset = job.error;
+                return ECM_VERIFY_READ_ERROR;
+        }
+
+        for (i = 0; i < job.nchunks; i++) {
+                off_t len = job.size - (off_t)i * VERIFY_CHUNK;
+
+                if (len > VERIFY_CHUNK) {
+                        len = VERIFY_CHUNK;
+                }
+                edc = edc_combine(edc, job.edc[i], len);
+        }
+        free(job.edc);
+
+        /* the EDC trailer follows the end-of-file tag */
+        ecm_seek(ecm, &cur, job.size);
+        if (ecm_read_tag(ecm, &ecm_len, &ecm_type, &cur.ecm_offset) < 0
+            || ecm_len != 0xFFFFFFFF
+            || ecm_pread(ecm, trailer, 4, cur.ecm_offset) != 4) {
+                *offset = job.size;
+                return ECM_VERIFY_READ_ERROR;
+        }
+        if (trailer[0] != ((edc >>  0) & 0xFF) ||
+            trailer[1] != ((edc >>  8) & 0xFF) ||
+            trailer[2] != ((edc >> 16) & 0xFF) ||
+            trailer[3] != ((edc >> 24) & 0xFF)) {
+                return ECM_VERIFY_EDC_MISMATCH;
+        }
+        return ECM_VERIFY_OK;
+}
+
+/***************************************************************************/
+/*
+** Encoding.
+**
+** A raw image is encoded by first classifying every 2352 byte sector. A
+** sector is stored as Mode 1 or Mode 2 Form 1/2 only if regenerating it
+** from its payload gives back exactly the same bytes, everything else is
+** stored verbatim. Consecutive sectors of the same class make up a run.
+**
+** The classification is kept as a struct ecm_map, from which any part of
+** the .ecm file and its .edi index can be produced on demand. Each run is
+** laid out as:
+**
+**   BLOCK_BYTES          one tag, then the bytes
+**   BLOCK_MODE_1         one tag, then 0x803 bytes of payload per sector
+**   BLOCK_MODE_2_FORM_*  per sector a tag and the 16 bytes of sync and
+**                        header, then a tag and the payload of the 2336
+**                        bytes that follow, as ECM stores Mode 2 sectors
+**
+** so every sector of a run is encoded to the same number of bytes and
+** random reads of the .ecm only need to read the sectors they cover.
+**
+** The image is classified MAP_CHUNK sectors at a time, and runs never
+** span two chunks. That way each chunk can be encoded on its own, by
+** whichever thread classified it, and a map built for an image always
+** describes the same .ecm that ecm_encode() writes for it.
+*/
+#define MAP_MAGIC "ECMMAP1"
+#define MAP_CHUNK 1024          /* sectors classified at a time */
+
+/* sectors read at a time by ecm_map_read() */
+#define MAP_READ_SECTORS 32
+
+struct ecm_run {
+        uint8_t type;
+        uint32_t count;         /* bytes for BLOCK_BYTES, else sectors */
+        off_t raw;              /* offset in the raw image */
+        off_t pos;              /* offset in the .ecm */
+};
+
+struct ecm_map {
+        off_t raw_size;
+        off_t end;              /* of the last run, where the end tag is */
+        uint32_t edc;           /* of the whole raw image */
+        size_t count;
+        size_t size;
+        struct ecm_run *runs;
+};
+
+/* Store a tag for 'num' + 1 items of 'type', returns its length */
+static int ecm_write_tag(uint8_t *out, uint8_t type, uint32_t num)
+{
+        int n = 0;
+
+        out[0] = type | ((num & 0x1F) << 2);
+        num >>= 5;
+        while (num) {
+                out[n++] |= 0x80;
+                out[n] = num & 0x7F;
+                num >>= 7;
+        }
+        return n + 1;
+}
+
+static int ecm_tag_size(uint32_t num)
+{
+        uint8_t tag[5];
+
+        return ecm_write_tag(tag, 0, num);
+}
+
+/* bytes each sector of a run is encoded to, 1 for each byte of a
+ * BLOCK_BYTES run
+ */
+static size_t ecm_unit_size(uint8_t type)
+{
+        switch (type) {
+        case BLOCK_MODE_1:
+                return 0x803;
+        case BLOCK_MODE_2_FORM_1:
+                return 1 + 16 + 1 + 0x804;
+        case BLOCK_MODE_2_FORM_2:
+                return 1 + 16 + 1 + 0x918;
+        }
+        return 1;
+}
+
+/* the tag in front of a run, Mode 2 runs have tags for every sector */
+static size_t ecm_run_prefix(struct ecm_run *run)
+{
+        if (run->type == BLOCK_BYTES || run->type == BLOCK_MODE_1) {
+                return ecm_tag_size(run->count - 1);
+        }
+        return 0;
+}
+
+/* bytes of the raw image a run covers */
+static off_t ecm_run_raw_size(struct ecm_run *run)
+{
+        if (run->type == BLOCK_BYTES) {
+                return run->count;
+        }
+        return (off_t)run->count * BIN_BLOCK_SIZE;
+}
+
+/* bytes of the .ecm a run is encoded to */
+static off_t ecm_run_length(struct ecm_run *run)
+{
+        return ecm_run_prefix(run) + (off_t)ecm_unit_size(run->type) *
+                run->count;
+}
+
+/* Encode one sector of a run to ecm_unit_size() bytes */
+static void ecm_encode_unit(uint8_t type, const uint8_t *sector,
+                            uint8_t *out)
+{
+        switch (type) {
+        case BLOCK_MODE_1:
+                memcpy(out, sector + 0x00C, 3);
+                memcpy(out + 3, sector + 0x010, 0x800);
+                break;
+        case BLOCK_MODE_2_FORM_1:
+        case BLOCK_MODE_2_FORM_2:
+                out += ecm_write_tag(out, BLOCK_BYTES, 15);
+                memcpy(out, sector, 16);
+                out += 16;
+                out += ecm_write_tag(out, type, 0);
+                memcpy(out, sector + 0x010, 4);
+                memcpy(out + 4, sector + 0x018,
+                       type == BLOCK_MODE_2_FORM_1 ? 0x800 : 0x914);
+                break;
+        }
+}
+
+/* Returns how a raw sector can be stored */
+static int ecm_classify(const uint8_t *sector)
+{
+        static const uint8_t sync[12] = {
+                0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+        };
+        uint8_t check[BIN_BLOCK_SIZE];
+        const uint8_t *m2 = sector + 0x010;
+
+        if (memcmp(sector, sync, 12)) {
+                return BLOCK_BYTES;
+        }
+        switch (sector[0x00F]) {
+        case 1:
+                memcpy(check, sector, 0x810);
+                if (!eccedc_generate_zero(check, BLOCK_MODE_1)) {
+                        eccedc_generate(check, BLOCK_MODE_1, BIN_BLOCK_SIZE);
+                }
+                if (!memcmp(check + 0x810, sector + 0x810,
+                            BIN_BLOCK_SIZE - 0x810)) {
+                        return BLOCK_MODE_1;
+                }
+                break;
+        case 2:
+                /* the subheader is stored only once */
+                if (memcmp(m2, m2 + 4, 4)) {
+                        break;
+                }
+                memcpy(check, m2, 0x808);
+                if (!eccedc_generate_zero(check, BLOCK_MODE_2_FORM_1)) {
+                        eccedc_generate(check, BLOCK_MODE_2_FORM_1,
+                                        BIN_BLOCK_SIZE);
+                }
+                if (!memcmp(check + 0x808, m2 + 0x808, 0x920 - 0x808)) {
+                        return BLOCK_MODE_2_FORM_1;
+                }
+                memcpy(check, m2, 0x91C);
+                if (!eccedc_generate_zero(check, BLOCK_MODE_2_FORM_2)) {
+                        eccedc_generate(check, BLOCK_MODE_2_FORM_2,
+                                        BIN_BLOCK_SIZE);
+                }
+                if (!memcmp(check + 0x91C, m2 + 0x91C, 4)) {
+                        return BLOCK_MODE_2_FORM_2;
+                }
+                break;
+        }
+        return BLOCK_BYTES;
+}
+
+/* Add 'count' sectors, or bytes for BLOCK_BYTES, to the end of the map,
+ * extending the last run if it is of the same type and 'merge' is set.
+ */
+static int ecm_map_append(struct ecm_map *map, uint8_t type, uint32_t count,
+                          int merge)
+{
+        struct ecm_run *run;
+
+        run = map->count ? &map->runs[map->count - 1] : NULL;
+        if (merge && run && run->type == type) {
+                map->end -= ecm_run_length(run);
+                run->count += count;
+                map->end += ecm_run_length(run);
+                return 0;
+        }
+        if (map->count == map->size) {
+                map->size = map->size ? 2 * map->size : 64;
+                run = realloc(map->runs, map->size * sizeof(struct ecm_run));
+                if (run == NULL) {
+                        return -1;
+                }
+                map->runs = run;
+        }
+        run = &map->runs[map->count++];
+        run->type = type;
+        run->count = count;
+        run->raw = 0;
+        run->pos = map->end;
+        if (map->count > 1) {
+                run->raw = run[-1].raw + ecm_run_raw_size(run - 1);
+        }
+        map->end += ecm_run_length(run);
+        return 0;
+}
+
+static struct ecm_map *ecm_map_new(void)
+{
+        struct ecm_map *map;
+
+        map = calloc(1, sizeof(struct ecm_map));
+        if (map == NULL) {
+                return NULL;
+        }
+        map->end = 4;
+        return map;
+}
+
+void ecm_map_free(struct ecm_map *map)
+{
+        free(map->runs);
+        free(map);
+}
+
+/* Encode a whole run, its raw data being 'raw', to ecm_run_length() bytes */
+static void ecm_encode_run(struct ecm_run *run, const uint8_t *raw,
+                           uint8_t *out)
+{
+        size_t unit = ecm_unit_size(run->type);
+        uint32_t i;
+
+        if (ecm_run_prefix(run)) {
+                out += ecm_write_tag(out, run->type, run->count - 1);
+        }
+        if (run->type == BLOCK_BYTES) {
+                memcpy(out, raw, run->count);
+                return;
+        }
+        for (i = 0; i < run->count; i++) {
+                ecm_encode_unit(run->type, raw + (size_t)i * BIN_BLOCK_SIZE,
+                                out + (size_t)i * unit);
+        }
+}
+
+/* the end tag and the EDC of the image */
+static void ecm_map_trailer(struct ecm_map *map, uint8_t *trailer)
+{
+        ecm_write_tag(trailer, BLOCK_BYTES, 0xFFFFFFFF);
+        trailer[5] = (map->edc >>  0) & 0xFF;
+        trailer[6] = (map->edc >>  8) & 0xFF;
+        trailer[7] = (map->edc >> 16) & 0xFF;
+        trailer[8] = (map->edc >> 24) & 0xFF;
+}
+
+struct map_chunk {
+        struct ecm_map *map;    /* runs of the chunk, relative to it */
+        uint8_t *out;           /* the chunk encoded, if writing a file */
+        uint32_t edc;
+        int done;
+};
+
+struct map_job {
+        int fd;
+        int out_fd;             /* where the .ecm goes, or -1 */
+        off_t size;
+        off_t nchunks;
+        off_t next;             /* next chunk to classify */
+        off_t written;          /* chunks written to out_fd so far */
+        off_t window;           /* how far ahead of that to classify */
+        struct map_chunk *chunks;
+        int error;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+static void map_fail(struct map_job *job)
+{
+        pthread_mutex_lock(&job->mutex);
+        job->error = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->mutex);
+}
+
+/* Classify, and encode if writing a file, one chunk of the image */
+static int map_chunk(struct map_job *job, off_t i, uint8_t *buf)
+{
+        struct map_chunk *c = &job->chunks[i];
+        off_t offset = i * MAP_CHUNK * BIN_BLOCK_SIZE;
+        ssize_t len;
+        size_t s, r;
+
+        len = job->size - offset;
+        if (len > MAP_CHUNK * BIN_BLOCK_SIZE) {
+                len = MAP_CHUNK * BIN_BLOCK_SIZE;
+        }
+        if (pread(job->fd, buf, len, offset) != len) {
+                return -1;
+        }
+        c->map = ecm_map_new();
+        if (c->map == NULL) {
+                return -1;
+        }
+        for (s = 0; (s + 1) * BIN_BLOCK_SIZE <= (size_t)len; s++) {
+                int type = ecm_classify(buf + s * BIN_BLOCK_SIZE);
+
+                if (ecm_map_append(c->map, type, type == BLOCK_BYTES ?
+                                   BIN_BLOCK_SIZE : 1, 1)) {
+                        return -1;
+                }
+        }
+        if (len % BIN_BLOCK_SIZE &&
+            ecm_map_append(c->map, BLOCK_BYTES, len % BIN_BLOCK_SIZE, 1)) {
+                return -1;
+        }
+        c->edc = edc_partial_computeblock(0, buf, len);
+
+        if (job->out_fd != -1) {
+                c->out = malloc(c->map->end);
+                if (c->out == NULL) {
+                        return -1;
+                }
+                for (r = 0; r < c->map->count; r++) {
+                        struct ecm_run *run = &c->map->runs[r];
+
+                        ecm_encode_run(run, buf + run->raw,
+                                       c->out + run->pos - 4);
+                }
+        }
+        return 0;
+}
+
+static void *map_worker(void *arg)
+{
+        struct map_job *job = arg;
+        uint8_t *buf;
+
+        buf = malloc(MAP_CHUNK * BIN_BLOCK_SIZE);
+        if (buf == NULL) {
+                map_fail(job);
+                return NULL;
+        }
+
+        while (1) {
+                off_t i;
+
+                pthread_mutex_lock(&job->mutex);
+                while (!job->error && job->next < job->nchunks &&
+                       job->next >= job->written + job->window) {
+                        pthread_cond_wait(&job->cond, &job->mutex);
+                }
+                i = job->error ? job->nchunks : job->next++;
+                pthread_mutex_unlock(&job->mutex);
+                if (i >= job->nchunks) {
+                        break;
+                }
+
+                if (map_chunk(job, i, buf)) {
+                        map_fail(job);
+                        break;
+                }
+                pthread_mutex_lock(&job->mutex);
+                job->chunks[i].done = 1;
+                pthread_cond_broadcast(&job->cond);
+                pthread_mutex_unlock(&job->mutex);
+        }
+        free(buf);
+        return NULL;
+}
+
+/*
+** Classify the raw image in 'fd' with 'threads' threads. If 'out_fd' is
+** not -1 the .ecm is written to it at the same time: the calling thread
+** writes out the chunks in order as they are encoded, and the workers
+** are kept at most a few chunks ahead of it.
+*/
+static struct ecm_map *ecm_map_encode(int fd, int out_fd, int threads)
+{
+        uint8_t trailer[5 + 4];
+        struct ecm_map *map;
+        struct map_job job;
+        pthread_t *thread;
+        struct stat st;
+        off_t i;
+        size_t r;
+        int t;
+
+        pthread_once(&eccedc_once, eccedc_init);
+
+        if (fstat(fd, &st) == -1) {
+                return NULL;
+        }
+        if (threads < 1) {
+                threads = 1;
+        }
+
+        memset(&job, 0, sizeof(job));
+        job.fd = fd;
+        job.out_fd = out_fd;
+        job.size = st.st_size;
+        job.nchunks = (job.size + MAP_CHUNK * BIN_BLOCK_SIZE - 1) /
+                (MAP_CHUNK * BIN_BLOCK_SIZE);
+        job.window = out_fd == -1 ? job.nchunks : 2 * threads;
+        job.chunks = calloc(job.nchunks + 1, sizeof(struct map_chunk));
+        thread = calloc(threads, sizeof(pthread_t));
+        map = ecm_map_new();
+        if (job.chunks == NULL || thread == NULL || map == NULL) {
+                goto failed;
+        }
+        map->raw_size = job.size;
+        if (out_fd != -1 && write(out_fd, "ECM", 4) != 4) {
+                goto failed;
+        }
+        pthread_mutex_init(&job.mutex, NULL);
+        pthread_cond_init(&job.cond, NULL);
+
+        for (t = 0; t < threads; t++) {
+                if (pthread_create(&thread[t], NULL, map_worker, &job)) {
+                        break;
+                }
+        }
+        if (t == 0) {
+                if (out_fd != -1) {
+                        job.error = 1;
+                } else {
+                        map_worker(&job);
+                }
+        }
+
+        /* collect the chunks in order */
+        for (i = 0; i < job.nchunks; i++) {
+                struct map_chunk *c = &job.chunks[i];
+                off_t len = job.size - i * MAP_CHUNK * BIN_BLOCK_SIZE;
+
+                pthread_mutex_lock(&job.mutex);
+                while (!c->done && !job.error) {
+                        pthread_cond_wait(&job.cond, &job.mutex);
+                }
+                pthread_mutex_unlock(&job.mutex);
+                if (job.error) {
+                        break;
+                }
+
+                if (out_fd != -1) {
+                        size_t n = c->map->end - 4;
+
+                        if (write(out_fd, c->out, n) != (ssize_t)n) {
+                                map_fail(&job);
+                                break;
+                        }
+                        free(c->out);
+                        c->out = NULL;
+                        pthread_mutex_lock(&job.mutex);
+                        job.written = i + 1;
+                        pthread_cond_broadcast(&job.cond);
+                        pthread_mutex_unlock(&job.mutex);
+                }
+
+                for (r = 0; r < c->map->count; r++) {
+                        if (ecm_map_append(map, c->map->runs[r].type,
+                                           c->map->runs[r].count, 0)) {
+                                map_fail(&job);
+                                break;
+                        }
+                }
+                if (len > MAP_CHUNK * BIN_BLOCK_SIZE) {
+                        len = MAP_CHUNK * BIN_BLOCK_SIZE;
+                }
+                map->edc = edc_combine(map->edc, c->edc, len);
+                ecm_map_free(c->map);
+                c->map = NULL;
+        }
+
+        while (t--) {
+                pthread_join(thread[t], NULL);
+        }
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.mutex);
+        if (job.error) {
+                errno = EIO;
+                goto failed;
+        }
+        if (out_fd != -1) {
+                ecm_map_trailer(map, trailer);
+                if (write(out_fd, trailer, sizeof(trailer)) !=
+                    sizeof(trailer)) {
+                        goto failed;
+                }
+        }
+        free(job.chunks);
+        free(thread);
+        return map;
+
+failed:
+        for (i = 0; job.chunks && i < job.nchunks; i++) {
+                if (job.chunks[i].map) {
+                        ecm_map_free(job.chunks[i].map);
+                }
+                free(job.chunks[i].out);
+        }
+        if (map) {
+                ecm_map_free(map);
+        }
+        free(job.chunks);
+        free(thread);
+        return NULL;
+}
+
+struct ecm_map *ecm_map_build(int fd, int threads)
+{
+        return ecm_map_encode(fd, -1, threads);
+}
+
+struct ecm_map *ecm_encode(int fd, int ecm_fd, int threads)
+{
+        return ecm_map_encode(fd, ecm_fd, threads);
+}
+
+/*
+** A saved map is MAP_MAGIC, the size and EDC of the raw image and the
+** number of runs, followed by the type and count of every run, all
+** little endian.
+*/
+struct map_header {
+        char magic[8];
+        uint64_t raw_size;
+        uint32_t edc;
+        uint32_t count;
+};
+
+struct map_record {
+        uint32_t count;
+        uint8_t type;
+        uint8_t pad[3];
+};
+
+int ecm_map_save(struct ecm_map *map, int fd)
+{
+        struct map_header hdr;
+        struct map_record *rec;
+        size_t i, len;
+        int ret = 0;
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, MAP_MAGIC, 8);
+        hdr.raw_size = htole64(map->raw_size);
+        hdr.edc = htole32(map->edc);
+        hdr.count = htole32(map->count);
+
+        len = map->count * sizeof(struct map_record);
+        rec = calloc(1, len + 1);
+        if (rec == NULL) {
+                return -1;
+        }
+        for (i = 0; i < map->count; i++) {
+                rec[i].count = htole32(map->runs[i].count);
+                rec[i].type = map->runs[i].type;
+        }
+        if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            write(fd, rec, len) != (ssize_t)len) {
+                ret = -1;
+        }
+        free(rec);
+        return ret;
+}
+
+struct ecm_map *ecm_map_load(int fd)
+{
+        struct ecm_map *map;
+        struct map_header hdr;
+        struct map_record *rec = NULL;
+        uint32_t i, count;
+        size_t len;
+
+        if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            memcmp(hdr.magic, MAP_MAGIC, 8)) {
+                errno = EINVAL;
+                return NULL;
+        }
+        map = ecm_map_new();
+        if (map == NULL) {
+                return NULL;
+        }
+        count = le32toh(hdr.count);
+        len = (size_t)count * sizeof(struct map_record);
+        rec = malloc(len + 1);
+        if (rec == NULL || read(fd, rec, len) != (ssize_t)len) {
+                errno = EINVAL;
+                goto failed;
+        }
+        for (i = 0; i < count; i++) {
+                if (rec[i].type > BLOCK_MODE_2_FORM_2 || rec[i].count == 0 ||
+                    ecm_map_append(map, rec[i].type, le32toh(rec[i].count),
+                                   0)) {
+                        errno = EINVAL;
+                        goto failed;
+                }
+        }
+        map->raw_size = le64toh(hdr.raw_size);
+        map->edc = le32toh(hdr.edc);
+        if ((count ? map->runs[map->count - 1].raw +
+             ecm_run_raw_size(&map->runs[map->count - 1]) : 0)
+            != map->raw_size) {
+                errno = EINVAL;
+                goto failed;
+        }
+        free(rec);
+        return map;
+
+failed:
+        free(rec);
+        ecm_map_free(map);
+        return NULL;
+}
+
+off_t ecm_map_raw_size(struct ecm_map *map)
+{
+        return map->raw_size;
+}
+
+/* the header, the runs, the end tag and the EDC */
+off_t ecm_map_size(struct ecm_map *map)
+{
+        return map->end + 5 + 4;
+}
+
+/* Find the run that byte 'pos' of the .ecm belongs to */
+static struct ecm_run *ecm_map_find(struct ecm_map *map, off_t pos)
+{
+        size_t lo = 0, hi = map->count;
+
+        while (hi - lo > 1) {
+                size_t mid = (lo + hi) / 2;
+
+                if (map->runs[mid].pos <= pos) {
+                        lo = mid;
+                } else {
+                        hi = mid;
+                }
+        }
+        return &map->runs[lo];
+}
+
+/* Produce up to 'len' bytes of a run starting 'rel' bytes into it.
+ * Returns the number of bytes produced or -1.
+ */
+static ssize_t ecm_map_read_run(struct ecm_run *run, int fd, char *buf,
+                                off_t rel, size_t len, uint8_t *sectors)
+{
+        uint8_t unit[1 + 16 + 1 + 0x918];
+        size_t prefix = ecm_run_prefix(run);
+        size_t unit_size = ecm_unit_size(run->type);
+        size_t skip, n = 0;
+        off_t first, count, i;
+
+        if (rel < (off_t)prefix) {
+                ecm_write_tag(unit, run->type, run->count - 1);
+                n = prefix - rel;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(buf, unit + rel, n);
+                return n;
+        }
+        rel -= prefix;
+
+        if (run->type == BLOCK_BYTES) {
+                n = run->count - rel;
+                if (n > len) {
+                        n = len;
+                }
+                if (pread(fd, buf, n, run->raw + rel) != (ssize_t)n) {
+                        return -1;
+                }
+                return n;
+        }
+
+        first = rel / unit_size;
+        skip = rel % unit_size;
+        count = (skip + len + unit_size - 1) / unit_size;
+        if (count > run->count - first) {
+                count = run->count - first;
+        }
+        if (count > MAP_READ_SECTORS) {
+                count = MAP_READ_SECTORS;
+        }
+        if (pread(fd, sectors, count * BIN_BLOCK_SIZE,
+                  run->raw + first * BIN_BLOCK_SIZE) !=
+            count * BIN_BLOCK_SIZE) {
+                return -1;
+        }
+        for (i = 0; i < count && n < len; i++) {
+                size_t c = unit_size - skip;
+
+                if (c > len - n) {
+                        c = len - n;
+                }
+                ecm_encode_unit(run->type, sectors + i * BIN_BLOCK_SIZE,
+                                unit);
+                memcpy(buf + n, unit + skip, c);
+                n += c;
+                skip = 0;
+        }
+        return n;
+}
+
+ssize_t ecm_map_read(struct ecm_map *map, int fd, char *buf, off_t offset,
+                     size_t len)
+{
+        uint8_t trailer[5 + 4], *sectors = NULL;
+        off_t size = ecm_map_size(map);
+        ssize_t total = 0, n;
+
+        if (offset >= size) {
+                return 0;
+        }
+        if (len > size - offset) {
+                len = size - offset;
+        }
+
+        while (len) {
+                if (offset < 4) {
+                        n = 4 - offset;
+                        if (n > (ssize_t)len) {
+                                n = len;
+                        }
+                        memcpy(buf, "ECM" + offset, n);
+                } else if (offset >= map->end) {
+                        ecm_map_trailer(map, trailer);
+                        n = len;
+                        memcpy(buf, trailer + offset - map->end, n);
+                } else {
+                        struct ecm_run *run = ecm_map_find(map, offset);
+
+                        if (sectors == NULL) {
+                                sectors = malloc(MAP_READ_SECTORS *
+                                                 BIN_BLOCK_SIZE);
+                                if (sectors == NULL) {
+                                        return -1;
+                                }
+                        }
+                        n = ecm_map_read_run(run, fd, buf,
+                                             offset - run->pos, len, sectors);
+                        if (n <= 0) {
+                                free(sectors);
+                                errno = EIO;
+                                return -1;
+                        }
+                }
+                buf    += n;
+                offset += n;
+                total  += n;
+                len    -= n;
+        }
+        free(sectors);
+        return total;
+}
+
+uint8_t *ecm_map_index(struct ecm_map *map, size_t *len)
+{
+        struct ecm_index idx = { NULL, 8, 0, 0, 0 };
+        uint32_t entries;
+        size_t r;
+
+        if (ecm_index_add(&idx, 0, 0, 4)) {
+                goto failed;
+        }
+        for (r = 0; r < map->count; r++) {
+                struct ecm_run *run = &map->runs[r];
+                size_t unit = ecm_unit_size(run->type);
+                uint32_t i;
+
+                if (run->type == BLOCK_BYTES || run->type == BLOCK_MODE_1) {
+                        if (ecm_index_add(&idx, run->raw,
+                                          ecm_run_raw_size(run), run->pos)) {
+                                goto failed;
+                        }
+                        continue;
+                }
+                for (i = 0; i < run->count; i++) {
+                        off_t upos = run->raw + (off_t)i * BIN_BLOCK_SIZE;
+                        off_t cpos = run->pos + (off_t)i * unit;
+
+                        if (ecm_index_add(&idx, upos, 16, cpos) ||
+                            ecm_index_add(&idx, upos + 16,
+                                          BIN_BLOCK_SIZE - 16,
+                                          cpos + 1 + 16)) {
+                                goto failed;
+                        }
+                }
+        }
+        entries = htole32(idx.entries);
+        memcpy(idx.buf, &entries, 4);
+        memset(idx.buf + 4, 0, 4);
+        *len = idx.len;
+        return idx.buf;
+
+failed:
+        free(idx.buf);
+        errno = ENOMEM;
+        return NULL;
 }
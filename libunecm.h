@@ -1,6 +1,99 @@
 /* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+ * libunecm, random access to the raw image inside an ECM file.
+ *
+ * A struct ecm holds no position of its own, so one handle can be read
+ * from by any number of threads at once. The ecm_set_*() calls are the
+ * exception, make them before the handle is shared.
+ *
+ * Build with -D_FILE_OFFSET_BITS=64 on 32 bit hosts, off_t is part of the
+ * interface.
+ */
+#ifndef _LIBUNECM_H_
+#define _LIBUNECM_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ecm;
+
+/* <file>.ecm, or <file>.ecm.gz / .zst, and its <file>.ecm.edi index */
 struct ecm *ecm_open_file(int dir_fd, const char *file);
+/* 'fd' stays the caller's, without an index, idx_fd -1, the tags of the
+ * whole file are walked at open
+ */
+struct ecm *ecm_open_fd(int fd, int idx_fd);
+/* uncompressed ECM data that must stay valid until ecm_close_file(),
+ * 'edi' may be NULL as above
+ */
+struct ecm *ecm_open_mem(const void *data, size_t len, const void *edi,
+                         size_t edi_len);
 void ecm_close_file(struct ecm *e);
 ssize_t ecm_read(struct ecm *ecm, char *buf, off_t offset, size_t len);
-size_t ecm_get_file_size(struct ecm *ecm);
+off_t ecm_get_file_size(struct ecm *ecm);
+
+/* one range of ecm_readv(), 'result' is what ecm_read() would return */
+struct ecm_iovec {
+        void *buf;
+        off_t offset;
+        size_t len;
+        ssize_t result;
+};
+
+/* Reads all ranges in the same batches, returns 0 or -1 and errno */
+int ecm_readv(struct ecm *ecm, struct ecm_iovec *iov, int iovcnt);
+
+struct ecm_stats {
+        uint64_t reads;         /* ecm_read() calls and ecm_readv() ranges */
+        uint64_t bytes;         /* returned by them */
+        uint64_t shared;        /* served by a read of another handle */
+        uint64_t errors;
+        uint64_t sectors;       /* regenerated */
+        uint64_t ecm_reads;     /* of the ECM data */
+        uint64_t ecm_bytes;
+        uint64_t cache_hits;    /* of the direct I/O or container blocks */
+        uint64_t cache_misses;
+};
+
+void ecm_get_stats(struct ecm *ecm, struct ecm_stats *stats);
+
+int ecm_set_io_uring(struct ecm *ecm, int entries);
+int ecm_set_direct_io(struct ecm *ecm, int blocks);
+/* number of decompressed blocks kept of a .gz or .zst, 8 by default */
+int ecm_set_cache(struct ecm *ecm, int blocks);
+int ecm_set_decode_threads(int threads);
+
+int ecm_cooked_offset(struct ecm *ecm);
+off_t ecm_get_cooked_size(struct ecm *ecm);
+ssize_t ecm_read_cooked(struct ecm *ecm, char *buf, off_t offset, size_t len);
+
+#define ECM_VERIFY_OK           0
+#define ECM_VERIFY_READ_ERROR   1
+#define ECM_VERIFY_EDC_MISMATCH 2
+#define ECM_VERIFY_NO_MEMORY    3
+
+int ecm_verify(struct ecm *ecm, int threads, off_t *offset);
+
+/* encoding raw images, see ecm_map_build() */
+struct ecm_map;
+
+struct ecm_map *ecm_map_build(int fd, int threads);
+struct ecm_map *ecm_encode(int fd, int ecm_fd, int threads);
+struct ecm_map *ecm_map_load(int fd);
+int ecm_map_save(struct ecm_map *map, int fd);
+void ecm_map_free(struct ecm_map *map);
+off_t ecm_map_raw_size(struct ecm_map *map);
+off_t ecm_map_size(struct ecm_map *map);
+ssize_t ecm_map_read(struct ecm_map *map, int fd, char *buf, off_t offset,
+                     size_t len);
+uint8_t *ecm_map_index(struct ecm_map *map, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBUNECM_H_ */
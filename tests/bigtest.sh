@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# Stress test on a synthetic image of more than 4 GiB, see ecm-bigtest.c.
+# The ECM file is sparse and takes less than a MB of disk, the run takes
+# some seconds.
+#
+#   tests/bigtest.sh [<scratch directory>]
+#
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+dir=$(mktemp -d "${1:-${TMPDIR:-/tmp}}/ecm-bigtest.XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+gcc -o "$dir/unecm" "$src/unecm.c" -lpthread
+gcc -o "$dir/ecm-index" "$src/ecm-index.c" "$src/libunecm.c" -lpthread -lz
+gcc -I"$src" -o "$dir/ecm-bigtest" "$src/tests/ecm-bigtest.c" \
+    "$src/libunecm.c" -lpthread -lz
+
+"$dir/ecm-bigtest" gen "$dir"
+"$dir/unecm" "$dir/small.ecm" >/dev/null 2>&1
+"$dir/ecm-index" "$dir/big.ecm" >/dev/null
+"$dir/ecm-bigtest" check "$dir"
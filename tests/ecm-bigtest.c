@@ -0,0 +1,390 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/***************************************************************************/
+/*
+ * Stress test of libunecm and ecm-index on an image larger than 4 GiB,
+ * run by tests/bigtest.sh.
+ *
+ *   ecm-bigtest gen <dir>     writes <dir>/big.ecm and <dir>/small.ecm
+ *   ecm-bigtest check <dir>   checks <dir>/big.ecm against <dir>/small
+ *
+ * big.ecm is a Mode 1 run that crosses 4 GiB, then a run of raw bytes that
+ * ends past 6 GiB, then a tail of Mode 2 Form 1 and Form 2 sectors and raw
+ * bytes. The payloads of the first two runs are zero and left as holes, so
+ * the file takes almost no space. small.ecm is one such Mode 1 sector and
+ * the same tail, and unecm decodes it to 'small', from which every byte of
+ * the big image is known without decoding all of it.
+ *
+ * The check compares the .edi written by ecm-index with one worked out
+ * here, the size, random reads and reads around the run boundaries and
+ * 4 GiB, both through the .edi and through an index built at open.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libunecm.h"
+
+#define MODE_1_SECTORS 2000000                  /* 4.7 GB */
+#define RAW_BYTES      2000000000u
+#define TAIL_SECTORS   8
+#define TAIL_BYTES     1000
+#define READS          20000
+
+/* tags of a run, and where its payload is */
+struct run {
+        uint8_t type;
+        uint32_t count;
+        off_t upos;
+        off_t cpos;             /* of the tag */
+};
+
+static struct run runs[4 + 4 * TAIL_SECTORS];
+static int nruns;
+
+static off_t big_size;          /* unpacked */
+static off_t head_size;         /* unpacked size of the two long runs */
+
+static int write_tag(int fd, off_t *pos, uint8_t type, uint32_t count)
+{
+        uint8_t tag[5];
+        uint32_t num = count - 1;
+        int n = 0;
+
+        tag[n] = type | (num & 0x1F) << 2;
+        num >>= 5;
+        while (num) {
+                tag[n++] |= 0x80;
+                tag[n] = num & 0x7F;
+                num >>= 7;
+        }
+        n++;
+        if (fd != -1 && pwrite(fd, tag, n, *pos) != n) {
+                return -1;
+        }
+        *pos += n;
+        return 0;
+}
+
+static off_t payload_size(uint8_t type, uint32_t count)
+{
+        static const off_t size[4] = { 1, 0x803, 0x804, 0x918 };
+
+        return size[type] * count;
+}
+
+static off_t unpacked_size(uint8_t type, uint32_t count)
+{
+        static const off_t size[4] = { 1, 2352, 2336, 2336 };
+
+        return size[type] * count;
+}
+
+/* Add a run with a payload of 'data', or of zeros left as a hole. With
+ * 'fd' -1 nothing is written, only the runs are noted.
+ */
+static int add_run(int fd, off_t *pos, off_t *upos, uint8_t type,
+                   uint32_t count, const uint8_t *data)
+{
+        off_t len = payload_size(type, count);
+
+        runs[nruns].type = type;
+        runs[nruns].count = count;
+        runs[nruns].upos = *upos;
+        runs[nruns].cpos = *pos;
+        nruns++;
+        if (write_tag(fd, pos, type, count)) {
+                return -1;
+        }
+        if (fd != -1 && data && pwrite(fd, data, len, *pos) != len) {
+                return -1;
+        }
+        *pos += len;
+        *upos += unpacked_size(type, count);
+        return 0;
+}
+
+/* The Mode 2 sectors and raw bytes at the end of both images */
+static int add_tail(int fd, off_t *pos, off_t *upos)
+{
+        uint8_t header[16], payload[0x918], bytes[TAIL_BYTES];
+        int i, j;
+
+        for (i = 0; i < TAIL_SECTORS; i++) {
+                uint8_t type = i & 1 ? 3 : 2;
+
+                memset(header, 0xFF, 12);
+                header[0] = header[11] = 0;
+                header[12] = i;
+                header[13] = 2;
+                header[14] = 0;
+                header[15] = 2;
+                for (j = 0; j < 0x918; j++) {
+                        payload[j] = i * 7 + j;
+                }
+                if (add_run(fd, pos, upos, 0, 16, header) ||
+                    add_run(fd, pos, upos, type, 1, payload)) {
+                        return -1;
+                }
+        }
+        for (j = 0; j < TAIL_BYTES; j++) {
+                bytes[j] = j * 13;
+        }
+        return add_run(fd, pos, upos, 0, TAIL_BYTES, bytes);
+}
+
+static int write_end(int fd, off_t *pos)
+{
+        /* the end tag, then an EDC that is not checked, ecm-index -v
+         * would report it
+         */
+        if (write_tag(fd, pos, 0, 0) ||
+            pwrite(fd, "\0\0\0\0", 4, *pos) != 4) {
+                return -1;
+        }
+        *pos += 4;
+        return 0;
+}
+
+static int gen_image(const char *dir, const char *name, int big)
+{
+        char path[4096];
+        off_t pos = 4, upos = 0;
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+        if (fd == -1 || pwrite(fd, "ECM", 4, 0) != 4) {
+                perror(path);
+                return -1;
+        }
+        nruns = 0;
+        if (add_run(fd, &pos, &upos, 1, big ? MODE_1_SECTORS : 1, NULL) ||
+            (big && add_run(fd, &pos, &upos, 0, RAW_BYTES, NULL)) ||
+            add_tail(fd, &pos, &upos) || write_end(fd, &pos) || close(fd)) {
+                perror(path);
+                return -1;
+        }
+        return 0;
+}
+
+/* big.ecm, without writing it, to know its runs and sizes */
+static void layout(void)
+{
+        off_t pos = 4, upos = 0;
+
+        nruns = 0;
+        add_run(-1, &pos, &upos, 1, MODE_1_SECTORS, NULL);
+        add_run(-1, &pos, &upos, 0, RAW_BYTES, NULL);
+        head_size = upos;
+        add_tail(-1, &pos, &upos);
+        big_size = upos;
+}
+
+/* The .edi as ecm-index has to write it */
+static uint8_t *expected_index(size_t *len)
+{
+        uint64_t *idx;
+        uint32_t n = 1;
+        off_t next = 65536;
+        int r;
+
+        idx = malloc((big_size / 65536 + 2) * 16 + 8);
+        if (idx == NULL) {
+                return NULL;
+        }
+        idx[1] = htole64(0);
+        idx[2] = htole64(4);
+        for (r = 0; r < nruns; r++) {
+                off_t end = runs[r].upos +
+                        unpacked_size(runs[r].type, runs[r].count);
+
+                while (end > next) {
+                        idx[1 + 2 * n] = htole64(runs[r].upos);
+                        idx[2 + 2 * n] = htole64(runs[r].cpos);
+                        n++;
+                        next += 65536;
+                }
+        }
+        n = htole32(n);
+        memcpy(idx, &n, 4);
+        memset((uint8_t *)idx + 4, 0, 4);
+        *len = 8 + 16 * (size_t)le32toh(n);
+        return (uint8_t *)idx;
+}
+
+static uint8_t *read_file(const char *dir, const char *name, size_t *len)
+{
+        char path[4096];
+        struct stat st;
+        uint8_t *buf;
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        fd = open(path, O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) ||
+            (buf = malloc(st.st_size + 1)) == NULL ||
+            pread(fd, buf, st.st_size, 0) != st.st_size) {
+                perror(path);
+                exit(1);
+        }
+        close(fd);
+        *len = st.st_size;
+        return buf;
+}
+
+static const uint8_t *small;
+
+/* byte 'o' of the big image */
+static uint8_t expected(off_t o)
+{
+        if (o < (off_t)2352 * MODE_1_SECTORS) {
+                return small[o % 2352];
+        }
+        if (o < head_size) {
+                return 0;
+        }
+        return small[2352 + (o - head_size)];
+}
+
+static int check_read(struct ecm *ecm, const char *what, off_t offset,
+                      size_t len)
+{
+        static uint8_t buf[65536];
+        ssize_t n, want;
+        size_t i;
+
+        want = offset >= big_size ? 0 :
+                (off_t)len > big_size - offset ? big_size - offset :
+                (ssize_t)len;
+        n = ecm_read(ecm, (char *)buf, offset, len);
+        if (n != want) {
+                printf("%s: read of %zu at %jd returned %zd, not %zd\n",
+                       what, len, (intmax_t)offset, n, want);
+                return 1;
+        }
+        for (i = 0; i < (size_t)n; i++) {
+                if (buf[i] != expected(offset + i)) {
+                        printf("%s: wrong data at %jd\n", what,
+                               (intmax_t)(offset + i));
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+static int check_reads(struct ecm *ecm, const char *what)
+{
+        off_t edges[] = {
+                0, 0x100000000LL, (off_t)2352 * MODE_1_SECTORS,
+                head_size, big_size
+        };
+        unsigned seed = 1;
+        int i, bad = 0;
+
+        if (ecm_get_file_size(ecm) != big_size) {
+                printf("%s: size is %jd, not %jd\n", what,
+                       (intmax_t)ecm_get_file_size(ecm),
+                       (intmax_t)big_size);
+                return 1;
+        }
+        for (i = 0; i < (int)(sizeof(edges) / sizeof(edges[0])); i++) {
+                bad += check_read(ecm, what,
+                                  edges[i] > 5000 ? edges[i] - 5000 : 0,
+                                  10000);
+                bad += check_read(ecm, what, edges[i], 1);
+        }
+        for (i = 0; i < READS && bad < 10; i++) {
+                off_t offset = (off_t)((double)rand_r(&seed) / RAND_MAX *
+                                       (big_size + 1000));
+
+                bad += check_read(ecm, what, offset,
+                                  1 + rand_r(&seed) % 65536);
+        }
+        return bad;
+}
+
+static int check(const char *dir)
+{
+        char path[4096];
+        uint8_t *edi, *want;
+        size_t len, want_len, small_len;
+        struct ecm *ecm;
+        int fd, bad = 0;
+
+        layout();
+        small = read_file(dir, "small", &small_len);
+        if (small_len != 2352 + big_size - head_size) {
+                printf("small is %zu bytes, not %jd\n", small_len,
+                       (intmax_t)(2352 + big_size - head_size));
+                return 1;
+        }
+
+        edi = read_file(dir, "big.ecm.edi", &len);
+        want = expected_index(&want_len);
+        if (len != want_len || memcmp(edi, want, len)) {
+                printf("big.ecm.edi is not what it should be\n");
+                bad++;
+        }
+        free(edi);
+        free(want);
+
+        ecm = ecm_open_file(open(dir, O_DIRECTORY), "big.ecm");
+        if (ecm == NULL) {
+                printf("Failed to open big.ecm\n");
+                return 1;
+        }
+        bad += check_reads(ecm, "big.ecm");
+        ecm_close_file(ecm);
+
+        snprintf(path, sizeof(path), "%s/big.ecm", dir);
+        fd = open(path, O_RDONLY);
+        ecm = ecm_open_fd(fd, -1);
+        if (ecm == NULL) {
+                printf("Failed to open big.ecm without an index\n");
+                return 1;
+        }
+        bad += check_reads(ecm, "big.ecm without .edi");
+        ecm_close_file(ecm);
+        close(fd);
+
+        printf("%s: %jd bytes, %s\n", path, (intmax_t)big_size,
+               bad ? "FAILED" : "OK");
+        return bad != 0;
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc == 3 && !strcmp(argv[1], "gen")) {
+                return gen_image(argv[2], "big.ecm", 1) ||
+                        gen_image(argv[2], "small.ecm", 0);
+        }
+        if (argc == 3 && !strcmp(argv[1], "check")) {
+                return check(argv[2]);
+        }
+        printf("Usage: ecm-bigtest gen|check <directory>\n");
+        return 1;
+}
@@ -26,12 +26,19 @@
 ** - No assumptions about byte order
 ** - No assumptions about struct packing
 ** - No unaligned memory access
+** - The parallel decoder (-j) needs POSIX threads and pread()/pwrite()
 */
 /***************************************************************************/
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /***************************************************************************/
 
@@ -74,7 +81,7 @@ static void eccedc_init(void) {
 ecc_uint32 edc_partial_computeblock(
         ecc_uint32  edc,
   const ecc_uint8  *src,
-        ecc_uint16  size
+        ecc_uint32  size
 ) {
   while(size--) edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
   return edc;
@@ -194,17 +201,317 @@ void setcounter(unsigned long n) {
   mycounter = n;
 }
 
-int unecmify(
-  FILE *in,
-  FILE *out
+/***************************************************************************/
+/*
+** Combine the EDCs of two consecutive blocks: edc1 is the EDC of the first
+** block, edc2 that of the second block computed starting from zero, and len2
+** the length of the second block. Same approach as zlib's crc32_combine().
+*/
+static ecc_uint32 gf2_matrix_times(ecc_uint32 *mat, ecc_uint32 vec) {
+  ecc_uint32 sum = 0;
+  while(vec) {
+    if(vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(ecc_uint32 *square, ecc_uint32 *mat) {
+  int n;
+  for(n = 0; n < 32; n++) square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+ecc_uint32 edc_combine(
+  ecc_uint32    edc1,
+  ecc_uint32    edc2,
+  unsigned long len2
+) {
+  ecc_uint32 even[32]; /* even-power-of-two zeros operator */
+  ecc_uint32 odd[32];  /* odd-power-of-two zeros operator */
+  ecc_uint32 row;
+  int n;
+  if(!len2) return edc1;
+  /* Operator for one zero bit in odd */
+  odd[0] = 0xD8018001;
+  row = 1;
+  for(n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  /* Operator for two zero bits in even, four zero bits in odd */
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+  /* Apply len2 zeros to edc1, first square will put the operator for one
+  ** zero byte, eight zero bits, in even */
+  do {
+    gf2_matrix_square(even, odd);
+    if(len2 & 1) edc1 = gf2_matrix_times(even, edc1);
+    len2 >>= 1;
+    if(!len2) break;
+    gf2_matrix_square(odd, even);
+    if(len2 & 1) edc1 = gf2_matrix_times(odd, edc1);
+    len2 >>= 1;
+  } while(len2);
+  return edc1 ^ edc2;
+}
+
+/***************************************************************************/
+/*
+** Regenerate one sector of the given type from its ECM payload.
+** Writes the decoded bytes to out and returns how many were written.
+*/
+unsigned decode_sector(
+        unsigned   type,
+  const ecc_uint8 *in,
+        ecc_uint8 *out
+) {
+  ecc_uint8 sector[2352];
+  memset(sector, 0, sizeof(sector));
+  memset(sector + 1, 0xFF, 10);
+  switch(type) {
+  case 1:
+    sector[0x0F] = 0x01;
+    memcpy(sector + 0x00C, in, 0x003);
+    memcpy(sector + 0x010, in + 0x003, 0x800);
+    eccedc_generate(sector, 1);
+    memcpy(out, sector, 2352);
+    return 2352;
+  case 2:
+    sector[0x0F] = 0x02;
+    memcpy(sector + 0x014, in, 0x804);
+    memcpy(sector + 0x010, in, 4);
+    eccedc_generate(sector, 2);
+    memcpy(out, sector + 0x10, 2336);
+    return 2336;
+  case 3:
+    sector[0x0F] = 0x02;
+    memcpy(sector + 0x014, in, 0x918);
+    memcpy(sector + 0x010, in, 4);
+    eccedc_generate(sector, 3);
+    memcpy(out, sector + 0x10, 2336);
+    return 2336;
+  }
+  return 0;
+}
+
+/* Size of one sector of each type in the ECM file and in the output */
+static const unsigned ecm_sector_size[4] = { 1, 0x803, 0x804, 0x918 };
+static const unsigned bin_sector_size[4] = { 1, 2352, 2336, 2336 };
+
+/***************************************************************************/
+/*
+** Write n bytes at offset. With sparse set, aligned SPARSE_BLOCK sized
+** blocks that are all zero are not written, leaving a hole in the file.
+** The caller has to extend the file to its final size with ftruncate().
+*/
+#define SPARSE_BLOCK 4096
+
+static int is_zero(const ecc_uint8 *p, size_t n) {
+  while(n--) if(*p++) return 0;
+  return 1;
+}
+
+static int pwrite_sparse(
+  int              fd,
+  const ecc_uint8 *p,
+  size_t           n,
+  off_t            offset,
+  int              sparse
+) {
+  while(n) {
+    size_t b = n;
+    ssize_t c;
+    if(sparse) {
+      /* split at SPARSE_BLOCK boundaries of the output file */
+      b = SPARSE_BLOCK - (offset % SPARSE_BLOCK);
+      if(b > n) b = n;
+    }
+    if(sparse && b == SPARSE_BLOCK && is_zero(p, b)) {
+      c = b;
+    } else {
+      c = pwrite(fd, p, b, offset);
+      if(c <= 0) return -1;
+    }
+    p += c;
+    n -= c;
+    offset += c;
+  }
+  return 0;
+}
+
+/***************************************************************************/
+/*
+** Parallel decoding
+**
+** The tag stream is pre-scanned, reading only the tag bytes and seeking
+** over the payload, and cut into chunks of at most CHUNK_SECTORS sectors.
+** Worker threads then decode the chunks independently, with pread() and
+** one large pwrite() per chunk at the offsets found during the scan.
+** Each chunk records the EDC of its own output and the whole-file EDC is
+** put back together in order with edc_combine() at the end.
+*/
+#define CHUNK_SECTORS 448
+
+struct chunk {
+  off_t in;       /* offset of the payload in the .ecm file */
+  off_t out;      /* offset of the decoded data in the output file */
+  unsigned type;
+  unsigned num;   /* number of sectors, or bytes for type 0 */
+  ecc_uint32 edc; /* EDC of this chunk alone */
+  int error;
+  int err;        /* errno of a failed write */
+};
+
+struct job {
+  int fdin;
+  int fdout;
+  int sparse;
+  struct chunk *chunks;
+  unsigned nchunks;
+  unsigned next;
+  off_t done;
+  pthread_mutex_t mutex;
+};
+
+/*
+** Scan the tags of the file and split it into chunks.
+** On success returns the number of chunks, and the offset of the trailing
+** EDC and the total output size through trailer and total.
+*/
+static long prescan(
+  FILE          *in,
+  struct chunk **chunks,
+  off_t         *trailer,
+  off_t         *total
 ) {
-  unsigned checkedc = 0;
-  unsigned char sector[2352];
+  struct chunk *c = NULL;
+  unsigned long n = 0, max = 0;
   unsigned type;
   unsigned num;
-  fseek(in, 0, SEEK_END);
-  resetcounter(ftell(in));
-  fseek(in, 0, SEEK_SET);
+  off_t out = 0;
+  fseeko(in, 4, SEEK_SET);
+  for(;;) {
+    int ch = fgetc(in);
+    int bits = 5;
+    if(ch == EOF) goto uneof;
+    type = ch & 3;
+    num = (ch >> 2) & 0x1F;
+    while(ch & 0x80) {
+      ch = fgetc(in);
+      if(ch == EOF) goto uneof;
+      num |= ((unsigned)(ch & 0x7F)) << bits;
+      bits += 7;
+    }
+    if(num == 0xFFFFFFFF) break;
+    num++;
+    if(num >= 0x80000000) goto corrupt;
+    while(num) {
+      unsigned b = num;
+      unsigned max_num = type ? CHUNK_SECTORS : CHUNK_SECTORS * 2352;
+      if(b > max_num) b = max_num;
+      if(n == max) {
+        struct chunk *m;
+        max = max ? 2 * max : 1024;
+        m = realloc(c, max * sizeof(struct chunk));
+        if(!m) goto nomem;
+        c = m;
+      }
+      c[n].in = ftello(in);
+      c[n].out = out;
+      c[n].type = type;
+      c[n].num = b;
+      c[n].edc = 0;
+      c[n].error = 0;
+      c[n].err = 0;
+      n++;
+      out += (off_t)bin_sector_size[type] * b;
+      if(fseeko(in, (off_t)ecm_sector_size[type] * b, SEEK_CUR)) goto uneof;
+      num -= b;
+    }
+  }
+  *chunks = c;
+  *trailer = ftello(in);
+  *total = out;
+  return n;
+nomem:
+  fprintf(stderr, "Out of memory!\n");
+  free(c);
+  return -2;
+uneof:
+  fprintf(stderr, "Unexpected EOF!\n");
+corrupt:
+  free(c);
+  return -1;
+}
+
+static void *decode_worker(void *arg) {
+  struct job *job = arg;
+  /* a raw chunk is as long as a decoded one, and longer than any payload */
+  ecc_uint8 *inbuf = malloc(CHUNK_SECTORS * 2352);
+  ecc_uint8 *outbuf = malloc(CHUNK_SECTORS * 2352);
+  /* the chunks are left to the other workers, if there are any */
+  if(!inbuf || !outbuf) goto done;
+  for(;;) {
+    struct chunk *c;
+    size_t inlen, outlen = 0;
+    unsigned i;
+    pthread_mutex_lock(&job->mutex);
+    if(job->next == job->nchunks) {
+      pthread_mutex_unlock(&job->mutex);
+      break;
+    }
+    c = &job->chunks[job->next++];
+    pthread_mutex_unlock(&job->mutex);
+
+    inlen = (size_t)ecm_sector_size[c->type] * c->num;
+    if(pread(job->fdin, inbuf, inlen, c->in) != (ssize_t)inlen) {
+      c->error = 1;
+      continue;
+    }
+    if(!c->type) {
+      memcpy(outbuf, inbuf, inlen);
+      outlen = inlen;
+    } else {
+      for(i = 0; i < c->num; i++) {
+        outlen += decode_sector(
+          c->type, inbuf + i * ecm_sector_size[c->type], outbuf + outlen
+        );
+      }
+    }
+    c->edc = edc_partial_computeblock(0, outbuf, outlen);
+    if(pwrite_sparse(job->fdout, outbuf, outlen, c->out, job->sparse)) {
+      c->err = errno;
+      c->error = 2;
+      continue;
+    }
+    pthread_mutex_lock(&job->mutex);
+    job->done += inlen;
+    setcounter(job->done);
+    pthread_mutex_unlock(&job->mutex);
+  }
+done:
+  free(inbuf);
+  free(outbuf);
+  return NULL;
+}
+
+int unecmify_parallel(
+  FILE *in,
+  FILE *out,
+  int   nthreads,
+  int   sparse
+) {
+  struct job job;
+  pthread_t *threads;
+  ecc_uint32 checkedc = 0;
+  unsigned char trailer[4];
+  off_t trailer_pos, total;
+  long n;
+  int i;
+  fseeko(in, 0, SEEK_END);
+  resetcounter(ftello(in));
+  fseeko(in, 0, SEEK_SET);
   if(
     (fgetc(in) != 'E') ||
     (fgetc(in) != 'C') ||
@@ -214,14 +521,251 @@ int unecmify(
     fprintf(stderr, "Header not found!\n");
     goto corrupt;
   }
+  n = prescan(in, &job.chunks, &trailer_pos, &total);
+  if(n == -2) return 1;
+  if(n < 0) goto corrupt;
+  job.fdin = fileno(in);
+  job.fdout = fileno(out);
+  job.sparse = sparse;
+  job.nchunks = n;
+  job.next = 0;
+  job.done = 0;
+  pthread_mutex_init(&job.mutex, NULL);
+
+  threads = malloc(nthreads * sizeof(pthread_t));
+  i = 0;
+  while(threads && i < nthreads) {
+    if(pthread_create(&threads[i], NULL, decode_worker, &job)) break;
+    i++;
+  }
+  if(!i) decode_worker(&job);
+  while(i--) pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_mutex_destroy(&job.mutex);
+
+  /* every worker failed to get its buffers */
+  if(job.next != job.nchunks) {
+    fprintf(stderr, "Out of memory!\n");
+    free(job.chunks);
+    return 1;
+  }
+  for(i = 0; i < n; i++) {
+    if(job.chunks[i].error == 2) {
+      errno = job.chunks[i].err;
+      perror("write");
+      free(job.chunks);
+      return 1;
+    }
+    if(job.chunks[i].error) {
+      free(job.chunks);
+      goto uneof;
+    }
+    checkedc = edc_combine(
+      checkedc,
+      job.chunks[i].edc,
+      (unsigned long)bin_sector_size[job.chunks[i].type] * job.chunks[i].num
+    );
+  }
+  free(job.chunks);
+  if(sparse && ftruncate(job.fdout, total)) {
+    perror("write");
+    return 1;
+  }
+
+  if(pread(fileno(in), trailer, 4, trailer_pos) != 4) goto uneof;
+  fprintf(stderr, "Decoded %ld bytes -> %ld bytes\n",
+    (long)trailer_pos + 4, (long)total);
+  if(
+    (trailer[0] != ((checkedc >>  0) & 0xFF)) ||
+    (trailer[1] != ((checkedc >>  8) & 0xFF)) ||
+    (trailer[2] != ((checkedc >> 16) & 0xFF)) ||
+    (trailer[3] != ((checkedc >> 24) & 0xFF))
+  ) {
+    fprintf(stderr, "EDC error (%08X, should be %02X%02X%02X%02X)\n",
+      checkedc,
+      trailer[3],
+      trailer[2],
+      trailer[1],
+      trailer[0]
+    );
+    goto corrupt;
+  }
+  fprintf(stderr, "Done; file is OK\n");
+  return 0;
+uneof:
+  fprintf(stderr, "Unexpected EOF!\n");
+corrupt:
+  fprintf(stderr, "Corrupt ECM file!\n");
+  return 1;
+}
+
+/***************************************************************************/
+/*
+** Buffered I/O for the sequential decoder
+**
+** Input is read IOBUF_SIZE bytes at a time into an aligned buffer and the
+** tags and payloads are parsed straight out of it. Output is collected in
+** a second buffer and written out when it is full.
+**
+** When the output is seekable, long runs of raw bytes are copied with
+** copy_file_range() which lets filesystems that support it share or
+** server-side copy the data instead of writing it again, and with -s
+** blocks that are all zero are written with pwrite_sparse().
+*/
+#define IOBUF_SIZE   (1024 * 1024)
+#define COPY_MIN     (64 * 1024)
+
+struct reader {
+  int fd;
+  ecc_uint8 *buf;
+  size_t pos;   /* next unconsumed byte in buf */
+  size_t len;   /* number of valid bytes in buf */
+  off_t offset; /* file offset of buf[len] */
+};
+
+struct writer {
+  int fd;
+  int seekable;
+  int sparse;
+  ecc_uint8 *buf;
+  size_t len;
+  off_t offset; /* file offset of buf[0] */
+};
+
+/*
+** Make sure at least n bytes are available at r->buf + r->pos.
+** Returns the number of bytes available, less than n only at EOF.
+*/
+static size_t reader_fill(struct reader *r, size_t n) {
+  if(r->len - r->pos >= n) return r->len - r->pos;
+  memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+  r->len -= r->pos;
+  r->pos = 0;
+  while(r->len < n) {
+    ssize_t c = read(r->fd, r->buf + r->len, IOBUF_SIZE - r->len);
+    if(c <= 0) break;
+    r->len += c;
+    r->offset += c;
+  }
+  setcounter(r->offset);
+  return r->len;
+}
+
+static int reader_getc(struct reader *r) {
+  if(!reader_fill(r, 1)) return EOF;
+  return r->buf[r->pos++];
+}
+
+static off_t reader_tell(struct reader *r) {
+  return r->offset - (r->len - r->pos);
+}
+
+static int writer_put(struct writer *w, const ecc_uint8 *p, size_t n) {
+  if(!w->seekable) {
+    while(n) {
+      ssize_t c = write(w->fd, p, n);
+      if(c <= 0) return -1;
+      p += c;
+      n -= c;
+      w->offset += c;
+    }
+    return 0;
+  }
+  if(pwrite_sparse(w->fd, p, n, w->offset, w->sparse)) return -1;
+  w->offset += n;
+  return 0;
+}
+
+static int writer_flush(struct writer *w) {
+  size_t len = w->len;
+  w->len = 0;
+  return writer_put(w, w->buf, len);
+}
+
+/*
+** Returns a pointer to room for n bytes in the output buffer.
+** The bytes must be committed by adding n to w->len.
+*/
+static ecc_uint8 *writer_reserve(struct writer *w, size_t n) {
+  if(w->len + n > IOBUF_SIZE) {
+    if(writer_flush(w)) return NULL;
+  }
+  return w->buf + w->len;
+}
+
+/*
+** Write out n raw bytes which are already in the input buffer.
+*/
+static int writer_copy(struct writer *w, struct reader *r, size_t n) {
+  ecc_uint8 *dst;
+  if(
+    w->seekable && n >= COPY_MIN &&
+    !(w->sparse && is_zero(r->buf + r->pos, n))
+  ) {
+    loff_t in = reader_tell(r);
+    loff_t out;
+    if(writer_flush(w)) return -1;
+    out = w->offset;
+    while(n) {
+      ssize_t c = copy_file_range(r->fd, &in, w->fd, &out, n, 0);
+      if(c <= 0) break;
+      n -= c;
+      r->pos += c;
+    }
+    w->offset = out;
+    if(!n) return 0;
+    /* not supported between these files, fall back to writing */
+  }
+  dst = writer_reserve(w, n);
+  if(!dst) return -1;
+  memcpy(dst, r->buf + r->pos, n);
+  w->len += n;
+  r->pos += n;
+  return 0;
+}
+
+int unecmify(
+  FILE *in,
+  FILE *out,
+  int   sparse
+) {
+  ecc_uint32 checkedc = 0;
+  struct reader r;
+  struct writer w;
+  unsigned type;
+  unsigned num;
+  int ret = 1;
+  r.fd = fileno(in);
+  r.pos = r.len = 0;
+  r.offset = 0;
+  w.fd = fileno(out);
+  w.seekable = lseek(w.fd, 0, SEEK_CUR) != -1;
+  w.sparse = sparse && w.seekable;
+  w.len = 0;
+  w.offset = 0;
+  if(
+    posix_memalign((void **)&r.buf, SPARSE_BLOCK, IOBUF_SIZE) ||
+    posix_memalign((void **)&w.buf, SPARSE_BLOCK, IOBUF_SIZE)
+  ) abort();
+  resetcounter(lseek(r.fd, 0, SEEK_END));
+  lseek(r.fd, 0, SEEK_SET);
+  if(
+    (reader_getc(&r) != 'E') ||
+    (reader_getc(&r) != 'C') ||
+    (reader_getc(&r) != 'M') ||
+    (reader_getc(&r) != 0x00)
+  ) {
+    fprintf(stderr, "Header not found!\n");
+    goto corrupt;
+  }
   for(;;) {
-    int c = fgetc(in);
+    int c = reader_getc(&r);
     int bits = 5;
     if(c == EOF) goto uneof;
     type = c & 3;
     num = (c >> 2) & 0x1F;
     while(c & 0x80) {
-      c = fgetc(in);
+      c = reader_getc(&r);
       if(c == EOF) goto uneof;
       num |= ((unsigned)(c & 0x7F)) << bits;
       bits += 7;
@@ -231,80 +775,63 @@ int unecmify(
     if(num >= 0x80000000) goto corrupt;
     if(!type) {
       while(num) {
-        int b = num;
-        if(b > 2352) b = 2352;
-        if(fread(sector, 1, b, in) != b) goto uneof;
-        checkedc = edc_partial_computeblock(checkedc, sector, b);
-        fwrite(sector, 1, b, out);
+        size_t b = reader_fill(&r, num < IOBUF_SIZE ? num : IOBUF_SIZE);
+        if(!b) goto uneof;
+        if(b > num) b = num;
+        checkedc = edc_partial_computeblock(checkedc, r.buf + r.pos, b);
+        if(writer_copy(&w, &r, b)) goto writeerror;
         num -= b;
-        setcounter(ftell(in));
       }
     } else {
+      unsigned insize = ecm_sector_size[type];
+      unsigned outsize = bin_sector_size[type];
       while(num--) {
-        memset(sector, 0, sizeof(sector));
-        memset(sector + 1, 0xFF, 10);
-        switch(type) {
-        case 1:
-          sector[0x0F] = 0x01;
-          if(fread(sector + 0x00C, 1, 0x003, in) != 0x003) goto uneof;
-          if(fread(sector + 0x010, 1, 0x800, in) != 0x800) goto uneof;
-          eccedc_generate(sector, 1);
-          checkedc = edc_partial_computeblock(checkedc, sector, 2352);
-          fwrite(sector, 2352, 1, out);
-          setcounter(ftell(in));
-          break;
-        case 2:
-          sector[0x0F] = 0x02;
-          if(fread(sector + 0x014, 1, 0x804, in) != 0x804) goto uneof;
-          sector[0x10] = sector[0x14];
-          sector[0x11] = sector[0x15];
-          sector[0x12] = sector[0x16];
-          sector[0x13] = sector[0x17];
-          eccedc_generate(sector, 2);
-          checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-          fwrite(sector + 0x10, 2336, 1, out);
-          setcounter(ftell(in));
-          break;
-        case 3:
-          sector[0x0F] = 0x02;
-          if(fread(sector + 0x014, 1, 0x918, in) != 0x918) goto uneof;
-          sector[0x10] = sector[0x14];
-          sector[0x11] = sector[0x15];
-          sector[0x12] = sector[0x16];
-          sector[0x13] = sector[0x17];
-          eccedc_generate(sector, 3);
-          checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-          fwrite(sector + 0x10, 2336, 1, out);
-          setcounter(ftell(in));
-          break;
-        }
+        ecc_uint8 *dst = writer_reserve(&w, outsize);
+        if(!dst) goto writeerror;
+        if(reader_fill(&r, insize) < insize) goto uneof;
+        decode_sector(type, r.buf + r.pos, dst);
+        checkedc = edc_partial_computeblock(checkedc, dst, outsize);
+        w.len += outsize;
+        r.pos += insize;
       }
     }
   }
-  if(fread(sector, 1, 4, in) != 4) goto uneof;
-  fprintf(stderr, "Decoded %ld bytes -> %ld bytes\n", ftell(in), ftell(out));
+  if(writer_flush(&w)) goto writeerror;
+  if(w.sparse && ftruncate(w.fd, w.offset)) goto writeerror;
+  if(reader_fill(&r, 4) < 4) goto uneof;
+  r.pos += 4;
+  fprintf(stderr, "Decoded %ld bytes -> %ld bytes\n",
+    (long)reader_tell(&r), (long)w.offset);
   if(
-    (sector[0] != ((checkedc >>  0) & 0xFF)) ||
-    (sector[1] != ((checkedc >>  8) & 0xFF)) ||
-    (sector[2] != ((checkedc >> 16) & 0xFF)) ||
-    (sector[3] != ((checkedc >> 24) & 0xFF))
+    (r.buf[r.pos - 4] != ((checkedc >>  0) & 0xFF)) ||
+    (r.buf[r.pos - 3] != ((checkedc >>  8) & 0xFF)) ||
+    (r.buf[r.pos - 2] != ((checkedc >> 16) & 0xFF)) ||
+    (r.buf[r.pos - 1] != ((checkedc >> 24) & 0xFF))
   ) {
     fprintf(stderr, "EDC error (%08X, should be %02X%02X%02X%02X)\n",
       checkedc,
-      sector[3],
-      sector[2],
-      sector[1],
-      sector[0]
+      r.buf[r.pos - 1],
+      r.buf[r.pos - 2],
+      r.buf[r.pos - 3],
+      r.buf[r.pos - 4]
     );
     goto corrupt;
   }
   fprintf(stderr, "Done; file is OK\n");
-  return 0;
+  ret = 0;
+  goto done;
+writeerror:
+  perror("write");
+  goto done;
 uneof:
   fprintf(stderr, "Unexpected EOF!\n");
 corrupt:
   fprintf(stderr, "Corrupt ECM file!\n");
-  return 1;
+  writer_flush(&w);
+done:
+  free(r.buf);
+  free(w.buf);
+  return ret;
 }
 
 /***************************************************************************/
@@ -313,6 +840,8 @@ int main(int argc, char **argv) {
   FILE *fin, *fout;
   char *infilename;
   char *outfilename;
+  int nthreads = 1;
+  int sparse = 0;
   banner();
   /*
   ** Initialize the ECC/EDC tables
@@ -321,8 +850,23 @@ int main(int argc, char **argv) {
   /*
   ** Check command line
   */
+  while((argc >= 3) && (argv[1][0] == '-')) {
+    if(!strncmp(argv[1], "-j", 2)) {
+      nthreads = atoi(argv[1] + 2);
+      if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+      if(nthreads <= 0) nthreads = 1;
+    } else if(!strcmp(argv[1], "-s")) {
+      sparse = 1;
+    } else {
+      break;
+    }
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
   if((argc != 2) && (argc != 3)) {
-    fprintf(stderr, "usage: %s ecmfile [outputfile]\n", argv[0]);
+    fprintf(stderr, "usage: %s [-j<threads>] [-s] ecmfile [outputfile]\n",
+      argv[0]);
     return 1;
   }
   /*
@@ -366,7 +910,16 @@ int main(int argc, char **argv) {
   /*
   ** Decode
   */
-  unecmify(fin, fout);
+  if(nthreads > 1 && lseek(fileno(fout), 0, SEEK_CUR) == -1) {
+    /* the chunks are written at their own offsets */
+    fprintf(stderr, "Output is not seekable, decoding with one thread.\n");
+    nthreads = 1;
+  }
+  if(nthreads > 1) {
+    unecmify_parallel(fin, fout, nthreads, sparse);
+  } else {
+    unecmify(fin, fout, sparse);
+  }
   /*
   ** Close everything
   */